@@ -1,17 +1,11 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
-#include <opencv2/cudawarping.hpp>
-#include <cfloat>
-#include <opencv2/cudawarping.hpp>
-#include <opencv2/core/cuda/common.hpp>
-#include <opencv2/core/cuda/border_interpolate.hpp>
-#include <opencv2/core/cuda/vec_traits.hpp>
-#include <opencv2/core/cuda/vec_math.hpp>
 #include <string>
 #include <cmath>
 #include <chrono>  // for high_resolution_clock
 
-#include "helper_math.h"
+#include "cli_options.h"
+#include "device.h"
 
 using namespace std;
 
@@ -24,83 +18,89 @@ enum AnaglyphType {
     OPTIMIZED
 };
 
-__global__ void processKernel(const cv::cuda::PtrStep<uchar3> left_image,
-                              const cv::cuda::PtrStep<uchar3> right_image,
-                              cv::cuda::PtrStep<uchar3> anaglyph_image,
-                              int rows,
-                              int cols,
-                              int anaglyph_type) {
-    const int dst_x = blockIdx.x * blockDim.x + threadIdx.x;
-    const int dst_y = blockIdx.y * blockDim.y + threadIdx.y;
-
-    if (dst_x < cols && dst_y < rows) {
-        uchar3 left_pixel = left_image(dst_y, dst_x);
-        uchar3 right_pixel = right_image(dst_y, dst_x);
-
-        switch (anaglyph_type) {
-            case TRUE:
-                // True Anaglyphs
-                anaglyph_image(dst_y, dst_x) = make_uchar3(
-                    0.299f * right_pixel.z + 0.578f * right_pixel.y + 0.114f * right_pixel.x,
-                    0,
-                    0.299f * left_pixel.z + 0.578f * left_pixel.y + 0.114f * left_pixel.x
-                );
-                break;
-            case GRAY:
-                // Gray Anaglyphs
-                anaglyph_image(dst_y, dst_x) = make_uchar3(
-                    0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
-                    0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
-                    0.299f * left_pixel.x + 0.578f * left_pixel.y + 0.114f * left_pixel.z
-                );
-                break;
-            case COLOR:
-                // Color Anaglyphs
-                anaglyph_image(dst_y, dst_x) = make_uchar3(
-                    right_pixel.x,
-                    right_pixel.y,
-                    left_pixel.z
-                );
-                break;
-            case HALFCOLOR:
-                // Half Color Anaglyphs
-                anaglyph_image(dst_y, dst_x) = make_uchar3(
-                    0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
-                    right_pixel.y,
-                    left_pixel.z
-                );
-                break;
-            case OPTIMIZED:
-                // Optimized Anaglyphs
-                anaglyph_image(dst_y, dst_x) = make_uchar3(
-                    0.7f * right_pixel.y + 0.3f * right_pixel.x,
-                    right_pixel.y,
-                    left_pixel.z
-                );
-                break;
-            default:
-                // No Anaglyphs
-                anaglyph_image(dst_y, dst_x) = left_pixel;
-                break;
+struct ProcessKernel {
+    ImageView<const uchar3> left_image;
+    ImageView<const uchar3> right_image;
+    ImageView<uchar3> anaglyph_image;
+    int rows;
+    int cols;
+    int anaglyph_type;
+
+    DEVICE_FUNC void operator()(const ThreadIndex& t) const {
+        const int dst_x = t.blockIdx.x * t.blockDim.x + t.threadIdx.x;
+        const int dst_y = t.blockIdx.y * t.blockDim.y + t.threadIdx.y;
+
+        if (dst_x < cols && dst_y < rows) {
+            uchar3 left_pixel = left_image(dst_y, dst_x);
+            uchar3 right_pixel = right_image(dst_y, dst_x);
+
+            switch (anaglyph_type) {
+                case TRUE:
+                    // True Anaglyphs
+                    anaglyph_image(dst_y, dst_x) = make_uchar3(
+                        0.299f * right_pixel.z + 0.578f * right_pixel.y + 0.114f * right_pixel.x,
+                        0,
+                        0.299f * left_pixel.z + 0.578f * left_pixel.y + 0.114f * left_pixel.x
+                    );
+                    break;
+                case GRAY:
+                    // Gray Anaglyphs
+                    anaglyph_image(dst_y, dst_x) = make_uchar3(
+                        0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
+                        0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
+                        0.299f * left_pixel.x + 0.578f * left_pixel.y + 0.114f * left_pixel.z
+                    );
+                    break;
+                case COLOR:
+                    // Color Anaglyphs
+                    anaglyph_image(dst_y, dst_x) = make_uchar3(
+                        right_pixel.x,
+                        right_pixel.y,
+                        left_pixel.z
+                    );
+                    break;
+                case HALFCOLOR:
+                    // Half Color Anaglyphs
+                    anaglyph_image(dst_y, dst_x) = make_uchar3(
+                        0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
+                        right_pixel.y,
+                        left_pixel.z
+                    );
+                    break;
+                case OPTIMIZED:
+                    // Optimized Anaglyphs
+                    anaglyph_image(dst_y, dst_x) = make_uchar3(
+                        0.7f * right_pixel.y + 0.3f * right_pixel.x,
+                        right_pixel.y,
+                        left_pixel.z
+                    );
+                    break;
+                default:
+                    // No Anaglyphs
+                    anaglyph_image(dst_y, dst_x) = left_pixel;
+                    break;
+            }
         }
     }
-}
+};
 
 int divUp(int a, int b)
 {
   return ((a % b) != 0) ? (a / b + 1) : (a / b);
 }
 
-void processCUDA(const cv::cuda::GpuMat& d_left_image,
-                 const cv::cuda::GpuMat& d_right_image,
-                 cv::cuda::GpuMat& d_anaglyph_image,
+void processCUDA(Backend backend,
+                 DeviceImage& d_left_image,
+                 DeviceImage& d_right_image,
+                 DeviceImage& d_anaglyph_image,
                  int rows,
                  int cols,
                  int anaglyph_type) {
     const dim3 block(32, 8);
 
     const dim3 grid(divUp(cols, block.x), divUp(rows, block.y));
-    processKernel<<<grid, block>>>(d_left_image, d_right_image, d_anaglyph_image, rows, cols, anaglyph_type);
+    launch(backend, grid, block, ProcessKernel{d_left_image.view<const uchar3>(), d_right_image.view<const uchar3>(),
+                                               d_anaglyph_image.view<uchar3>(), rows, cols, anaglyph_type});
 }
 
 int main(int argc, char** argv) {
@@ -109,6 +109,15 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    // Kernels run on the GPU when there is one, else on the CPU backend;
+    // --backend=cuda|cpu forces one
+    Backend backend;
+    if (!selectBackend(findOption(argc, argv, "--backend"), backend)) {
+        cerr << "Error: Backend unavailable, use auto, cuda or cpu." << endl;
+        return -1;
+    }
+    cout << "Backend: " << backendName(backend) << endl;
+
     cv::Mat stereo_image = cv::imread(argv[1], cv::IMREAD_COLOR);
 
     AnaglyphType anaglyph_type = static_cast<AnaglyphType>(atoi(argv[2]));
@@ -156,7 +165,7 @@ int main(int argc, char** argv) {
             anaglyph_name = "None";
     }
 
-    cv::cuda::GpuMat d_left_image, d_right_image, d_anaglyph_image;
+    DeviceImage d_left_image(backend), d_right_image(backend), d_anaglyph_image(backend);
 
     // Start the timer
     auto begin = chrono::high_resolution_clock::now();
@@ -169,7 +178,7 @@ int main(int argc, char** argv) {
         d_right_image.upload(right_image);
         d_anaglyph_image.upload(left_image);
 
-        processCUDA(d_left_image, d_right_image, d_anaglyph_image, left_image.rows, left_image.cols, anaglyph_type);
+        processCUDA(backend, d_left_image, d_right_image, d_anaglyph_image, left_image.rows, left_image.cols, anaglyph_type);
 
         d_anaglyph_image.download(anaglyph_image);
     }
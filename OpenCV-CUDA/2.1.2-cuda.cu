@@ -1,16 +1,12 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
-#include <opencv2/cudaarithm.hpp>
-#include <opencv2/cudawarping.hpp>
-#include <cfloat>
-#include <opencv2/core/cuda/common.hpp>
-#include <opencv2/core/cuda/border_interpolate.hpp>
-#include <opencv2/core/cuda/vec_traits.hpp>
-#include <opencv2/core/cuda/vec_math.hpp>
 #include <string>
 #include <cmath>
 #include <chrono>  
 
+#include "cli_options.h"
+#include "device.h"
+
 using namespace std;
 
 enum AnaglyphType {
@@ -22,153 +18,186 @@ enum AnaglyphType {
     OPTIMIZED
 };
 
-__global__ void generateGaussianKernelKernel(double* gaussKernel, int kernelSize, double sigma) {
-    const int x = blockIdx.x * blockDim.x + threadIdx.x;
-    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+struct GenerateGaussianKernelKernel {
+    double* gaussKernel;
+    int kernelSize;
+    double sigma;
+
+    DEVICE_FUNC void operator()(const ThreadIndex& t) const {
+        const int x = t.blockIdx.x * t.blockDim.x + t.threadIdx.x;
+        const int y = t.blockIdx.y * t.blockDim.y + t.threadIdx.y;
 
-    if (x < kernelSize && y < kernelSize) {
-        int halfKernelSize = kernelSize / 2;
-        const double PI = 3.14159265358979323846;
+        if (x < kernelSize && y < kernelSize) {
+            int halfKernelSize = kernelSize / 2;
+            const double PI = 3.14159265358979323846;
 
-        double lp = 1.0 / (2.0 * PI * sigma * sigma);
-        double rp = 1.0 / (2.0 * sigma * sigma);
+            double lp = 1.0 / (2.0 * PI * sigma * sigma);
+            double rp = 1.0 / (2.0 * sigma * sigma);
 
-        double gaussianVal = lp * exp(-((x - halfKernelSize) * (x - halfKernelSize) + (y - halfKernelSize) * (y - halfKernelSize)) * rp);
-        gaussKernel[y * kernelSize + x] = gaussianVal;
+            double gaussianVal = lp * exp(-((x - halfKernelSize) * (x - halfKernelSize) + (y - halfKernelSize) * (y - halfKernelSize)) * rp);
+            gaussKernel[y * kernelSize + x] = gaussianVal;
+        }
     }
-}
+};
 
-__global__ void applyGaussianBlurKernel(const cv::cuda::PtrStepSz<uchar3> src, cv::cuda::PtrStepSz<uchar3> dst, int kernelSize, double* gaussKernel) {
-    const int x = blockIdx.x * blockDim.x + threadIdx.x;
-    const int y = blockIdx.y * blockDim.y + threadIdx.y;
+struct ApplyGaussianBlurKernel {
+    ImageView<const uchar3> src;
+    ImageView<uchar3> dst;
+    int kernelSize;
+    const double* gaussKernel;
 
-    if (x < src.cols && y < src.rows) {
-        int halfKernelSize = kernelSize / 2;
+    DEVICE_FUNC void operator()(const ThreadIndex& t) const {
+        const int x = t.blockIdx.x * t.blockDim.x + t.threadIdx.x;
+        const int y = t.blockIdx.y * t.blockDim.y + t.threadIdx.y;
 
-        double sum[3] = {0.0, 0.0, 0.0};
-        double gaussianTotal = 0.0;
+        if (x < src.cols && y < src.rows) {
+            int halfKernelSize = kernelSize / 2;
 
-        for (int i = -halfKernelSize; i <= halfKernelSize; ++i) {
-            for (int j = -halfKernelSize; j <= halfKernelSize; ++j) {
-                int row = min(max(y + i, 0), src.rows - 1);
-                int col = min(max(x + j, 0), src.cols - 1);
+            double sum[3] = {0.0, 0.0, 0.0};
+            double gaussianTotal = 0.0;
 
-                double gaussianVal = gaussKernel[(i + halfKernelSize) * kernelSize + (j + halfKernelSize)];
-                gaussianTotal += gaussianVal;
+            for (int i = -halfKernelSize; i <= halfKernelSize; ++i) {
+                for (int j = -halfKernelSize; j <= halfKernelSize; ++j) {
+                    int row = min(max(y + i, 0), src.rows - 1);
+                    int col = min(max(x + j, 0), src.cols - 1);
 
-                uchar3 pixel = src(row, col);
-                double pixelVec[3] = {static_cast<double>(pixel.x), static_cast<double>(pixel.y), static_cast<double>(pixel.z)};
-                for (int k = 0; k < 3; ++k) {
-                    sum[k] += pixelVec[k] * gaussianVal;
+                    double gaussianVal = gaussKernel[(i + halfKernelSize) * kernelSize + (j + halfKernelSize)];
+                    gaussianTotal += gaussianVal;
+
+                    uchar3 pixel = src(row, col);
+                    double pixelVec[3] = {static_cast<double>(pixel.x), static_cast<double>(pixel.y), static_cast<double>(pixel.z)};
+                    for (int k = 0; k < 3; ++k) {
+                        sum[k] += pixelVec[k] * gaussianVal;
+                    }
                 }
             }
-        }
 
-        for (int k = 0; k < 3; ++k) {
-            sum[k] /= gaussianTotal;
+            for (int k = 0; k < 3; ++k) {
+                sum[k] /= gaussianTotal;
+            }
+            dst(y, x) = make_uchar3(static_cast<uchar>(sum[0]), static_cast<uchar>(sum[1]), static_cast<uchar>(sum[2]));
         }
-        dst(y, x) = make_uchar3(static_cast<uchar>(sum[0]), static_cast<uchar>(sum[1]), static_cast<uchar>(sum[2]));
     }
-}
+};
 
-__global__ void processKernel(const cv::cuda::PtrStepSz<uchar3> left_image,
-                                     const cv::cuda::PtrStepSz<uchar3> right_image,
-                                     cv::cuda::PtrStepSz<uchar3> anaglyph_image,
-                                     int anaglyph_type) {
-    const int x = blockIdx.x * blockDim.x + threadIdx.x;
-    const int y = blockIdx.y * blockDim.y + threadIdx.y;
-
-    if (x < left_image.cols && y < left_image.rows) {
-        uchar3 left_pixel = left_image(y, x);
-        uchar3 right_pixel = right_image(y, x);
-
-        switch (anaglyph_type) {
-            case TRUE:
-                // True Anaglyphs
-                anaglyph_image(y, x) = make_uchar3(
-                    0.299f * right_pixel.z + 0.578f * right_pixel.y + 0.114f * right_pixel.x,
-                    0,
-                    0.299f * left_pixel.z + 0.578f * left_pixel.y + 0.114f * left_pixel.x
-                );
-                break;
-            case GRAY:
-                // Gray Anaglyphs
-                anaglyph_image(y, x) = make_uchar3(
-                    0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
-                    0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
-                    0.299f * left_pixel.x + 0.578f * left_pixel.y + 0.114f * left_pixel.z
-                );
-                break;
-            case COLOR:
-                // Color Anaglyphs
-                anaglyph_image(y, x) = make_uchar3(
-                    right_pixel.x,
-                    right_pixel.y,
-                    left_pixel.z
-                );
-                break;
-            case HALFCOLOR:
-                // Half Color Anaglyphs
-                anaglyph_image(y, x) = make_uchar3(
-                    0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
-                    right_pixel.y,
-                    left_pixel.z
-                );
-                break;
-            case OPTIMIZED:
-                // Optimized Anaglyphs
-                anaglyph_image(y, x) = make_uchar3(
-                    0.7f * right_pixel.y + 0.3f * right_pixel.x,
-                    right_pixel.y,
-                    left_pixel.z
-                );
-                break;
-            default:
-                // No Anaglyphs
-                anaglyph_image(y, x) = left_pixel;
+struct ProcessKernel {
+    ImageView<const uchar3> left_image;
+    ImageView<const uchar3> right_image;
+    ImageView<uchar3> anaglyph_image;
+    int anaglyph_type;
+
+    DEVICE_FUNC void operator()(const ThreadIndex& t) const {
+        const int x = t.blockIdx.x * t.blockDim.x + t.threadIdx.x;
+        const int y = t.blockIdx.y * t.blockDim.y + t.threadIdx.y;
+
+        if (x < left_image.cols && y < left_image.rows) {
+            uchar3 left_pixel = left_image(y, x);
+            uchar3 right_pixel = right_image(y, x);
+
+            switch (anaglyph_type) {
+                case TRUE:
+                    // True Anaglyphs
+                    anaglyph_image(y, x) = make_uchar3(
+                        0.299f * right_pixel.z + 0.578f * right_pixel.y + 0.114f * right_pixel.x,
+                        0,
+                        0.299f * left_pixel.z + 0.578f * left_pixel.y + 0.114f * left_pixel.x
+                    );
+                    break;
+                case GRAY:
+                    // Gray Anaglyphs
+                    anaglyph_image(y, x) = make_uchar3(
+                        0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
+                        0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
+                        0.299f * left_pixel.x + 0.578f * left_pixel.y + 0.114f * left_pixel.z
+                    );
+                    break;
+                case COLOR:
+                    // Color Anaglyphs
+                    anaglyph_image(y, x) = make_uchar3(
+                        right_pixel.x,
+                        right_pixel.y,
+                        left_pixel.z
+                    );
+                    break;
+                case HALFCOLOR:
+                    // Half Color Anaglyphs
+                    anaglyph_image(y, x) = make_uchar3(
+                        0.299f * right_pixel.x + 0.578f * right_pixel.y + 0.114f * right_pixel.z,
+                        right_pixel.y,
+                        left_pixel.z
+                    );
+                    break;
+                case OPTIMIZED:
+                    // Optimized Anaglyphs
+                    anaglyph_image(y, x) = make_uchar3(
+                        0.7f * right_pixel.y + 0.3f * right_pixel.x,
+                        right_pixel.y,
+                        left_pixel.z
+                    );
+                    break;
+                default:
+                    // No Anaglyphs
+                    anaglyph_image(y, x) = left_pixel;
+            }
         }
     }
-}
+};
+
+struct MergeImagesKernel {
+    ImageView<const uchar3> leftImage;
+    ImageView<const uchar3> rightImage;
+    ImageView<uchar3> resultImage;
+    int rows;
+    int cols;
 
-__global__ void mergeImagesKernel(cv::cuda::PtrStepSz<uchar3> leftImage, cv::cuda::PtrStepSz<uchar3> rightImage, cv::cuda::PtrStepSz<uchar3> resultImage, int rows, int cols) {
-    const int dst_x = blockDim.x * blockIdx.x + threadIdx.x;
-    const int dst_y = blockDim.y * blockIdx.y + threadIdx.y;
+    DEVICE_FUNC void operator()(const ThreadIndex& t) const {
+        const int dst_x = t.blockDim.x * t.blockIdx.x + t.threadIdx.x;
+        const int dst_y = t.blockDim.y * t.blockIdx.y + t.threadIdx.y;
 
-    if (dst_y < rows && dst_x < cols) {
-        resultImage(dst_y, dst_x) = leftImage(dst_y, dst_x);
-        resultImage(dst_y, dst_x + cols) = rightImage(dst_y, dst_x);
+        if (dst_y < rows && dst_x < cols) {
+            resultImage(dst_y, dst_x) = leftImage(dst_y, dst_x);
+            resultImage(dst_y, dst_x + cols) = rightImage(dst_y, dst_x);
+        }
     }
-}
+};
 
 int divUp(int a, int b)
 {
     return ((a % b) != 0) ? (a / b + 1) : (a / b);
 }
 
-void processCUDA(const cv::cuda::GpuMat& d_left_image,
-                const cv::cuda::GpuMat& d_right_image,
-                cv::cuda::GpuMat& d_anaglyph_image,
-                cv::cuda::GpuMat& d_blurred_image,
+// Blurs both eyes into d_left_blurred and d_right_blurred, side by side into
+// d_blurred_image, and mixes the anaglyph unless the type is NORMAL, in which
+// case the blurred left eye is the result. The blur reads neighbours, so it
+// cannot write over its own input.
+void processCUDA(Backend backend,
+                DeviceImage& d_left_image,
+                DeviceImage& d_right_image,
+                DeviceImage& d_left_blurred,
+                DeviceImage& d_right_blurred,
+                DeviceImage& d_anaglyph_image,
+                DeviceImage& d_blurred_image,
                 int kernelSize,
                 int anaglyph_type,
-                double* gaussKernel) {
+                const double* gaussKernel) {
     const dim3 block(32, 8);
-    const dim3 grid(divUp(d_right_image.cols, block.x), divUp(d_right_image.rows, block.y));
-    int rows = d_anaglyph_image.rows;
-    int cols = d_anaglyph_image.cols;
+    const dim3 grid(divUp(d_right_image.cols(), block.x), divUp(d_right_image.rows(), block.y));
+    int rows = d_left_image.rows();
+    int cols = d_left_image.cols();
 
     // Apply Gaussian blur kernel
-    applyGaussianBlurKernel<<<grid, block>>>(d_left_image, d_left_image, kernelSize, gaussKernel);
-    applyGaussianBlurKernel<<<grid, block>>>(d_right_image, d_right_image, kernelSize, gaussKernel);
+    d_left_blurred.create(rows, cols, CV_8UC3);
+    d_right_blurred.create(rows, cols, CV_8UC3);
+    launch(backend, grid, block, ApplyGaussianBlurKernel{d_left_image.view<const uchar3>(), d_left_blurred.view<uchar3>(), kernelSize, gaussKernel});
+    launch(backend, grid, block, ApplyGaussianBlurKernel{d_right_image.view<const uchar3>(), d_right_blurred.view<uchar3>(), kernelSize, gaussKernel});
 
-    mergeImagesKernel<<<grid, block>>>(d_left_image, d_right_image, d_blurred_image, rows, cols);
+    launch(backend, grid, block, MergeImagesKernel{d_left_blurred.view<const uchar3>(), d_right_blurred.view<const uchar3>(), d_blurred_image.view<uchar3>(), rows, cols});
 
     if (anaglyph_type == NORMAL) {
-        d_anaglyph_image = d_left_image;
         return;
     }
     // Create anaglyph image kernel
-    processKernel<<<grid, block>>>(d_left_image, d_right_image, d_anaglyph_image, anaglyph_type);
+    launch(backend, grid, block, ProcessKernel{d_left_blurred.view<const uchar3>(), d_right_blurred.view<const uchar3>(), d_anaglyph_image.view<uchar3>(), anaglyph_type});
 }
 
 int main( int argc, char** argv )
@@ -178,6 +207,15 @@ int main( int argc, char** argv )
         return -1;
     }
 
+    // Kernels run on the GPU when there is one, else on the CPU backend;
+    // --backend=cuda|cpu forces one
+    Backend backend;
+    if (!selectBackend(findOption(argc, argv, "--backend"), backend)) {
+        cerr << "Error: Backend unavailable, use auto, cuda or cpu." << endl;
+        return -1;
+    }
+    cout << "Backend: " << backendName(backend) << endl;
+
     cv::Mat stereo_image = cv::imread(argv[1], cv::IMREAD_COLOR);
     if (stereo_image.empty()) {
         cerr << "Error: Unable to load image." << endl;
@@ -229,18 +267,17 @@ int main( int argc, char** argv )
         return -1;
     }
 
-    double* gaussKernel;
-    cudaMalloc(&gaussKernel, kernelSize * kernelSize * sizeof(double));
-    cudaMemset(gaussKernel, 0, kernelSize * kernelSize * sizeof(double));
+    DeviceBuffer<double> gaussKernel(backend, kernelSize * kernelSize);
 
     dim3 blockSize(16, 16);
     dim3 gridSize((kernelSize + blockSize.x - 1) / blockSize.x, (kernelSize + blockSize.y - 1) / blockSize.y);
 
-    generateGaussianKernelKernel<<<gridSize, blockSize>>>(gaussKernel, kernelSize, sigma);
+    launch(backend, gridSize, blockSize, GenerateGaussianKernelKernel{gaussKernel.data(), kernelSize, sigma});
 
     cv::Mat anaglyph_image, blurred_image;
 
-    cv::cuda::GpuMat d_left_image, d_right_image, d_blurred_image, d_anaglyph_image;
+    DeviceImage d_left_image(backend), d_right_image(backend), d_blurred_image(backend), d_anaglyph_image(backend);
+    DeviceImage d_left_blurred(backend), d_right_blurred(backend);
 
     // Start the timer
     auto begin = chrono::high_resolution_clock::now();
@@ -253,9 +290,10 @@ int main( int argc, char** argv )
         d_right_image.upload(right_image);
         d_anaglyph_image.upload(right_image);
         d_blurred_image.upload(stereo_image);
-        processCUDA(d_left_image, d_right_image, d_anaglyph_image, d_blurred_image, kernelSize, anaglyph_type, gaussKernel);
+        processCUDA(backend, d_left_image, d_right_image, d_left_blurred, d_right_blurred, d_anaglyph_image, d_blurred_image,
+                    kernelSize, anaglyph_type, gaussKernel.data());
         d_blurred_image.download(blurred_image);
-        d_anaglyph_image.download(anaglyph_image);
+        (anaglyph_type == NORMAL ? d_left_blurred : d_anaglyph_image).download(anaglyph_image);
     }
 
     // Stop the timer
@@ -286,7 +324,5 @@ int main( int argc, char** argv )
     // Wait for a key press before closing the windows
     cv::waitKey();
 
-    cudaFree(gaussKernel);
-
     return 0;
 }
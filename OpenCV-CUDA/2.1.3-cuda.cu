@@ -3,87 +3,98 @@
 #include <string>
 #include <cmath>
 #include <chrono>  // for high_resolution_clock
-#include <cuda_runtime.h>
+
+#include "cli_options.h"
+#include "device.h"
 
 using namespace std;
 
-__global__ void calculateAndDenoiseKernel(const uchar3* src, uchar3* dst, int cols, int rows, int neighborhoodSize, float factorRatio) {
-    int x = blockIdx.x * blockDim.x + threadIdx.x;
-    int y = blockIdx.y * blockDim.y + threadIdx.y;
-
-    if (x < cols && y < rows) {
-        int halfSize = neighborhoodSize / 2;
-        int xStart = max(0, x - halfSize);
-        int yStart = max(0, y - halfSize);
-        int xEnd = min(cols, x + halfSize);
-        int yEnd = min(rows, y + halfSize);
-
-        float3 mean = make_float3(0.0f, 0.0f, 0.0f);
-        float3 cov = make_float3(0.0f, 0.0f, 0.0f);
-
-        for (int j = yStart; j < yEnd; ++j) {
-            for (int i = xStart; i < xEnd; ++i) {
-                uchar3 pixel = src[j * cols + i];
-                mean.x += pixel.x;
-                mean.y += pixel.y;
-                mean.z += pixel.z;
+struct CalculateAndDenoiseKernel {
+    ImageView<const uchar3> src;
+    ImageView<uchar3> dst;
+    int cols;
+    int rows;
+    int neighborhoodSize;
+    float factorRatio;
+
+    DEVICE_FUNC void operator()(const ThreadIndex& t) const {
+        int x = t.blockIdx.x * t.blockDim.x + t.threadIdx.x;
+        int y = t.blockIdx.y * t.blockDim.y + t.threadIdx.y;
+
+        if (x < cols && y < rows) {
+            int halfSize = neighborhoodSize / 2;
+            int xStart = max(0, x - halfSize);
+            int yStart = max(0, y - halfSize);
+            int xEnd = min(cols, x + halfSize);
+            int yEnd = min(rows, y + halfSize);
+
+            float3 mean = make_float3(0.0f, 0.0f, 0.0f);
+            float3 cov = make_float3(0.0f, 0.0f, 0.0f);
+
+            for (int j = yStart; j < yEnd; ++j) {
+                for (int i = xStart; i < xEnd; ++i) {
+                    uchar3 pixel = src(j, i);
+                    mean.x += pixel.x;
+                    mean.y += pixel.y;
+                    mean.z += pixel.z;
+                }
             }
-        }
 
-        int count = (xEnd - xStart) * (yEnd - yStart);
-        mean.x /= count;
-        mean.y /= count;
-        mean.z /= count;
-
-        for (int j = yStart; j < yEnd; ++j) {
-            for (int i = xStart; i < xEnd; ++i) {
-                uchar3 pixel = src[j * cols + i];
-                float3 diff = make_float3(pixel.x - mean.x, pixel.y - mean.y, pixel.z - mean.z);
-                cov.x += diff.x * diff.x;
-                cov.y += diff.y * diff.y;
-                cov.z += diff.z * diff.z;
+            int count = (xEnd - xStart) * (yEnd - yStart);
+            mean.x /= count;
+            mean.y /= count;
+            mean.z /= count;
+
+            for (int j = yStart; j < yEnd; ++j) {
+                for (int i = xStart; i < xEnd; ++i) {
+                    uchar3 pixel = src(j, i);
+                    float3 diff = make_float3(pixel.x - mean.x, pixel.y - mean.y, pixel.z - mean.z);
+                    cov.x += diff.x * diff.x;
+                    cov.y += diff.y * diff.y;
+                    cov.z += diff.z * diff.z;
+                }
             }
-        }
-
-        cov.x /= count;
-        cov.y /= count;
-        cov.z /= count;
 
-        float determinant = cov.x * cov.y * cov.z;
-
-        int kernelSize;
-        if (determinant != 0) {
-            kernelSize = static_cast<int>(round(factorRatio / determinant));
-            kernelSize = kernelSize % 2 == 0 ? kernelSize + 1 : kernelSize;
-        } else {
-            kernelSize = neighborhoodSize;
-        }
+            cov.x /= count;
+            cov.y /= count;
+            cov.z /= count;
 
-        kernelSize = max(1, kernelSize);
-        kernelSize |= 1; // Ensure it's odd
+            float determinant = cov.x * cov.y * cov.z;
 
-        float3 sum = make_float3(0.0f, 0.0f, 0.0f);
-        count = 0;
+            int kernelSize;
+            if (determinant != 0) {
+                kernelSize = static_cast<int>(round(factorRatio / determinant));
+                kernelSize = kernelSize % 2 == 0 ? kernelSize + 1 : kernelSize;
+            } else {
+                kernelSize = neighborhoodSize;
+            }
 
-        for (int j = y - kernelSize / 2; j <= y + kernelSize / 2; ++j) {
-            for (int i = x - kernelSize / 2; i <= x + kernelSize / 2; ++i) {
-                if (i >= 0 && i < cols && j >= 0 && j < rows) {
-                    uchar3 pixel = src[j * cols + i];
-                    sum.x += pixel.x;
-                    sum.y += pixel.y;
-                    sum.z += pixel.z;
-                    ++count;
+            kernelSize = max(1, kernelSize);
+            kernelSize |= 1; // Ensure it's odd
+
+            float3 sum = make_float3(0.0f, 0.0f, 0.0f);
+            count = 0;
+
+            for (int j = y - kernelSize / 2; j <= y + kernelSize / 2; ++j) {
+                for (int i = x - kernelSize / 2; i <= x + kernelSize / 2; ++i) {
+                    if (i >= 0 && i < cols && j >= 0 && j < rows) {
+                        uchar3 pixel = src(j, i);
+                        sum.x += pixel.x;
+                        sum.y += pixel.y;
+                        sum.z += pixel.z;
+                        ++count;
+                    }
                 }
             }
-        }
 
-        sum.x /= count;
-        sum.y /= count;
-        sum.z /= count;
+            sum.x /= count;
+            sum.y /= count;
+            sum.z /= count;
 
-        dst[y * cols + x] = make_uchar3(static_cast<unsigned char>(sum.x), static_cast<unsigned char>(sum.y), static_cast<unsigned char>(sum.z));
+            dst(y, x) = make_uchar3(static_cast<unsigned char>(sum.x), static_cast<unsigned char>(sum.y), static_cast<unsigned char>(sum.z));
+        }
     }
-}
+};
 
 int divUp(int a, int b)
 {
@@ -91,14 +102,13 @@ int divUp(int a, int b)
 }
 
 
-void processCUDA(const cv::cuda::GpuMat& src, cv::cuda::GpuMat& dst, int neighborhoodSize, double factorRatio) {
+void processCUDA(Backend backend, DeviceImage& src, DeviceImage& dst, int neighborhoodSize, double factorRatio) {
     dim3 block(32, 8);
-    dim3 grid(divUp(src.cols, block.x), divUp(src.rows, block.y));
+    dim3 grid(divUp(src.cols(), block.x), divUp(src.rows(), block.y));
 
-    calculateAndDenoiseKernel<<<grid, block>>>(
-        reinterpret_cast<uchar3*>(const_cast<unsigned char*>(src.ptr())), 
-        reinterpret_cast<uchar3*>(dst.ptr()), 
-        src.cols, src.rows, neighborhoodSize, factorRatio);
+    launch(backend, grid, block, CalculateAndDenoiseKernel{
+        src.view<const uchar3>(), dst.view<uchar3>(),
+        src.cols(), src.rows(), neighborhoodSize, static_cast<float>(factorRatio)});
 }
 
 int main(int argc, char** argv) {
@@ -107,6 +117,15 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    // Kernels run on the GPU when there is one, else on the CPU backend;
+    // --backend=cuda|cpu forces one
+    Backend backend;
+    if (!selectBackend(findOption(argc, argv, "--backend"), backend)) {
+        cerr << "Error: Backend unavailable, use auto, cuda or cpu." << endl;
+        return -1;
+    }
+    cout << "Backend: " << backendName(backend) << endl;
+
     cv::Mat input_img = cv::imread(argv[1], cv::IMREAD_COLOR);
     if (input_img.empty()) {
         cerr << "Error: Unable to load image." << endl;
@@ -135,7 +154,7 @@ int main(int argc, char** argv) {
 
     cv::Mat denoised_image;
 
-    cv::cuda::GpuMat d_input_img, d_denoised_image;
+    DeviceImage d_input_img(backend), d_denoised_image(backend);
 
     // Start the timer
     auto begin = chrono::high_resolution_clock::now();
@@ -146,7 +165,7 @@ int main(int argc, char** argv) {
     for (int it = 0; it < iter; it++) {
         d_input_img.upload(input_img);
         d_denoised_image.upload(input_img);
-        processCUDA(d_input_img, d_denoised_image, neighborhoodSize, factorRatio);
+        processCUDA(backend, d_input_img, d_denoised_image, neighborhoodSize, factorRatio);
         d_denoised_image.download(denoised_image);
     }
 
@@ -0,0 +1,335 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+// Thin host/device layer that lets one kernel source run on CUDA or the CPU.
+//
+// A kernel is a functor whose operator()(const ThreadIndex&) does the work of
+// one CUDA thread. launch() runs it as a CUDA grid, or on the CPU: the blocks
+// are spread over OpenMP threads and the threads of a block run as loops, the
+// inner one over threadIdx.x so consecutive pixels can be vectorized.
+//
+// Kernels that stage data in shared memory are split at their __syncthreads()
+// into phases (see launchTiled). The GPU runs every phase followed by a
+// barrier; the CPU runs a phase for all threads of the block before starting
+// the next one, with the tile in the block's stack frame.
+//
+// Images are passed to kernels as ImageView<T> (pointer, step, size), which is
+// the same on both sides. DeviceImage and DeviceBuffer hold device memory on
+// the CUDA backend and host memory on the CPU backend.
+//
+// Built with nvcc both backends are available and one is picked at run time;
+// built as plain C++ (g++ -x c++) only the CPU backend is. Grids and blocks are
+// two-dimensional.
+
+#include <opencv2/opencv.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __CUDACC__
+#include <cuda_runtime.h>
+#include <opencv2/core/cuda.hpp>
+#define DEVICE_FUNC __host__ __device__
+#else
+#define DEVICE_FUNC
+
+// The CUDA vector types and helpers the kernels use
+struct dim3 {
+    unsigned int x, y, z;
+    dim3(unsigned int vx = 1, unsigned int vy = 1, unsigned int vz = 1) : x(vx), y(vy), z(vz) {}
+};
+
+struct uchar3 {
+    unsigned char x, y, z;
+};
+
+struct float3 {
+    float x, y, z;
+};
+
+inline uchar3 make_uchar3(unsigned char x, unsigned char y, unsigned char z) {
+    return uchar3{x, y, z};
+}
+
+inline float3 make_float3(float x, float y, float z) {
+    return float3{x, y, z};
+}
+
+inline int min(int a, int b) {
+    return a < b ? a : b;
+}
+
+inline int max(int a, int b) {
+    return a > b ? a : b;
+}
+#endif
+
+enum class Backend {
+    CUDA,
+    CPU
+};
+
+struct ThreadIndex {
+    dim3 blockIdx;
+    dim3 threadIdx;
+    dim3 blockDim;
+    dim3 gridDim;
+};
+
+// Rows of T that are step bytes apart
+template <typename T>
+struct ImageView {
+    unsigned char* data;
+    size_t step;
+    int rows;
+    int cols;
+
+    DEVICE_FUNC T& operator()(int y, int x) const {
+        return reinterpret_cast<T*>(data + y * step)[x];
+    }
+};
+
+inline bool cudaAvailable() {
+#ifdef __CUDACC__
+    int count = 0;
+    return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+#else
+    return false;
+#endif
+}
+
+// Resolves "cuda", "cpu" or "auto" (also nullptr): auto takes CUDA when a
+// device is present. Returns false for an unknown or unavailable backend.
+inline bool selectBackend(const char* name, Backend& backend) {
+    if (!name || strcmp(name, "auto") == 0) {
+        backend = cudaAvailable() ? Backend::CUDA : Backend::CPU;
+        return true;
+    }
+    if (strcmp(name, "cpu") == 0) {
+        backend = Backend::CPU;
+        return true;
+    }
+    if (strcmp(name, "cuda") == 0 && cudaAvailable()) {
+        backend = Backend::CUDA;
+        return true;
+    }
+    return false;
+}
+
+inline const char* backendName(Backend backend) {
+    return backend == Backend::CUDA ? "cuda" : "cpu";
+}
+
+#ifdef __CUDACC__
+template <typename Kernel>
+__global__ void runKernel(Kernel kernel) {
+    kernel(ThreadIndex{blockIdx, threadIdx, blockDim, gridDim});
+}
+
+template <typename Kernel>
+__global__ void runTiledKernel(Kernel kernel) {
+    __shared__ typename Kernel::Tile tile;
+    ThreadIndex index{blockIdx, threadIdx, blockDim, gridDim};
+    for (int phase = 0; phase < Kernel::PHASES; ++phase) {
+        kernel(phase, index, tile);
+        __syncthreads();
+    }
+}
+#endif
+
+// Runs kernel(index) for every thread of the grid
+template <typename Kernel>
+void launch(Backend backend, dim3 grid, dim3 block, const Kernel& kernel) {
+#ifdef __CUDACC__
+    if (backend == Backend::CUDA) {
+        runKernel<<<grid, block>>>(kernel);
+        return;
+    }
+#else
+    (void)backend;
+#endif
+    const int gridX = grid.x;
+    const int gridY = grid.y;
+    const int blockX = block.x;
+    const int blockY = block.y;
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int by = 0; by < gridY; ++by) {
+        for (int bx = 0; bx < gridX; ++bx) {
+            for (int ty = 0; ty < blockY; ++ty) {
+                #pragma omp simd
+                for (int tx = 0; tx < blockX; ++tx) {
+                    kernel(ThreadIndex{dim3(bx, by), dim3(tx, ty), block, grid});
+                }
+            }
+        }
+    }
+}
+
+// Runs a kernel that shares a Kernel::Tile between the threads of a block.
+// kernel(phase, index, tile) is called for phases 0 .. Kernel::PHASES - 1 with
+// a block-wide barrier after each; values that must survive a barrier go in
+// the tile.
+template <typename Kernel>
+void launchTiled(Backend backend, dim3 grid, dim3 block, const Kernel& kernel) {
+#ifdef __CUDACC__
+    if (backend == Backend::CUDA) {
+        runTiledKernel<<<grid, block>>>(kernel);
+        return;
+    }
+#else
+    (void)backend;
+#endif
+    const int gridX = grid.x;
+    const int gridY = grid.y;
+    const int blockX = block.x;
+    const int blockY = block.y;
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int by = 0; by < gridY; ++by) {
+        for (int bx = 0; bx < gridX; ++bx) {
+            typename Kernel::Tile tile;
+            for (int phase = 0; phase < Kernel::PHASES; ++phase) {
+                for (int ty = 0; ty < blockY; ++ty) {
+                    for (int tx = 0; tx < blockX; ++tx) {
+                        kernel(phase, ThreadIndex{dim3(bx, by), dim3(tx, ty), block, grid}, tile);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Waits for the launched kernels to finish
+inline void synchronize(Backend backend) {
+#ifdef __CUDACC__
+    if (backend == Backend::CUDA) {
+        cudaDeviceSynchronize();
+    }
+#else
+    (void)backend;
+#endif
+}
+
+// Image in device memory (CUDA) or host memory (CPU)
+class DeviceImage {
+public:
+    explicit DeviceImage(Backend backend) : backend_(backend) {}
+
+    void upload(const cv::Mat& image) {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            gpu_.upload(image);
+            return;
+        }
+#endif
+        image.copyTo(host_);
+    }
+
+    void download(cv::Mat& image) const {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            gpu_.download(image);
+            return;
+        }
+#endif
+        host_.copyTo(image);
+    }
+
+    void create(int rows, int cols, int type) {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            gpu_.create(rows, cols, type);
+            return;
+        }
+#endif
+        host_.create(rows, cols, type);
+    }
+
+    template <typename T>
+    ImageView<T> view() {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            return ImageView<T>{gpu_.data, gpu_.step, gpu_.rows, gpu_.cols};
+        }
+#endif
+        return ImageView<T>{host_.data, host_.step, host_.rows, host_.cols};
+    }
+
+    int rows() const {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            return gpu_.rows;
+        }
+#endif
+        return host_.rows;
+    }
+
+    int cols() const {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            return gpu_.cols;
+        }
+#endif
+        return host_.cols;
+    }
+
+private:
+    Backend backend_;
+    cv::Mat host_;
+#ifdef __CUDACC__
+    cv::cuda::GpuMat gpu_;
+#endif
+};
+
+// Array of count T in device memory (CUDA) or host memory (CPU), zeroed.
+// Throws cv::Exception, as GpuMat allocations do, when the device memory
+// cannot be allocated or cleared.
+template <typename T>
+class DeviceBuffer {
+public:
+    DeviceBuffer(Backend backend, size_t count) : backend_(backend), data_(nullptr) {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            cudaError_t status = cudaMalloc(&data_, count * sizeof(T));
+            if (status != cudaSuccess) {
+                data_ = nullptr;
+                CV_Error(cv::Error::GpuApiCallError, std::string("cudaMalloc: ") + cudaGetErrorString(status));
+            }
+            status = cudaMemset(data_, 0, count * sizeof(T));
+            if (status != cudaSuccess) {
+                cudaFree(data_);
+                data_ = nullptr;
+                CV_Error(cv::Error::GpuApiCallError, std::string("cudaMemset: ") + cudaGetErrorString(status));
+            }
+            return;
+        }
+#endif
+        host_.assign(count, T());
+        data_ = host_.data();
+    }
+
+    ~DeviceBuffer() {
+#ifdef __CUDACC__
+        if (backend_ == Backend::CUDA) {
+            cudaFree(data_);
+        }
+#endif
+    }
+
+    DeviceBuffer(const DeviceBuffer&) = delete;
+    DeviceBuffer& operator=(const DeviceBuffer&) = delete;
+
+    T* data() {
+        return data_;
+    }
+
+private:
+    Backend backend_;
+    T* data_;
+    std::vector<T> host_;
+};
+
+#endif // DEVICE_H
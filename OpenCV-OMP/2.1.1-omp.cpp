@@ -3,7 +3,20 @@
 #include <string>
 #include <cmath>
 #include <chrono>  // for high_resolution_clock
+#include <memory>
+#include <sstream>
 #include <omp.h> // OpenMP header
+#include "anaglyph_lut.h"
+#include "cli_options.h"
+#include "frame_stream.h"
+#include "mat_allocator.h"
+#include "perf_counters.h"
+#include "resample.h"
+#include "result_cache.h"
+#include "roofline.h"
+#include "scaled_imread.h"
+#include "stereo_align.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -16,6 +29,77 @@ enum AnaglyphType {
     OPTIMIZED
 };
 
+perf::Stage mixStage("anaglyph.mix");
+
+// Bump whenever a change alters the output; it is part of the result cache key
+const int ENGINE_VERSION = 1;
+
+// Coefficients of each anaglyph mode for the table-driven mixer. Rows are the
+// output B, G, R channels; columns are left B, G, R and right B, G, R.
+AnaglyphCoefficients anaglyphCoefficients(AnaglyphType anaglyph_type) {
+    switch (anaglyph_type) {
+        case TRUE:
+            // True Anaglyphs
+            return {{{0, 0, 0, 0.299, 0.578, 0.114}, {0, 0, 0, 0, 0, 0}, {0.299, 0.578, 0.114, 0, 0, 0}}};
+        case GRAY:
+            // Gray Anaglyphs
+            return {{{0, 0, 0, 0.299, 0.578, 0.114}, {0, 0, 0, 0.299, 0.578, 0.114}, {0.299, 0.578, 0.114, 0, 0, 0}}};
+        case COLOR:
+            // Color Anaglyphs
+            return {{{0, 0, 0, 1, 0, 0}, {0, 0, 0, 0, 1, 0}, {0, 0, 1, 0, 0, 0}}};
+        case HALFCOLOR:
+            // Half Color Anaglyphs
+            return {{{0, 0, 0, 0.299, 0.578, 0.114}, {0, 0, 0, 0, 1, 0}, {0, 0, 1, 0, 0, 0}}};
+        case OPTIMIZED:
+            // Optimized Anaglyphs
+            return {{{0, 0, 0, 0, 0.7, 0.3}, {0, 0, 0, 0, 1, 0}, {0, 0, 1, 0, 0, 0}}};
+        default:
+            // No Anaglyphs
+            return {{{1, 0, 0, 0, 0, 0}, {0, 1, 0, 0, 0, 0}, {0, 0, 1, 0, 0, 0}}};
+    }
+}
+
+std::string anaglyphName(AnaglyphType anaglyph_type) {
+    switch (anaglyph_type) {
+        case TRUE:
+            return "True";
+        case GRAY:
+            return "Gray";
+        case COLOR:
+            return "Color";
+        case HALFCOLOR:
+            return "Half Color";
+        case OPTIMIZED:
+            return "Optimized";
+        default:
+            return "None";
+    }
+}
+
+// Resamples both views to the size of anaglyph_image and mixes them in one
+// pass: each thread resamples one row of each eye into a row buffer and mixes
+// the two buffers straight into the output row, so neither the resized views
+// nor a full-size anaglyph are ever written
+template <typename Mixer>
+void mixResampled(const resample::Resampler& resampler, const Mixer& mixer, const cv::Mat& left_image, const cv::Mat& right_image,
+                  cv::Mat& anaglyph_image) {
+    #pragma omp parallel
+    {
+    TRACE_SCOPE("anaglyph.resample_mix");
+    PERF_SCOPE(mixStage);
+    int row_size = anaglyph_image.cols * left_image.channels();
+    std::vector<float> scratch(resampler.scratchSize(left_image.channels()));
+    std::vector<uchar> left_row(row_size);
+    std::vector<uchar> right_row(row_size);
+    #pragma omp for nowait
+    for (int i = 0; i < anaglyph_image.rows; i++) {
+        resampler.resampleRow(left_image, i, left_row.data(), scratch.data());
+        resampler.resampleRow(right_image, i, right_row.data(), scratch.data());
+        mixer.mixRow(left_row.data(), right_row.data(), anaglyph_image.ptr<uchar>(i), anaglyph_image.cols);
+    }
+    }
+}
+
 int main( int argc, char** argv )
 {
     if (argc < 3) {
@@ -23,14 +107,74 @@ int main( int argc, char** argv )
         return -1;
     }
 
-    // Read the stereo image
-    cv::Mat stereo_image = cv::imread(argv[1], cv::IMREAD_COLOR);
+    // Optional Chrome trace output
+    const char* trace_path = findOption(argc, argv, "--trace");
+    if (trace_path) {
+        trace::enable();
+    }
+
+    // Optional hardware performance counters
+    if (hasFlag(argc, argv, "--perf") && !perf::enable()) {
+        cerr << "Warning: Hardware performance counters unavailable, reporting timing only." << endl;
+    }
+
+    // Optional aligned / huge-page allocator for every image, selected before
+    // the first image is created
+    const char* allocator_name = findOption(argc, argv, "--allocator");
+    if (allocator_name && !installMatAllocator(allocator_name, hasFlag(argc, argv, "--pad-rows"))) {
+        cerr << "Error: Invalid allocator, use default, aligned, thp or hugetlb." << endl;
+        return -1;
+    }
+
+    // Optional raw-frame filter mode: an image path of "-" reads video frames
+    // from stdin and writes the results to stdout (see frame_stream.h)
+    bool streaming = strcmp(argv[1], "-") == 0;
+    StreamFormat stream_format = StreamFormat::BGR24;
+    int stream_width = 0;
+    int stream_height = 0;
+    if (streaming && !parseStreamOptions(argc, argv, stream_format, stream_width, stream_height)) {
+        cerr << "Error: Invalid stream options, use --stream-format=bgr24 with --stream-size=<w>x<h>, or --stream-format=y4m." << endl;
+        return -1;
+    }
+
+    // Optional output width; the input is decoded (and processed) at that size
+    const char* width_option = findOption(argc, argv, "--output-width");
+    int output_width = width_option ? atoi(width_option) : 0;
+    double scale = 1.0;
+
+    // Optional display size: the views are resampled to it while they are
+    // mixed, with --resample=bilinear|area|lanczos (default area)
+    const char* display_option = findOption(argc, argv, "--display-size");
+    cv::Size display_size;
+    char display_separator = 0;
+    if (display_option && (sscanf(display_option, "%d%c%d", &display_size.width, &display_separator, &display_size.height) != 3
+                           || display_separator != 'x' || display_size.width <= 0 || display_size.height <= 0)) {
+        cerr << "Error: Invalid display size, use --display-size=<w>x<h>." << endl;
+        return -1;
+    }
+    const char* resample_option = findOption(argc, argv, "--resample");
+    resample::Filter resample_filter = resample::Filter::AREA;
+    if (resample_option && !resample::parseFilter(resample_option, resample_filter)) {
+        cerr << "Error: Invalid resampling filter, use bilinear, area or lanczos." << endl;
+        return -1;
+    }
 
     // Determine the type of anaglyphs to generate
     AnaglyphType anaglyph_type = static_cast<AnaglyphType>(atoi(argv[2]));
 
+    // True and Gray anaglyphs only need the luminance of each eye, so only the
+    // luma plane is decoded
+    bool luma = anaglyph_type == TRUE || anaglyph_type == GRAY;
+
+    // Read the stereo image
+    cv::Mat stereo_image;
+    if (!streaming) {
+        TRACE_SCOPE("imread");
+        stereo_image = imreadWithWidth(argv[1], 2 * output_width, scale, luma);
+    }
+
     // Check if the image is loaded successfully
-    if (stereo_image.empty()) {
+    if (!streaming && stereo_image.empty()) {
         cerr << "Error: Unable to load image." << endl;
         return -1;
     }
@@ -47,14 +191,138 @@ int main( int argc, char** argv )
         return -1;
     }
 
+    // Each frame holds both views side by side, as the stereo image does
+    if (streaming) {
+        AnaglyphLut anaglyph_lut(anaglyphCoefficients(anaglyph_type));
+        std::unique_ptr<resample::Resampler> resampler;
+        cv::Mat anaglyph_image;
+        return runFrameStream(stream_format, stream_width, stream_height, [&](const cv::Mat& frame) {
+            cv::Mat left_image(frame, cv::Rect(0, 0, frame.cols / 2, frame.rows));
+            cv::Mat right_image(frame, cv::Rect(frame.cols / 2, 0, frame.cols / 2, frame.rows));
+            if (display_option) {
+                if (!resampler) {
+                    resampler.reset(new resample::Resampler(left_image.size(), display_size, resample_filter));
+                }
+                anaglyph_image.create(display_size, CV_8UC3);
+                mixResampled(*resampler, anaglyph_lut, left_image, right_image, anaglyph_image);
+                return anaglyph_image;
+            }
+            anaglyph_image.create(left_image.size(), CV_8UC3);
+            #pragma omp parallel for
+            for (int i = 0; i < left_image.rows; i++) {
+                anaglyph_lut.mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
+            }
+            return anaglyph_image;
+        });
+    }
+
     // Split the stereo image into left and right images
     cv::Mat left_image(stereo_image, cv::Rect(0, 0, stereo_image.cols / 2, stereo_image.rows));
     cv::Mat right_image(stereo_image, cv::Rect(stereo_image.cols / 2, 0, stereo_image.cols / 2, stereo_image.rows));
 
-    // Create an empty anaglyph image with the same size as the left and right images
-    cv::Mat anaglyph_image(left_image.size(), CV_8UC3);
+    // Optional alignment of the views: --align estimates the vertical and
+    // horizontal shift, --align=vertical only the vertical one. Both views
+    // are cropped to their overlap, so the mix below reads shifted rows
+    // without copying. --disparity also writes a coarse disparity map.
+    const char* align_option = findOption(argc, argv, "--align");
+    if (align_option && strcmp(align_option, "both") != 0 && strcmp(align_option, "vertical") != 0) {
+        cerr << "Error: Invalid alignment, use both or vertical." << endl;
+        return -1;
+    }
+    bool write_disparity = hasFlag(argc, argv, "--disparity");
+    bool align = align_option || hasFlag(argc, argv, "--align") || write_disparity;
+    bool align_horizontal = !align_option || strcmp(align_option, "both") == 0;
+    cv::Mat disparity_map;
+    if (align) {
+        TRACE_SCOPE("align");
+        auto align_begin = chrono::high_resolution_clock::now();
+        StereoShift shift = alignStereoViews(left_image, right_image, align_horizontal, write_disparity ? &disparity_map : nullptr);
+        std::chrono::duration<double> align_time = chrono::high_resolution_clock::now() - align_begin;
+        cout << "Alignment: dx " << shift.dx << ", dy " << shift.dy << ", views cropped to " << left_image.cols << "x"
+             << left_image.rows << " (" << align_time.count() * 1000 << " ms)" << endl;
+    }
+
+    // Create an empty anaglyph image with the same size as the left and right
+    // images, or with the display size
+    cv::Mat anaglyph_image;
+    {
+        TRACE_SCOPE("allocate");
+        anaglyph_image.create(display_option ? display_size : left_image.size(), CV_8UC3);
+    }
 
-    std::string anaglyph_name;
+    std::string anaglyph_name = anaglyphName(anaglyph_type);
+
+    // Precompute the lookup tables of the selected mode
+    AnaglyphLut anaglyph_lut(anaglyphCoefficients(anaglyph_type));
+    LumaAnaglyphMixer luma_mixer(anaglyph_type == GRAY);
+
+    // Filter taps of the display size, computed once for every iteration
+    std::unique_ptr<resample::Resampler> resampler;
+    if (display_option) {
+        resampler.reset(new resample::Resampler(left_image.size(), display_size, resample_filter));
+        cout << "Resampling: " << left_image.cols << "x" << left_image.rows << " to " << display_size.width << "x"
+             << display_size.height << " (" << resample::filterName(resample_filter) << ", " << resampler->horizontalTaps()
+             << "x" << resampler->verticalTaps() << " taps), fused with the mix" << endl;
+    }
+
+    // Optional roofline analysis instead of the benchmark: measures the
+    // host's bandwidth and FLOP roofs and places the mix under them.
+    // --roofline=<file> also writes the report as JSON.
+    const char* roofline_json = findOption(argc, argv, "--roofline");
+    if (roofline_json || hasFlag(argc, argv, "--roofline")) {
+        if (display_option) {
+            cerr << "Error: --display-size cannot be combined with --roofline." << endl;
+            return -1;
+        }
+        roofline::Machine machine = roofline::measureMachine();
+        // Both eyes are read and the BGR output written once; the tables
+        // stay in L1. A lookup-table term is an add, plus one rounding shift
+        // per channel; the luma path only moves bytes.
+        double pixels = static_cast<double>(left_image.total());
+        roofline::Kernel mix = {"anaglyph.mix", roofline::INTEGER,
+                                luma ? 0.0 : pixels * (anaglyph_lut.termCount() + 3),
+                                pixels * (2 * left_image.channels() + 3), 0.0};
+        mix.seconds = roofline::bestSeconds([&]() {
+            #pragma omp parallel for
+            for (int i = 0; i < left_image.rows; i++) {
+                if (luma) {
+                    luma_mixer.mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
+                } else {
+                    anaglyph_lut.mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
+                }
+            }
+        });
+        if (!roofline::report(machine, {mix}, roofline_json)) {
+            cerr << "Error: Unable to write roofline file." << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Optional result cache keyed by the decoded input and every parameter
+    // that affects the output
+    const char* cache_dir = findOption(argc, argv, "--cache");
+    const char* cache_size = findOption(argc, argv, "--cache-size");
+    std::unique_ptr<ResultCache> cache;
+    uint64_t input_hash = 0;
+    std::ostringstream operation;
+    operation.precision(17);
+    operation << "2.1.1 anaglyph type=" << anaglyph_type << " engine=" << ENGINE_VERSION;
+    if (align) {
+        operation << " align=" << (align_horizontal ? "both" : "vertical");
+    }
+    if (display_option) {
+        operation << " display=" << display_size.width << "x" << display_size.height << " resample="
+                  << resample::filterName(resample_filter);
+    }
+    std::vector<cv::Mat> cached_outputs;
+    bool cache_hit = false;
+    if (cache_dir) {
+        TRACE_SCOPE("cache.lookup");
+        cache.reset(new ResultCache(cache_dir, (cache_size ? strtoull(cache_size, nullptr, 10) : 1024) * 1024 * 1024));
+        input_hash = ResultCache::hashImage(stereo_image);
+        cache_hit = cache->lookup(input_hash, operation.str(), 1, cached_outputs);
+    }
 
     // Start the timer
     auto begin = chrono::high_resolution_clock::now();
@@ -63,68 +331,35 @@ int main( int argc, char** argv )
     const int iter = 5;
 
     // Perform the operation iter times
-    for (int it = 0; it < iter; it++) {
-        // Parallelize the outer loop using OpenMP
-        #pragma omp parallel for
-        // Loop through each pixel in the left image
+    for (int it = 0; it < iter && !cache_hit; it++) {
+        TRACE_SCOPE("iteration");
+
+        if (resampler) {
+            if (luma) {
+                mixResampled(*resampler, luma_mixer, left_image, right_image, anaglyph_image);
+            } else {
+                mixResampled(*resampler, anaglyph_lut, left_image, right_image, anaglyph_image);
+            }
+            continue;
+        }
+
+        // Parallelize the outer loop using OpenMP; each thread records its own
+        // span so load imbalance shows up in the trace
+        #pragma omp parallel
+        {
+        TRACE_SCOPE("anaglyph.mix");
+        PERF_SCOPE(mixStage);
+        #pragma omp for nowait
+        // Mix each row of the left and right images through the lookup tables,
+        // or interleave the luma rows
         for (int i = 0; i < left_image.rows; i++) {
-            for (int j = 0; j < left_image.cols; j++) {
-                // Get the color channels for the left and right pixels
-                cv::Vec3b left_pixel = left_image.at<cv::Vec3b>(i, j);
-                cv::Vec3b right_pixel = right_image.at<cv::Vec3b>(i, j);
-
-                switch (anaglyph_type) {
-                    case TRUE:
-                        // True Anaglyphs
-                        anaglyph_name = "True";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.299 * right_pixel[0] + 0.578 * right_pixel[1] + 0.114 * right_pixel[2],
-                            0,
-                            0.299 * left_pixel[0] + 0.578 * left_pixel[1] + 0.114 * left_pixel[2]
-                        );
-                        break;
-                    case GRAY:
-                        // Gray Anaglyphs
-                        anaglyph_name = "Gray";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.299 * right_pixel[0] + 0.578 * right_pixel[1] + 0.114 * right_pixel[2],
-                            0.299 * right_pixel[0] + 0.578 * right_pixel[1] + 0.114 * right_pixel[2],
-                            0.299 * left_pixel[0] + 0.578 * left_pixel[1] + 0.114 * left_pixel[2]
-                        );
-                        break;
-                    case COLOR:
-                        // Color Anaglyphs
-                        anaglyph_name = "Color";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            right_pixel[0],
-                            right_pixel[1],
-                            left_pixel[2]
-                        );
-                        break;
-                    case HALFCOLOR:
-                        // Half Color Anaglyphs
-                        anaglyph_name = "Half Color";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.299* right_pixel[0] + 0.578 * right_pixel[1] + 0.114 * right_pixel[2],
-                            right_pixel[1],
-                            left_pixel[2]
-                        );
-                        break;
-                    case OPTIMIZED:
-                        // Optimized Anaglyphs
-                        anaglyph_name = "Optimized";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.7 * right_pixel[1] + 0.3 * right_pixel[2],
-                            right_pixel[1],
-                            left_pixel[2]
-                        );
-                        break;
-                    default:
-                        anaglyph_name = "None";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = left_image.at<cv::Vec3b>(i, j);
-                }
+            if (luma) {
+                luma_mixer.mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
+            } else {
+                anaglyph_lut.mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
             }
         }
+        }
     }
 
     // Stop the timer
@@ -133,6 +368,13 @@ int main( int argc, char** argv )
     // Calculate the time difference
     std::chrono::duration<double> diff = end - begin;
 
+    if (cache_hit) {
+        anaglyph_image = cached_outputs[0];
+    } else if (cache) {
+        TRACE_SCOPE("cache.store");
+        cache->store(input_hash, operation.str(), {anaglyph_image});
+    }
+
     // Display the anaglyph image
     cv::imshow(anaglyph_name + " Anaglyph Image", anaglyph_image);
 
@@ -141,12 +383,35 @@ int main( int argc, char** argv )
 
     // Save the anaglyph image
     std::string filename =  "output/2.1.1/" + anaglyph_name + "Anaglyph.jpg";
-    cv::imwrite(filename, anaglyph_image);
+    {
+        TRACE_SCOPE("imwrite");
+        cv::imwrite(filename, anaglyph_image);
+        if (!disparity_map.empty()) {
+            cv::imwrite("output/2.1.1/disparity.png", disparity_map);
+        }
+    }
 
     // Display performance metrics
-    cout << "Total time for " << iter << " iterations: " << diff.count() << " s" << endl;
-    cout << "Time for 1 iteration: " << diff.count() / iter << " s" << endl;
-    cout << "IPS: " << iter / diff.count() << endl;
+    if (cache_hit) {
+        cout << "Result served from cache" << endl;
+    } else {
+        cout << "Total time for " << iter << " iterations: " << diff.count() << " s" << endl;
+        cout << "Time for 1 iteration: " << diff.count() / iter << " s" << endl;
+        cout << "IPS: " << iter / diff.count() << endl;
+        perf::report(mixStage, static_cast<double>(iter) * left_image.total());
+    }
+    if (cache) {
+        cache->printStats(cout);
+    }
+
+    // Write the per-stage trace
+    if (trace_path) {
+        if (trace::writeChromeTrace(trace_path)) {
+            cout << "Trace written to " << trace_path << endl;
+        } else {
+            cerr << "Error: Unable to write trace file." << endl;
+        }
+    }
 
     // Wait for a key press before closing the windows
     cv::waitKey();
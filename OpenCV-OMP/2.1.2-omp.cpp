@@ -3,7 +3,26 @@
 #include <string>
 #include <cmath>
 #include <chrono>  // for high_resolution_clock
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <vector>
 #include <omp.h> // OpenMP header
+#include "anaglyph_lut.h"
+#include "buffer_pool.h"
+#include "cli_options.h"
+#include "convolution.h"
+#include "cpu_dispatch.h"
+#include "dataflow.h"
+#include "frame_stream.h"
+#include "mat_allocator.h"
+#include "perf_counters.h"
+#include "result_cache.h"
+#include "roofline.h"
+#include "scaled_imread.h"
+#include "shard.h"
+#include "stereo_align.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -16,40 +35,472 @@ enum AnaglyphType {
     OPTIMIZED
 };
 
+perf::Stage blurStage("blur");
+perf::Stage mixStage("anaglyph.mix");
+perf::Stage detailStage("blur.detail");
+
+// Bump whenever a change alters the output; it is part of the result cache key
+const int ENGINE_VERSION = 1;
+
+// Coefficients of each anaglyph mode for the table-driven mixer. Rows are the
+// output B, G, R channels; columns are left B, G, R and right B, G, R.
+AnaglyphCoefficients anaglyphCoefficients(AnaglyphType anaglyph_type) {
+    switch (anaglyph_type) {
+        case TRUE:
+            // True Anaglyphs
+            return {{{0, 0, 0, 0.114, 0.578, 0.299}, {0, 0, 0, 0, 0, 0}, {0.114, 0.578, 0.299, 0, 0, 0}}};
+        case GRAY:
+            // Gray Anaglyphs
+            return {{{0, 0, 0, 0.114, 0.578, 0.299}, {0, 0, 0, 0.114, 0.578, 0.299}, {0.114, 0.578, 0.299, 0, 0, 0}}};
+        case COLOR:
+            // Color Anaglyphs
+            return {{{0, 0, 0, 0, 0, 1}, {0, 0, 0, 0, 1, 0}, {1, 0, 0, 0, 0, 0}}};
+        case HALFCOLOR:
+            // Half Color Anaglyphs
+            return {{{0, 0, 0, 0.114, 0.578, 0.299}, {0, 0, 0, 0, 1, 0}, {1, 0, 0, 0, 0, 0}}};
+        case OPTIMIZED:
+            // Optimized Anaglyphs
+            return {{{0, 0, 0, 0.3, 0.7, 0}, {0, 0, 0, 0, 1, 0}, {1, 0, 0, 0, 0, 0}}};
+        default:
+            // No Anaglyphs, the left image is used as is
+            return {{{1, 0, 0, 0, 0, 0}, {0, 1, 0, 0, 0, 0}, {0, 0, 1, 0, 0, 0}}};
+    }
+}
+
+std::string anaglyphName(AnaglyphType anaglyph_type) {
+    switch (anaglyph_type) {
+        case TRUE:
+            return "True";
+        case GRAY:
+            return "Gray";
+        case COLOR:
+            return "Color";
+        case HALFCOLOR:
+            return "Half Color";
+        case OPTIMIZED:
+            return "Optimized";
+        default:
+            return "None";
+    }
+}
+
 cv::Mat applyGaussianBlurBuildIn(const cv::Mat& image, int kernelSize, double sigma) {
+    TRACE_SCOPE("blur.buildin");
     cv::Mat blurredImage;
     cv::GaussianBlur(image, blurredImage, cv::Size(kernelSize, kernelSize), sigma, sigma);
     return blurredImage;
 }
 
-cv::Mat applyGaussianBlur(const cv::Mat& src, int kernelSize, double** gaussKernel) {
-    cv::Mat dst(src.size(), CV_8UC3);
+// Blurs pixel (x, y) of src into dst with the 2D Gaussian kernel, dropping
+// the taps that fall outside the image; CN is the channel count of both images
+template <int CN>
+CPU_DISPATCH_INLINE void gaussianBlurPixel(const cv::Mat& src, cv::Mat& dst, int kernelSize, double** gaussKernel, int x, int y) {
+    int halfKernelSize = kernelSize / 2;
+    double sum[CN] = {};
+    double gaussianTotal = 0.0;
 
+    for (int i = -halfKernelSize; i <= halfKernelSize; ++i) {
+        for (int j = -halfKernelSize; j <= halfKernelSize; ++j) {
+            if (y + i >= 0 && y + i < src.rows && x + j >= 0 && x + j < src.cols) {
+                double gaussianVal = gaussKernel[i + halfKernelSize][j + halfKernelSize];
+                gaussianTotal += gaussianVal;
+                const uchar* pixel = src.ptr<uchar>(y + i) + (x + j) * CN;
+                for (int c = 0; c < CN; ++c) {
+                    sum[c] += pixel[c] * gaussianVal;
+                }
+            }
+        }
+    }
+    uchar* out = dst.ptr<uchar>(y) + x * CN;
+    for (int c = 0; c < CN; ++c) {
+        out[c] = static_cast<uchar>(sum[c] / gaussianTotal);
+    }
+}
+
+// Blurs rows [rowBegin, rowEnd) of src into dst with the 2D Gaussian kernel.
+// Pixels whose taps all lie within the row are accumulated tap by tap over the
+// whole row, so the innermost loop runs along x and vectorizes; every pixel
+// still adds its taps in the same order as gaussianBlurPixel, so the result is
+// the same.
+template <int CN>
+CPU_DISPATCH_INLINE void gaussianBlurRows(const cv::Mat& src, cv::Mat& dst, int kernelSize, double** gaussKernel, int rowBegin, int rowEnd) {
     int halfKernelSize = kernelSize / 2;
+    int interiorBegin = std::min(halfKernelSize, src.cols);
+    int interiorEnd = std::max(interiorBegin, src.cols - halfKernelSize);
+    std::vector<double> sum((interiorEnd - interiorBegin) * CN);
 
-    // Apply Gaussian blur
-    #pragma omp parallel for
-    for (int y = 0; y < src.rows; ++y) {
-        for (int x = 0; x < src.cols; ++x) {
-            cv::Vec3d sum = cv::Vec3d(0.0, 0.0, 0.0);
-            double gaussianTotal = 0.0;
-
-            for (int i = -halfKernelSize; i <= halfKernelSize; ++i) {
-                for (int j = -halfKernelSize; j <= halfKernelSize; ++j) {
-                    if (y + i >= 0 && y + i < src.rows && x + j >= 0 && x + j < src.cols) {
-                        double gaussianVal = gaussKernel[i + halfKernelSize][j + halfKernelSize];
-                        gaussianTotal += gaussianVal;
-                        cv::Vec3b pixel = src.at<cv::Vec3b>(y + i, x + j);
-                        sum += cv::Vec3d(pixel[0], pixel[1], pixel[2]) * gaussianVal;
-                    }
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        for (int x = 0; x < interiorBegin; ++x) {
+            gaussianBlurPixel<CN>(src, dst, kernelSize, gaussKernel, x, y);
+        }
+        for (int x = interiorEnd; x < src.cols; ++x) {
+            gaussianBlurPixel<CN>(src, dst, kernelSize, gaussKernel, x, y);
+        }
+
+        std::fill(sum.begin(), sum.end(), 0.0);
+        double gaussianTotal = 0.0;
+        double* acc = sum.data();
+        const int count = static_cast<int>(sum.size());
+        for (int i = std::max(-halfKernelSize, -y); i <= std::min(halfKernelSize, src.rows - 1 - y); ++i) {
+            for (int j = -halfKernelSize; j <= halfKernelSize; ++j) {
+                double gaussianVal = gaussKernel[i + halfKernelSize][j + halfKernelSize];
+                gaussianTotal += gaussianVal;
+                const uchar* in = src.ptr<uchar>(y + i) + (interiorBegin + j) * CN;
+                for (int k = 0; k < count; ++k) {
+                    acc[k] += in[k] * gaussianVal;
                 }
             }
-            sum /= gaussianTotal;
-            dst.at<cv::Vec3b>(y, x) = cv::Vec3b(sum[0], sum[1], sum[2]);
         }
+        uchar* out = dst.ptr<uchar>(y) + interiorBegin * CN;
+        for (int k = 0; k < count; ++k) {
+            out[k] = static_cast<uchar>(acc[k] / gaussianTotal);
+        }
+    }
+}
+
+CPU_DISPATCH_INLINE void gaussianBlurRowsKernel(const cv::Mat& src, cv::Mat& dst, int kernelSize, double** gaussKernel, int rowBegin, int rowEnd) {
+    if (src.channels() == 1) {
+        gaussianBlurRows<1>(src, dst, kernelSize, gaussKernel, rowBegin, rowEnd);
+    } else {
+        gaussianBlurRows<3>(src, dst, kernelSize, gaussKernel, rowBegin, rowEnd);
+    }
+}
+
+// Blurs rows [rowBegin, rowEnd) of src into dst, both BGR (CV_8UC3) or both
+// luma (CV_8UC1)
+CPU_DISPATCH(applyGaussianBlurRows, gaussianBlurRowsKernel,
+             (const cv::Mat& src, cv::Mat& dst, int kernelSize, double** gaussKernel, int rowBegin, int rowEnd),
+             (src, dst, kernelSize, gaussKernel, rowBegin, rowEnd))
+
+// Builds the normalized 1D kernel equivalent to applying the kernelSize x
+// kernelSize Gaussian `repeat` times: the repeat-fold self-convolution of its
+// 1D factor. Without truncation this is the Gaussian of sigma * sqrt(repeat).
+// Taps below 1e-6 at either end are trimmed, so the result is only as wide as
+// the equivalent Gaussian needs rather than repeat * (kernelSize - 1) + 1.
+std::vector<double> generateRepeatedGaussianKernel(int kernelSize, double sigma, int repeat) {
+    int halfKernelSize = kernelSize / 2;
+    double rp = 1.0 / (2.0 * sigma * sigma);
+
+    std::vector<double> base(kernelSize);
+    double total = 0.0;
+    for (int i = -halfKernelSize; i <= halfKernelSize; ++i) {
+        base[i + halfKernelSize] = exp(-(i * i) * rp);
+        total += base[i + halfKernelSize];
+    }
+    for (double& value : base) {
+        value /= total;
+    }
+
+    std::vector<double> kernel = base;
+    for (int pass = 1; pass < repeat; ++pass) {
+        std::vector<double> next(kernel.size() + base.size() - 1, 0.0);
+        for (size_t i = 0; i < kernel.size(); ++i) {
+            for (size_t j = 0; j < base.size(); ++j) {
+                next[i + j] += kernel[i] * base[j];
+            }
+        }
+        kernel.swap(next);
+    }
+
+    size_t trim = 0;
+    while (kernel.size() - 2 * trim > 1 && kernel[trim] < 1e-6) {
+        ++trim;
+    }
+    return std::vector<double>(kernel.begin() + trim, kernel.end() - trim);
+}
+
+// Horizontal blur of pixel x of row in into out, dropping the taps that fall
+// outside the row
+template <int CN>
+CPU_DISPATCH_INLINE void horizontalBlurPixel(const uchar* in, float* out, const std::vector<double>& kernel, int cols, int x) {
+    int halfKernelSize = static_cast<int>(kernel.size()) / 2;
+    double sum[CN] = {};
+    double gaussianTotal = 0.0;
+
+    for (int j = std::max(-halfKernelSize, -x); j <= std::min(halfKernelSize, cols - 1 - x); ++j) {
+        double gaussianVal = kernel[j + halfKernelSize];
+        gaussianTotal += gaussianVal;
+        for (int c = 0; c < CN; ++c) {
+            sum[c] += in[(x + j) * CN + c] * gaussianVal;
+        }
+    }
+    for (int c = 0; c < CN; ++c) {
+        out[x * CN + c] = static_cast<float>(sum[c] / gaussianTotal);
+    }
+}
+
+// Horizontal half of the separable blur for rows [rowBegin, rowEnd): src
+// (CV_8UC(CN)) into tmp (CV_32FC(CN)). As in gaussianBlurRows, taps that fall
+// outside the image are dropped and the remaining weights renormalized, and
+// the pixels away from the edges are accumulated tap by tap along the row.
+template <int CN>
+CPU_DISPATCH_INLINE void horizontalBlurRows(const cv::Mat& src, cv::Mat& tmp, const std::vector<double>& kernel, int rowBegin, int rowEnd) {
+    int halfKernelSize = static_cast<int>(kernel.size()) / 2;
+    int interiorBegin = std::min(halfKernelSize, src.cols);
+    int interiorEnd = std::max(interiorBegin, src.cols - halfKernelSize);
+    std::vector<double> sum((interiorEnd - interiorBegin) * CN);
+    double interiorTotal = 0.0;
+    for (double gaussianVal : kernel) {
+        interiorTotal += gaussianVal;
+    }
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        const uchar* in = src.ptr<uchar>(y);
+        float* out = tmp.ptr<float>(y);
+        for (int x = 0; x < interiorBegin; ++x) {
+            horizontalBlurPixel<CN>(in, out, kernel, src.cols, x);
+        }
+        for (int x = interiorEnd; x < src.cols; ++x) {
+            horizontalBlurPixel<CN>(in, out, kernel, src.cols, x);
+        }
+
+        std::fill(sum.begin(), sum.end(), 0.0);
+        double* acc = sum.data();
+        const int count = static_cast<int>(sum.size());
+        for (int j = -halfKernelSize; j <= halfKernelSize; ++j) {
+            double gaussianVal = kernel[j + halfKernelSize];
+            const uchar* p = in + (interiorBegin + j) * CN;
+            for (int k = 0; k < count; ++k) {
+                acc[k] += p[k] * gaussianVal;
+            }
+        }
+        float* o = out + interiorBegin * CN;
+        for (int k = 0; k < count; ++k) {
+            o[k] = static_cast<float>(acc[k] / interiorTotal);
+        }
+    }
+}
+
+// Vertical half of the separable blur for rows [rowBegin, rowEnd): tmp
+// (CV_32FC(CN)) into dst (CV_8UC(CN)), reading halfKernelSize rows of tmp above
+// and below. Only this pass rounds to 8 bits. The taps of a row are the same
+// for every pixel, so each is applied to the whole row at once.
+template <int CN>
+CPU_DISPATCH_INLINE void verticalBlurRows(const cv::Mat& tmp, cv::Mat& dst, const std::vector<double>& kernel, int rowBegin, int rowEnd) {
+    int halfKernelSize = static_cast<int>(kernel.size()) / 2;
+    std::vector<double> sum(tmp.cols * CN);
+    double* acc = sum.data();
+    const int count = static_cast<int>(sum.size());
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        std::fill(sum.begin(), sum.end(), 0.0);
+        double gaussianTotal = 0.0;
+
+        for (int i = std::max(-halfKernelSize, -y); i <= std::min(halfKernelSize, tmp.rows - 1 - y); ++i) {
+            double gaussianVal = kernel[i + halfKernelSize];
+            gaussianTotal += gaussianVal;
+            const float* in = tmp.ptr<float>(y + i);
+            for (int k = 0; k < count; ++k) {
+                acc[k] += in[k] * gaussianVal;
+            }
+        }
+        uchar* out = dst.ptr<uchar>(y);
+        for (int k = 0; k < count; ++k) {
+            out[k] = cv::saturate_cast<uchar>(acc[k] / gaussianTotal);
+        }
+    }
+}
+
+CPU_DISPATCH_INLINE void horizontalBlurRowsKernel(const cv::Mat& src, cv::Mat& tmp, const std::vector<double>& kernel, int rowBegin, int rowEnd) {
+    if (src.channels() == 1) {
+        horizontalBlurRows<1>(src, tmp, kernel, rowBegin, rowEnd);
+    } else {
+        horizontalBlurRows<3>(src, tmp, kernel, rowBegin, rowEnd);
+    }
+}
+
+CPU_DISPATCH_INLINE void verticalBlurRowsKernel(const cv::Mat& tmp, cv::Mat& dst, const std::vector<double>& kernel, int rowBegin, int rowEnd) {
+    if (tmp.channels() == 1) {
+        verticalBlurRows<1>(tmp, dst, kernel, rowBegin, rowEnd);
+    } else {
+        verticalBlurRows<3>(tmp, dst, kernel, rowBegin, rowEnd);
+    }
+}
+
+CPU_DISPATCH(applyHorizontalBlurRows, horizontalBlurRowsKernel,
+             (const cv::Mat& src, cv::Mat& tmp, const std::vector<double>& kernel, int rowBegin, int rowEnd),
+             (src, tmp, kernel, rowBegin, rowEnd))
+
+CPU_DISPATCH(applyVerticalBlurRows, verticalBlurRowsKernel,
+             (const cv::Mat& tmp, cv::Mat& dst, const std::vector<double>& kernel, int rowBegin, int rowEnd),
+             (tmp, dst, kernel, rowBegin, rowEnd))
+
+// Unsharp mask and high-pass residual of count values from the source and
+// its blur. The mask adds amount times the difference to the source, except
+// where the difference is below threshold, which keeps noise and smooth
+// gradients unsharpened. The residual is offset by 128. Either output may be
+// null.
+CPU_DISPATCH_INLINE void detailRowKernel(const uchar* src, const uchar* blur, uchar* sharpened, uchar* highpass, int count, float amount,
+                                         int threshold) {
+    if (sharpened) {
+        for (int k = 0; k < count; ++k) {
+            int difference = src[k] - blur[k];
+            float value = std::min(255.0f, std::max(0.0f, src[k] + amount * difference));
+            sharpened[k] = std::abs(difference) < threshold ? src[k] : static_cast<uchar>(value + 0.5f);
+        }
+    }
+    if (highpass) {
+        for (int k = 0; k < count; ++k) {
+            highpass[k] = static_cast<uchar>(std::min(255, std::max(0, 128 + src[k] - blur[k])));
+        }
+    }
+}
+
+CPU_DISPATCH(applyDetailRow, detailRowKernel,
+             (const uchar* src, const uchar* blur, uchar* sharpened, uchar* highpass, int count, float amount, int threshold),
+             (src, blur, sharpened, highpass, count, amount, threshold))
+
+// One row-parallel stage of an eye's blur: writes rows [y0, y1) of its output
+// and reads `halo` rows above and below from the output of the previous pass.
+struct BlurPass {
+    int halo;
+    std::function<void(int, int)> rows;
+};
+
+// Splits the blur of one eye into row passes from src to dst. With one pass,
+// or with exactRounding, which reproduces the 8-bit rounding after every
+// pass, the 2D kernel is applied `repeat` times literally. Otherwise the
+// repeated Gaussians collapse into one wider Gaussian, so a single separable
+// pass with the equivalent 1D kernel does the work of all of them.
+// Intermediate images come from the buffer pool, are reused by every
+// iteration and are appended to scratch so the caller can release them once
+// the passes are gone. Repeated passes ping-pong between two buffers: the pass
+// that overwrites a block already depends on every block of the previous pass
+// that reads it.
+std::vector<BlurPass> buildBlurPasses(const cv::Mat& src, cv::Mat dst, int kernelSize, double sigma, double** gaussKernel, int repeat, bool exactRounding, std::vector<cv::Mat>& scratch) {
+    std::vector<BlurPass> passes;
+
+    if (repeat == 1 || exactRounding) {
+        cv::Mat pingPong[2];
+        for (int i = 0; i < std::min(repeat - 1, 2); ++i) {
+            pingPong[i] = BufferPool::instance().acquire(src.size(), src.type());
+            scratch.push_back(pingPong[i]);
+        }
+
+        cv::Mat input = src;
+        for (int pass = 0; pass < repeat; ++pass) {
+            cv::Mat output = pass == repeat - 1 ? dst : pingPong[pass % 2];
+            passes.push_back(BlurPass{kernelSize / 2, [=](int y0, int y1) mutable {
+                applyGaussianBlurRows(input, output, kernelSize, gaussKernel, y0, y1);
+            }});
+            input = output;
+        }
+        // The first pass reads the source, which is ready before any task runs
+        passes[0].halo = 0;
+        return passes;
+    }
+
+    std::vector<double> kernel = generateRepeatedGaussianKernel(kernelSize, sigma, repeat);
+    cv::Mat tmp = BufferPool::instance().acquire(src.size(), CV_32FC(src.channels()));
+    scratch.push_back(tmp);
+    passes.push_back(BlurPass{0, [=](int y0, int y1) mutable {
+        applyHorizontalBlurRows(src, tmp, kernel, y0, y1);
+    }});
+    passes.push_back(BlurPass{static_cast<int>(kernel.size()) / 2, [=](int y0, int y1) mutable {
+        applyVerticalBlurRows(tmp, dst, kernel, y0, y1);
+    }});
+    return passes;
+}
+
+// Adds the passes of one eye's blur as row nodes, each reading the previous
+// one; returns the last
+int addBlurNodes(dataflow::Graph& graph, const std::vector<BlurPass>& passes) {
+    int node = -1;
+    for (const BlurPass& pass : passes) {
+        node = graph.addRows("blur.block", node < 0 ? std::vector<int>{} : std::vector<int>{node}, pass.halo, blurStage, pass.rows);
+    }
+    return node;
+}
+
+// Adds the blur of one eye from src to dst: the Gaussian passes, or with a
+// plan the convolution with its kernel as one image node; returns the node
+// that writes dst
+int addEyeBlur(dataflow::Graph& graph, const convolution::Plan* plan, const cv::Mat& src, cv::Mat dst, int kernelSize, double sigma,
+               double** gaussKernel, int repeat, bool exactRounding, std::vector<cv::Mat>& scratch) {
+    if (plan) {
+        return graph.addImage("convolve", {}, [=]() mutable {
+            plan->apply(src, dst);
+        });
+    }
+    return addBlurNodes(graph, buildBlurPasses(src, dst, kernelSize, sigma, gaussKernel, repeat, exactRounding, scratch));
+}
+
+// Adds the unsharp mask and high-pass residual of one eye, computed from its
+// source and its blur, as a row node; either output may be empty. It has no
+// halo, so the graph fuses it into the task of the blur's last pass: each
+// block is sharpened right after it is blurred, while the blurred rows and
+// the source rows the blur read are still in cache.
+int addDetailNode(dataflow::Graph& graph, int blur, const cv::Mat& src, const cv::Mat& blurred, cv::Mat sharpened, cv::Mat highpass,
+                  float amount, int threshold) {
+    return graph.addRows("blur.detail", {blur}, 0, detailStage, [=](int y0, int y1) mutable {
+        int count = src.cols * src.channels();
+        for (int y = y0; y < y1; ++y) {
+            applyDetailRow(src.ptr<uchar>(y), blurred.ptr<uchar>(y), sharpened.empty() ? nullptr : sharpened.ptr<uchar>(y),
+                           highpass.empty() ? nullptr : highpass.ptr<uchar>(y), count, amount, threshold);
+        }
+    });
+}
+
+// Adds the anaglyph mix of the two eyes' blurs as a row node. Mixer is
+// AnaglyphLut for BGR eyes or LumaAnaglyphMixer for luma eyes; it must outlive
+// the graph.
+template <typename Mixer>
+int addMixNode(dataflow::Graph& graph, int leftBlur, int rightBlur, const cv::Mat& left_image, const cv::Mat& right_image,
+               cv::Mat anaglyph_image, const Mixer* mixer) {
+    return graph.addRows("anaglyph.mix", {leftBlur, rightBlur}, 0, mixStage, [=](int y0, int y1) mutable {
+        for (int i = y0; i < y1; i++) {
+            mixer->mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
+        }
+    });
+}
+
+// Normalized 1D Gaussian of sigma, cut off at 3 sigma on either side
+std::vector<double> generateGaussianKernel1D(double sigma) {
+    int halfKernelSize = std::max(1, static_cast<int>(std::ceil(3.0 * sigma)));
+    double rp = 1.0 / (2.0 * sigma * sigma);
+
+    std::vector<double> kernel(2 * halfKernelSize + 1);
+    double total = 0.0;
+    for (int i = -halfKernelSize; i <= halfKernelSize; ++i) {
+        kernel[i + halfKernelSize] = exp(-(i * i) * rp);
+        total += kernel[i + halfKernelSize];
+    }
+    for (double& value : kernel) {
+        value /= total;
     }
+    return kernel;
+}
+
+// Adds the blur of one eye at every sigma of a scale space (increasing) as
+// row nodes writing levels[i]; returns the node of every level. Blurring an
+// image of blur s with sigma d gives blur sqrt(s^2 + d^2), so each level is a
+// separable pass over the previous one with the difference sigma
+// sqrt(sigma_i^2 - sigma_{i-1}^2), a much smaller kernel than sigma_i. The
+// horizontal pass of a level reads no halo and is fused with the vertical pass
+// of the level before. Float intermediates come from the buffer pool and are
+// appended to scratch.
+std::vector<int> addScaleSpaceNodes(dataflow::Graph& graph, const cv::Mat& src, const std::vector<cv::Mat>& levels,
+                                    const std::vector<double>& sigmas, std::vector<cv::Mat>& scratch) {
+    std::vector<int> nodes;
+    cv::Mat input = src;
+    double previous = 0.0;
+    for (size_t i = 0; i < sigmas.size(); ++i) {
+        std::vector<double> kernel = generateGaussianKernel1D(std::sqrt(sigmas[i] * sigmas[i] - previous * previous));
+        cv::Mat tmp = BufferPool::instance().acquire(src.size(), CV_32FC(src.channels()));
+        scratch.push_back(tmp);
+        cv::Mat output = levels[i];
 
-    return dst;
+        int horizontal = graph.addRows("blur.block", nodes.empty() ? std::vector<int>{} : std::vector<int>{nodes.back()}, 0, blurStage,
+                                       [=](int y0, int y1) mutable {
+            applyHorizontalBlurRows(input, tmp, kernel, y0, y1);
+        });
+        nodes.push_back(graph.addRows("blur.block", {horizontal}, static_cast<int>(kernel.size()) / 2, blurStage, [=](int y0, int y1) mutable {
+            applyVerticalBlurRows(tmp, output, kernel, y0, y1);
+        }));
+        input = output;
+        previous = sigmas[i];
+    }
+    return nodes;
 }
 
 void generateGaussianKernel(double** gaussKernel, int kernelSize, double sigma) {
@@ -71,17 +522,61 @@ void generateGaussianKernel(double** gaussKernel, int kernelSize, double sigma)
 int main( int argc, char** argv )
 {
     if (argc < 5) {
-        cerr << "Usage: " << argv[0] << " <image_path> <anaglyph_type> <kernel_size> <sigma>" << endl;
+        cerr << "Usage: " << argv[0] << " <image_path> <anaglyph_type> <kernel_size> <sigma> [--repeat=<n> (default 5)]" << endl;
         return -1;
     }
 
-    // Read the stereo image
-    cv::Mat stereo_image = cv::imread(argv[1], cv::IMREAD_COLOR);
+    // Optional Chrome trace output
+    const char* trace_path = findOption(argc, argv, "--trace");
+    if (trace_path) {
+        trace::enable();
+    }
+
+    // Optional hardware performance counters
+    if (hasFlag(argc, argv, "--perf") && !perf::enable()) {
+        cerr << "Warning: Hardware performance counters unavailable, reporting timing only." << endl;
+    }
+
+    // Optional aligned / huge-page allocator for every image, selected before
+    // the first image is created
+    const char* allocator_name = findOption(argc, argv, "--allocator");
+    if (allocator_name && !installMatAllocator(allocator_name, hasFlag(argc, argv, "--pad-rows"))) {
+        cerr << "Error: Invalid allocator, use default, aligned, thp or hugetlb." << endl;
+        return -1;
+    }
+
+    // Optional raw-frame filter mode: an image path of "-" reads video frames
+    // from stdin and writes the results to stdout (see frame_stream.h)
+    bool streaming = strcmp(argv[1], "-") == 0;
+    StreamFormat stream_format = StreamFormat::BGR24;
+    int stream_width = 0;
+    int stream_height = 0;
+    if (streaming && !parseStreamOptions(argc, argv, stream_format, stream_width, stream_height)) {
+        cerr << "Error: Invalid stream options, use --stream-format=bgr24 with --stream-size=<w>x<h>, or --stream-format=y4m." << endl;
+        return -1;
+    }
+
+    // Optional output width; the input is decoded (and processed) at that size
+    const char* width_option = findOption(argc, argv, "--output-width");
+    int output_width = width_option ? atoi(width_option) : 0;
+    double scale = 1.0;
+
     // Determine the type of anaglyphs to generate
     AnaglyphType anaglyph_type = static_cast<AnaglyphType>(atoi(argv[2]));
 
+    // True and Gray anaglyphs only need the luminance of each eye, so only the
+    // luma plane is decoded and blurred
+    bool luma = anaglyph_type == TRUE || anaglyph_type == GRAY;
+
+    // Read the stereo image
+    cv::Mat stereo_image;
+    if (!streaming) {
+        TRACE_SCOPE("imread");
+        stereo_image = imreadWithWidth(argv[1], 2 * output_width, scale, luma);
+    }
+
     // Check if the image is loaded successfully
-    if (stereo_image.empty()) {
+    if (!streaming && stereo_image.empty()) {
         cerr << "Error: Unable to load image." << endl;
         return -1;
     }
@@ -98,10 +593,6 @@ int main( int argc, char** argv )
         return -1;
     }
 
-    // Split the stereo image into left and right images
-    cv::Mat left_image(stereo_image, cv::Rect(0, 0, stereo_image.cols / 2, stereo_image.rows));
-    cv::Mat right_image(stereo_image, cv::Rect(stereo_image.cols / 2, 0, stereo_image.cols / 2, stereo_image.rows));
-
     int kernelSize = atoi(argv[3]);
     double sigma = atof(argv[4]);
 
@@ -113,99 +604,517 @@ int main( int argc, char** argv )
         return -1;
     }
 
-    // Create an empty anaglyph image with the same size as the left and right images
-    cv::Mat anaglyph_image(left_image.size(), CV_8UC3);
+    // A smaller output keeps the blur radius proportional to the image
+    if (scale < 1.0) {
+        kernelSize = scaleWindowSize(kernelSize, scale);
+        sigma *= scale;
+        cout << "Processing at " << stereo_image.cols << "x" << stereo_image.rows << " (scale " << scale
+             << "), kernel size " << kernelSize << ", sigma " << sigma << endl;
+    }
+
+    // Number of blur passes per eye and whether every pass is rounded to 8 bits.
+    // The default is the 5 passes the original program made by feeding its
+    // output back into the blur.
+    const char* repeat_option = findOption(argc, argv, "--repeat");
+    int repeat = repeat_option ? atoi(repeat_option) : 5;
+    bool exactRounding = hasFlag(argc, argv, "--exact-rounding");
+    if (repeat < 1) {
+        cerr << "Error: Repeat count must be at least 1." << endl;
+        return -1;
+    }
+
+    // Optional kernel replacing the Gaussian blur of both eyes, e.g. a bokeh
+    // disk or a motion streak, convolved by the engine that --engine selects
+    // or, by default, by the one estimated to be fastest for this image
+    const char* kernel_option = findOption(argc, argv, "--kernel");
+    const char* engine_option = findOption(argc, argv, "--engine");
+    cv::Mat custom_kernel;
+    convolution::Engine engine = convolution::Engine::AUTO;
+    if (kernel_option) {
+        custom_kernel = convolution::parseKernel(kernel_option);
+        if (custom_kernel.empty()) {
+            cerr << "Error: Invalid kernel, use gaussian:<size>:<sigma>, disk:<diameter>, motion:<length>:<angle> or file:<path>." << endl;
+            return -1;
+        }
+    }
+    if (engine_option && !convolution::parseEngine(engine_option, engine)) {
+        cerr << "Error: Invalid engine, use auto, direct, separable or fft." << endl;
+        return -1;
+    }
+    if (kernel_option && engine == convolution::Engine::SEPARABLE && !convolution::isSeparable(custom_kernel)) {
+        cerr << "Error: The kernel is not separable." << endl;
+        return -1;
+    }
+
+    // Outputs to compute and write; only the stages they depend on run
+    const char* outputs_option = findOption(argc, argv, "--outputs");
+    bool want_anaglyph = !outputs_option;
+    bool want_blurred = !outputs_option;
+    bool want_reference = !outputs_option;
+    bool want_sharpened = false;
+    bool want_highpass = false;
+    if (outputs_option) {
+        std::stringstream names(outputs_option);
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            if (name == "anaglyph") {
+                want_anaglyph = true;
+            } else if (name == "blurred") {
+                want_blurred = true;
+            } else if (name == "reference") {
+                want_reference = true;
+            } else if (name == "sharpened") {
+                want_sharpened = true;
+            } else if (name == "highpass") {
+                want_highpass = true;
+            } else {
+                cerr << "Error: Invalid output " << name << ", use anaglyph, blurred, reference, sharpened or highpass." << endl;
+                return -1;
+            }
+        }
+    }
+
+    // Strength and threshold (in grey levels) of the unsharp mask
+    const char* amount_option = findOption(argc, argv, "--unsharp-amount");
+    const char* threshold_option = findOption(argc, argv, "--unsharp-threshold");
+    float unsharp_amount = amount_option ? static_cast<float>(atof(amount_option)) : 1.0f;
+    int unsharp_threshold = threshold_option ? atoi(threshold_option) : 0;
+    if (unsharp_amount < 0 || unsharp_threshold < 0 || unsharp_threshold > 255) {
+        cerr << "Error: Invalid unsharp mask, use an amount of at least 0 and a threshold from 0 to 255." << endl;
+        return -1;
+    }
+
+    // Each frame holds both views side by side, as the stereo image does. The
+    // graph is rebuilt per frame since its passes refer to the frame's buffer;
+    // their intermediates come back from the pool every time. Without an
+    // anaglyph only the left eye is blurred.
+    if (streaming) {
+        AnaglyphLut anaglyph_lut(anaglyphCoefficients(anaglyph_type));
+        std::vector<std::vector<double>> kernel_rows(kernelSize, std::vector<double>(kernelSize));
+        std::vector<double*> gauss_kernel(kernelSize);
+        for (int i = 0; i < kernelSize; ++i) {
+            gauss_kernel[i] = kernel_rows[i].data();
+        }
+        generateGaussianKernel(gauss_kernel.data(), kernelSize, sigma);
+
+        cv::Mat anaglyph_image;
+        cv::Mat blurred_image;
+        std::unique_ptr<convolution::Plan> plan;
+        return runFrameStream(stream_format, stream_width, stream_height, [&](const cv::Mat& frame) {
+            cv::Mat left_source(frame, cv::Rect(0, 0, frame.cols / 2, frame.rows));
+            cv::Mat right_source(frame, cv::Rect(frame.cols / 2, 0, frame.cols / 2, frame.rows));
+            anaglyph_image.create(left_source.size(), CV_8UC3);
+            blurred_image.create(left_source.rows, left_source.cols * 2, CV_8UC3);
+            cv::Mat left_image(blurred_image, cv::Rect(0, 0, left_source.cols, left_source.rows));
+            cv::Mat right_image(blurred_image, cv::Rect(left_source.cols, 0, left_source.cols, left_source.rows));
+
+            if (kernel_option && !plan) {
+                plan.reset(new convolution::Plan(custom_kernel, left_source.size(), left_source.channels(), engine));
+            }
+
+            std::vector<cv::Mat> scratch;
+            dataflow::Graph graph(left_source.rows);
+            int left_blur = addEyeBlur(graph, plan.get(), left_source, left_image, kernelSize, sigma, gauss_kernel.data(), repeat, exactRounding, scratch);
+            int right_blur = addEyeBlur(graph, plan.get(), right_source, right_image, kernelSize, sigma, gauss_kernel.data(), repeat, exactRounding, scratch);
+            int output = anaglyph_type == NORMAL ? left_blur
+                                                 : addMixNode(graph, left_blur, right_blur, left_image, right_image, anaglyph_image, &anaglyph_lut);
+            graph.evaluate({output});
+            graph.clear();
+            for (const cv::Mat& buffer : scratch) {
+                BufferPool::instance().release(buffer);
+            }
+            return anaglyph_type == NORMAL ? left_image : anaglyph_image;
+        });
+    }
+
+    // Split the stereo image into left and right images
+    cv::Mat left_source(stereo_image, cv::Rect(0, 0, stereo_image.cols / 2, stereo_image.rows));
+    cv::Mat right_source(stereo_image, cv::Rect(stereo_image.cols / 2, 0, stereo_image.cols / 2, stereo_image.rows));
+
+    // Optional alignment of the views: --align estimates the vertical and
+    // horizontal shift, --align=vertical only the vertical one. Both views
+    // are cropped to their overlap, so the mix below reads shifted rows
+    // without copying. --disparity also writes a coarse disparity map.
+    const char* align_option = findOption(argc, argv, "--align");
+    if (align_option && strcmp(align_option, "both") != 0 && strcmp(align_option, "vertical") != 0) {
+        cerr << "Error: Invalid alignment, use both or vertical." << endl;
+        return -1;
+    }
+    bool write_disparity = hasFlag(argc, argv, "--disparity");
+    bool align = align_option || hasFlag(argc, argv, "--align") || write_disparity;
+    bool align_horizontal = !align_option || strcmp(align_option, "both") == 0;
+    cv::Mat disparity_map;
+    if (align) {
+        TRACE_SCOPE("align");
+        auto align_begin = chrono::high_resolution_clock::now();
+        StereoShift shift = alignStereoViews(left_source, right_source, align_horizontal, write_disparity ? &disparity_map : nullptr);
+        std::chrono::duration<double> align_time = chrono::high_resolution_clock::now() - align_begin;
+        cout << "Alignment: dx " << shift.dx << ", dy " << shift.dy << ", views cropped to " << left_source.cols << "x"
+             << left_source.rows << " (" << align_time.count() * 1000 << " ms)" << endl;
+    }
+
+    // Optional multi-process mode: the outputs live in shared memory and are
+    // written in place by one worker process per band of rows
+    const char* shards_option = findOption(argc, argv, "--shards");
+    int shards = shards_option ? atoi(shards_option) : 0;
+    if (kernel_option && (shards > 0 || hasFlag(argc, argv, "--roofline") || findOption(argc, argv, "--roofline"))) {
+        cerr << "Error: --kernel cannot be combined with --shards or --roofline." << endl;
+        return -1;
+    }
+    std::unique_ptr<SharedImage> shared_anaglyph;
+    std::unique_ptr<SharedImage> shared_blurred;
+    std::unique_ptr<SharedImage> shared_sharpened;
+    std::unique_ptr<SharedImage> shared_highpass;
+    std::vector<ShardTiming> shard_timings;
 
-    cv::Mat blurred_image(stereo_image.size(), CV_8UC3);
+    // Create an empty anaglyph image with the same size as the left and right
+    // images; it stays empty when no anaglyph is requested
+    cv::Mat anaglyph_image;
 
-    std::string anaglyph_name;
+    // The blurred eyes are written straight into the two halves of the
+    // side-by-side output, so no concatenation pass is needed
+    cv::Mat blurred_image;
+
+    // The sharpened eyes and their high-pass residuals, side by side as well;
+    // empty unless requested
+    cv::Mat sharpened_image;
+    cv::Mat highpass_image;
+    if (shards > 0) {
+        shared_anaglyph.reset(new SharedImage(left_source.rows, left_source.cols, CV_8UC3));
+        shared_blurred.reset(new SharedImage(left_source.rows, left_source.cols * 2, left_source.type()));
+        anaglyph_image = shared_anaglyph->mat();
+        blurred_image = shared_blurred->mat();
+        if (want_sharpened) {
+            shared_sharpened.reset(new SharedImage(left_source.rows, left_source.cols * 2, left_source.type()));
+            sharpened_image = shared_sharpened->mat();
+        }
+        if (want_highpass) {
+            shared_highpass.reset(new SharedImage(left_source.rows, left_source.cols * 2, left_source.type()));
+            highpass_image = shared_highpass->mat();
+        }
+    } else {
+        if (want_anaglyph) {
+            anaglyph_image.create(left_source.size(), CV_8UC3);
+        }
+        blurred_image.create(left_source.rows, left_source.cols * 2, left_source.type());
+        if (want_sharpened) {
+            sharpened_image.create(left_source.rows, left_source.cols * 2, left_source.type());
+        }
+        if (want_highpass) {
+            highpass_image.create(left_source.rows, left_source.cols * 2, left_source.type());
+        }
+    }
+    cv::Rect left_half(0, 0, left_source.cols, left_source.rows);
+    cv::Rect right_half(left_source.cols, 0, left_source.cols, left_source.rows);
+    cv::Mat left_image(blurred_image, left_half);
+    cv::Mat right_image(blurred_image, right_half);
+
+    std::string anaglyph_name = anaglyphName(anaglyph_type);
+
+    // Precompute the lookup tables of the selected mode
+    AnaglyphLut anaglyph_lut(anaglyphCoefficients(anaglyph_type));
+    LumaAnaglyphMixer luma_mixer(anaglyph_type == GRAY);
+
+    // Optional scale space instead of the benchmark: the blurred eyes and the
+    // anaglyph at every sigma of --scale-space=<s1,s2,...>, each level blurred
+    // from the previous one, timed against the largest level on its own
+    const char* scale_space_option = findOption(argc, argv, "--scale-space");
+    if (scale_space_option) {
+        std::vector<double> sigmas;
+        std::stringstream list(scale_space_option);
+        std::string item;
+        while (std::getline(list, item, ',')) {
+            sigmas.push_back(atof(item.c_str()) * scale);
+        }
+        for (size_t i = 0; i < sigmas.size(); ++i) {
+            if (sigmas[i] <= 0 || (i > 0 && sigmas[i] <= sigmas[i - 1])) {
+                cerr << "Error: Scale space sigmas must be positive and increasing." << endl;
+                return -1;
+            }
+        }
+        if (sigmas.empty()) {
+            cerr << "Error: Scale space needs at least one sigma." << endl;
+            return -1;
+        }
+
+        // Both eyes of a level side by side, as blurred_image below
+        std::vector<cv::Mat> scratch;
+        std::vector<cv::Mat> blurred_levels;
+        std::vector<cv::Mat> anaglyph_levels;
+        std::vector<cv::Mat> left_levels;
+        std::vector<cv::Mat> right_levels;
+        for (size_t i = 0; i < sigmas.size(); ++i) {
+            blurred_levels.push_back(BufferPool::instance().acquire(left_source.rows, left_source.cols * 2, left_source.type()));
+            anaglyph_levels.push_back(BufferPool::instance().acquire(left_source.size(), CV_8UC3));
+            left_levels.push_back(blurred_levels[i](cv::Rect(0, 0, left_source.cols, left_source.rows)));
+            right_levels.push_back(blurred_levels[i](cv::Rect(left_source.cols, 0, left_source.cols, left_source.rows)));
+        }
+
+        dataflow::Graph cascade(left_source.rows);
+        std::vector<int> left_nodes = addScaleSpaceNodes(cascade, left_source, left_levels, sigmas, scratch);
+        std::vector<int> right_nodes = addScaleSpaceNodes(cascade, right_source, right_levels, sigmas, scratch);
+        std::vector<int> level_outputs;
+        for (size_t i = 0; i < sigmas.size(); ++i) {
+            level_outputs.push_back(left_nodes[i]);
+            level_outputs.push_back(right_nodes[i]);
+            if (anaglyph_type != NORMAL && luma) {
+                level_outputs.push_back(addMixNode(cascade, left_nodes[i], right_nodes[i], left_levels[i], right_levels[i], anaglyph_levels[i], &luma_mixer));
+            } else if (anaglyph_type != NORMAL) {
+                level_outputs.push_back(addMixNode(cascade, left_nodes[i], right_nodes[i], left_levels[i], right_levels[i], anaglyph_levels[i], &anaglyph_lut));
+            }
+        }
+
+        // The largest sigma blurred straight from the source, for comparison
+        cv::Mat direct = BufferPool::instance().acquire(left_source.rows, left_source.cols * 2, left_source.type());
+        dataflow::Graph single(left_source.rows);
+        std::vector<cv::Mat> direct_eyes = {direct(cv::Rect(0, 0, left_source.cols, left_source.rows)),
+                                            direct(cv::Rect(left_source.cols, 0, left_source.cols, left_source.rows))};
+        std::vector<int> single_outputs = addScaleSpaceNodes(single, left_source, {direct_eyes[0]}, {sigmas.back()}, scratch);
+        single_outputs.push_back(addScaleSpaceNodes(single, right_source, {direct_eyes[1]}, {sigmas.back()}, scratch)[0]);
+
+        double cascade_seconds = roofline::bestSeconds([&]() {
+            cascade.invalidate();
+            cascade.evaluate(level_outputs);
+        });
+        double single_seconds = roofline::bestSeconds([&]() {
+            single.invalidate();
+            single.evaluate(single_outputs);
+        });
+        cout << "Scale space: " << sigmas.size() << " levels in " << cascade_seconds * 1000 << " ms, sigma "
+             << sigmas.back() << " alone " << single_seconds * 1000 << " ms" << endl;
+
+        {
+            TRACE_SCOPE("imwrite");
+            for (size_t i = 0; i < sigmas.size(); ++i) {
+                std::ostringstream suffix;
+                suffix << "-sigma" << sigmas[i] << ".jpg";
+                cv::imwrite("output/2.1.2/blurred" + suffix.str(), blurred_levels[i]);
+                if (anaglyph_type != NORMAL) {
+                    cv::imwrite("output/2.1.2/" + anaglyph_name + "Anaglyph-blurred" + suffix.str(), anaglyph_levels[i]);
+                }
+            }
+        }
+
+        cascade.clear();
+        single.clear();
+        for (const cv::Mat& buffer : scratch) {
+            BufferPool::instance().release(buffer);
+        }
+        for (size_t i = 0; i < sigmas.size(); ++i) {
+            BufferPool::instance().release(blurred_levels[i]);
+            BufferPool::instance().release(anaglyph_levels[i]);
+        }
+        BufferPool::instance().release(direct);
+        return 0;
+    }
 
     double** gaussKernel = new double*[kernelSize];
     for (int i = 0; i < kernelSize; ++i) {
         gaussKernel[i] = new double[kernelSize];
     }
-    generateGaussianKernel(gaussKernel, kernelSize, sigma);
+    {
+        TRACE_SCOPE("gaussian.kernel");
+        generateGaussianKernel(gaussKernel, kernelSize, sigma);
+    }
+
+    // The engine for a custom kernel is chosen for the size of the views
+    std::unique_ptr<convolution::Plan> plan;
+    if (kernel_option) {
+        plan.reset(new convolution::Plan(custom_kernel, left_source.size(), left_source.channels(), engine));
+        cout << "Convolution: " << custom_kernel.cols << "x" << custom_kernel.rows << " kernel, "
+             << convolution::engineName(plan->engine()) << " engine (estimates per eye: direct "
+             << plan->estimate(convolution::Engine::DIRECT) * 1000 << " ms, separable "
+             << plan->estimate(convolution::Engine::SEPARABLE) * 1000 << " ms, fft "
+             << plan->estimate(convolution::Engine::FFT) * 1000 << " ms with " << plan->fftSize() << "x"
+             << plan->fftSize() << " tiles)" << endl;
+    }
+
+    // The pipeline as a lazy graph: the row passes of each eye's blur (or its
+    // convolution), each followed by its unsharp mask and high-pass residual
+    // when requested, the mix of the two eyes (the left eye is the result
+    // without an anaglyph) and the built-in blur for reference. Only what the
+    // requested outputs need is evaluated.
+    std::vector<cv::Mat> scratch;
+    cv::Mat gaussianBlurBuildInImage;
+    dataflow::Graph graph(left_image.rows);
+    std::vector<int> detail_nodes;
+    int left_blur = addEyeBlur(graph, plan.get(), left_source, left_image, kernelSize, sigma, gaussKernel, repeat, exactRounding, scratch);
+    if (want_sharpened || want_highpass) {
+        detail_nodes.push_back(addDetailNode(graph, left_blur, left_source, left_image,
+                                             want_sharpened ? sharpened_image(left_half) : cv::Mat(),
+                                             want_highpass ? highpass_image(left_half) : cv::Mat(), unsharp_amount, unsharp_threshold));
+    }
+    int right_blur = addEyeBlur(graph, plan.get(), right_source, right_image, kernelSize, sigma, gaussKernel, repeat, exactRounding, scratch);
+    if (want_sharpened || want_highpass) {
+        detail_nodes.push_back(addDetailNode(graph, right_blur, right_source, right_image,
+                                             want_sharpened ? sharpened_image(right_half) : cv::Mat(),
+                                             want_highpass ? highpass_image(right_half) : cv::Mat(), unsharp_amount, unsharp_threshold));
+    }
+    int anaglyph_node = left_blur;
+    if (anaglyph_type != NORMAL && luma) {
+        anaglyph_node = addMixNode(graph, left_blur, right_blur, left_image, right_image, anaglyph_image, &luma_mixer);
+    } else if (anaglyph_type != NORMAL) {
+        anaglyph_node = addMixNode(graph, left_blur, right_blur, left_image, right_image, anaglyph_image, &anaglyph_lut);
+    }
+    int reference_node = graph.addImage("blur.buildin", {left_blur}, [&]() {
+        gaussianBlurBuildInImage = applyGaussianBlurBuildIn(left_image, kernelSize, sigma);
+    });
+
+    // Row outputs computed by every iteration of the benchmark; the
+    // reference is computed once afterwards
+    std::vector<int> targets;
+    if (want_anaglyph) {
+        targets.push_back(anaglyph_node);
+    }
+    if (want_blurred) {
+        targets.push_back(left_blur);
+        targets.push_back(right_blur);
+    }
+    targets.insert(targets.end(), detail_nodes.begin(), detail_nodes.end());
+
+    // Optional roofline analysis instead of the benchmark: measures the
+    // host's bandwidth and FLOP roofs and places the blur of both eyes and
+    // the mix under them. --roofline=<file> also writes the report as JSON.
+    const char* roofline_json = findOption(argc, argv, "--roofline");
+    if (roofline_json || hasFlag(argc, argv, "--roofline")) {
+        roofline::Machine machine = roofline::measureMachine();
+        double pixels = static_cast<double>(left_image.total());
+        int channels = left_image.channels();
+
+        // A tap is a multiply-add per channel plus the weight total. The 2D
+        // kernel reads and writes each 8-bit image once per pass; the
+        // separable one also writes and reads its float intermediate.
+        roofline::Kernel blur = {"blur", roofline::DOUBLE, 0.0, 0.0, 0.0};
+        if (repeat == 1 || exactRounding) {
+            blur.flops = 2 * repeat * pixels * kernelSize * kernelSize * (1 + 2 * channels);
+            blur.bytes = 2 * repeat * pixels * 2 * channels;
+        } else {
+            double taps = static_cast<double>(generateRepeatedGaussianKernel(kernelSize, sigma, repeat).size());
+            blur.flops = 2 * pixels * 2 * taps * (1 + 2 * channels);
+            blur.bytes = 2 * pixels * (2 * channels + 2 * 4 * channels);
+        }
+        blur.seconds = roofline::bestSeconds([&]() {
+            graph.invalidate();
+            graph.evaluate({left_blur, right_blur});
+        });
+        std::vector<roofline::Kernel> kernels = {blur};
+
+        // As in 2.1.1: a lookup-table term is an add, plus one rounding shift
+        // per channel; the luma path only moves bytes
+        if (anaglyph_type != NORMAL) {
+            anaglyph_image.create(left_image.size(), CV_8UC3);
+            roofline::Kernel mix = {"anaglyph.mix", roofline::INTEGER,
+                                    luma ? 0.0 : pixels * (anaglyph_lut.termCount() + 3),
+                                    pixels * (2 * channels + 3), 0.0};
+            mix.seconds = roofline::bestSeconds([&]() {
+                #pragma omp parallel for
+                for (int i = 0; i < left_image.rows; i++) {
+                    if (luma) {
+                        luma_mixer.mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
+                    } else {
+                        anaglyph_lut.mixRow(left_image.ptr<uchar>(i), right_image.ptr<uchar>(i), anaglyph_image.ptr<uchar>(i), left_image.cols);
+                    }
+                }
+            });
+            kernels.push_back(mix);
+        }
+
+        bool written = roofline::report(machine, kernels, roofline_json);
+        graph.clear();
+        for (const cv::Mat& buffer : scratch) {
+            BufferPool::instance().release(buffer);
+        }
+        for (int i = 0; i < kernelSize; ++i) {
+            delete[] gaussKernel[i];
+        }
+        delete[] gaussKernel;
+        if (!written) {
+            cerr << "Error: Unable to write roofline file." << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Optional result cache keyed by the decoded input and every parameter
+    // that affects the output
+    const char* cache_dir = findOption(argc, argv, "--cache");
+    const char* cache_size = findOption(argc, argv, "--cache-size");
+    std::unique_ptr<ResultCache> cache;
+    uint64_t input_hash = 0;
+    std::ostringstream operation;
+    operation.precision(17);
+    operation << "2.1.2 blur type=" << anaglyph_type << " kernel=" << kernelSize << " sigma=" << sigma
+              << " repeat=" << repeat << " exact=" << exactRounding << " engine=" << ENGINE_VERSION;
+    if (align) {
+        operation << " align=" << (align_horizontal ? "both" : "vertical");
+    }
+    if (kernel_option) {
+        operation << " convolve=" << kernel_option << " " << convolution::engineName(plan->engine());
+    }
+    if (outputs_option) {
+        operation << " outputs=" << want_anaglyph << want_blurred << want_reference;
+    }
+    if (want_sharpened || want_highpass) {
+        operation << " detail=" << want_sharpened << want_highpass << " amount=" << unsharp_amount << " threshold=" << unsharp_threshold;
+    }
+    // The requested outputs, in the order the cache stores them
+    std::vector<cv::Mat*> outputs;
+    if (want_anaglyph) {
+        outputs.push_back(&anaglyph_image);
+    }
+    if (want_blurred) {
+        outputs.push_back(&blurred_image);
+    }
+    if (want_reference) {
+        outputs.push_back(&gaussianBlurBuildInImage);
+    }
+    if (want_sharpened) {
+        outputs.push_back(&sharpened_image);
+    }
+    if (want_highpass) {
+        outputs.push_back(&highpass_image);
+    }
+    std::vector<cv::Mat> cached_outputs;
+    bool cache_hit = false;
+    if (cache_dir) {
+        TRACE_SCOPE("cache.lookup");
+        cache.reset(new ResultCache(cache_dir, (cache_size ? strtoull(cache_size, nullptr, 10) : 1024) * 1024 * 1024));
+        input_hash = ResultCache::hashImage(stereo_image);
+        cache_hit = cache->lookup(input_hash, operation.str(), outputs.size(), cached_outputs);
+    }
 
     // Start the timer
     auto begin = chrono::high_resolution_clock::now();
 
     // Number of iterations
-    const int iter = 5;
-
-    // Perform the operation iter times
-    for (int it = 0; it < iter; it++) {
-
-        left_image = applyGaussianBlur(left_image, kernelSize, gaussKernel);
-        right_image = applyGaussianBlur(right_image, kernelSize, gaussKernel);
-
-        cv::hconcat(left_image, right_image, blurred_image);
-
-        if (anaglyph_type == NORMAL) {
-            anaglyph_name = "None";
-            anaglyph_image = left_image;
-            continue;
-        }
-
-        // Parallelize the outer loop using OpenMP
-        #pragma omp parallel for
-        for (int i = 0; i < left_image.rows; i++) {
-            for (int j = 0; j < left_image.cols; j++) {
-                // Get the color channels for the left and right pixels
-                cv::Vec3b left_pixel = left_image.at<cv::Vec3b>(i, j);
-                cv::Vec3b right_pixel = right_image.at<cv::Vec3b>(i, j);
-
-                switch (anaglyph_type) {
-                    case TRUE:
-                        // True Anaglyphs
-                        anaglyph_name = "True";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.299 * right_pixel[2] + 0.578 * right_pixel[1] + 0.114 * right_pixel[0],
-                            0,
-                            0.299 * left_pixel[2] + 0.578 * left_pixel[1] + 0.114 * left_pixel[0]
-                        );
-                        break;
-                    case GRAY:
-                        // Gray Anaglyphs
-                        anaglyph_name = "Gray";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.299 * right_pixel[2] + 0.578 * right_pixel[1] + 0.114 * right_pixel[0],
-                            0.299 * right_pixel[2] + 0.578 * right_pixel[1] + 0.114 * right_pixel[0],
-                            0.299 * left_pixel[2] + 0.578 * left_pixel[1] + 0.114 * left_pixel[0]
-                        );
-                        break;
-                    case COLOR:
-                        // Color Anaglyphs
-                        anaglyph_name = "Color";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            right_pixel[2],
-                            right_pixel[1],
-                            left_pixel[0]
-                        );
-                        break;
-                    case HALFCOLOR:
-                        // Half Color Anaglyphs
-                        anaglyph_name = "Half Color";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.299* right_pixel[2] + 0.578 * right_pixel[1] + 0.114 * right_pixel[0],
-                            right_pixel[1],
-                            left_pixel[0]
-                        );
-                        break;
-                    case OPTIMIZED:
-                        // Optimized Anaglyphs
-                        anaglyph_name = "Optimized";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = cv::Vec3b(
-                            0.7 * right_pixel[1] + 0.3 * right_pixel[0],
-                            right_pixel[1],
-                            left_pixel[0]
-                        );
-                        break;
-                    default:
-                        anaglyph_name = "None";
-                        anaglyph_image.at<cv::Vec3b>(i, j) = left_image.at<cv::Vec3b>(i, j);
-                }
+    // The passes of the blur are --repeat, so one iteration computes the
+    // whole result
+    const int iter = 1;
+
+    // Perform the operation iter times; each shard runs all iterations on its
+    // own band
+    if (shards > 0 && !cache_hit) {
+        TRACE_SCOPE("shards");
+        shard_timings = runShards(shards, left_image.rows, [&](int y0, int y1) {
+            for (int it = 0; it < iter; it++) {
+                graph.evaluateRows(targets, y0, y1);
             }
+        });
+        if (!allShardsOk(shard_timings)) {
+            printShardTimings(shard_timings, cerr);
+            cerr << "Error: A shard worker failed." << endl;
+            return -1;
         }
+        graph.markComputed(targets);
+    }
+    for (int it = 0; it < iter && !cache_hit && shards <= 0; it++) {
+        TRACE_SCOPE("iteration");
+        graph.invalidate();
+        graph.evaluate(targets);
+    }
+
+    if (anaglyph_type == NORMAL) {
+        anaglyph_image = left_image;
     }
 
     // Stop the timer
@@ -214,30 +1123,109 @@ int main( int argc, char** argv )
     // Calculate the time difference
     std::chrono::duration<double> diff = end - begin;
 
-    cv::Mat gaussianBlurBuildInImage = applyGaussianBlurBuildIn(left_image, kernelSize, sigma);
+    if (cache_hit) {
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            *outputs[i] = cached_outputs[i];
+        }
+    } else {
+        if (want_reference) {
+            graph.evaluate({reference_node});
+        }
+        if (cache) {
+            TRACE_SCOPE("cache.store");
+            std::vector<cv::Mat> stored;
+            for (cv::Mat* output : outputs) {
+                stored.push_back(*output);
+            }
+            cache->store(input_hash, operation.str(), stored);
+        }
+    }
 
     // Display the original images
     cv::imshow("Input Image", stereo_image);
 
     // Display the output image
-    cv::imshow("Gaussian Blur By Build-in Function Image", gaussianBlurBuildInImage);
-    cv::imshow("Gaussian Blurred Image", blurred_image);
-    cv::imshow("Gaussian + " + anaglyph_name + " Anaglyph Image", anaglyph_image);
+    if (want_reference) {
+        cv::imshow("Gaussian Blur By Build-in Function Image", gaussianBlurBuildInImage);
+    }
+    if (want_blurred) {
+        cv::imshow("Gaussian Blurred Image", blurred_image);
+    }
+    if (want_anaglyph) {
+        cv::imshow("Gaussian + " + anaglyph_name + " Anaglyph Image", anaglyph_image);
+    }
+    if (want_sharpened) {
+        cv::imshow("Unsharp Masked Image", sharpened_image);
+    }
+    if (want_highpass) {
+        cv::imshow("High-Pass Image", highpass_image);
+    }
 
     // Save the anaglyph image
     std::string filename =  "output/2.1.2/" + anaglyph_name + "Anaglyph-blurred.jpg";
-    cv::imwrite(filename, anaglyph_image);
-
     std::string blurred_img_name =  "output/2.1.2/blurred.jpg";
-    cv::imwrite(blurred_img_name, blurred_image);
-
     std::string buildin_blurred_img_name =  "output/2.1.2/build-in-blurred.jpg";
-    cv::imwrite(buildin_blurred_img_name, gaussianBlurBuildInImage);
+    {
+        TRACE_SCOPE("imwrite");
+        if (want_anaglyph) {
+            cv::imwrite(filename, anaglyph_image);
+        }
+        if (want_blurred) {
+            cv::imwrite(blurred_img_name, blurred_image);
+        }
+        if (want_reference) {
+            cv::imwrite(buildin_blurred_img_name, gaussianBlurBuildInImage);
+        }
+        if (want_sharpened) {
+            cv::imwrite("output/2.1.2/sharpened.jpg", sharpened_image);
+        }
+        if (want_highpass) {
+            cv::imwrite("output/2.1.2/highpass.jpg", highpass_image);
+        }
+        if (!disparity_map.empty()) {
+            cv::imwrite("output/2.1.2/disparity.png", disparity_map);
+        }
+    }
 
     // Display performance metrics
-    cout << "Total time for " << iter << " iterations: " << diff.count() << " s" << endl;
-    cout << "Time for 1 iteration: " << diff.count() / iter << " s" << endl;
-    cout << "IPS: " << iter / diff.count() << endl;
+    if (cache_hit) {
+        cout << "Result served from cache" << endl;
+    } else {
+        cout << "Total time for " << iter << (iter == 1 ? " iteration: " : " iterations: ") << diff.count() << " s" << endl;
+        cout << "Time for 1 iteration: " << diff.count() / iter << " s" << endl;
+        cout << "IPS: " << iter / diff.count() << endl;
+        bool both_eyes = want_blurred || !detail_nodes.empty() || (want_anaglyph && anaglyph_type != NORMAL);
+        perf::report(blurStage, (both_eyes ? 2.0 : 1.0) * iter * left_image.total());
+        if (want_anaglyph && anaglyph_type != NORMAL) {
+            perf::report(mixStage, static_cast<double>(iter) * left_image.total());
+        }
+        if (!detail_nodes.empty()) {
+            perf::report(detailStage, 2.0 * iter * left_image.total());
+        }
+        printShardTimings(shard_timings, cout);
+    }
+    if (cache) {
+        cache->printStats(cout);
+    }
+
+    // Hand the intermediates back to the pool once no pass refers to them
+    graph.clear();
+    for (const cv::Mat& buffer : scratch) {
+        BufferPool::instance().release(buffer);
+    }
+    scratch.clear();
+    if (hasFlag(argc, argv, "--pool-stats")) {
+        BufferPool::instance().printStats(cout);
+    }
+
+    // Write the per-stage trace
+    if (trace_path) {
+        if (trace::writeChromeTrace(trace_path)) {
+            cout << "Trace written to " << trace_path << endl;
+        } else {
+            cerr << "Error: Unable to write trace file." << endl;
+        }
+    }
 
     // Wait for a key press before closing the windows
     cv::waitKey();
@@ -3,54 +3,383 @@
 #include <string>
 #include <cmath>
 #include <chrono>  // for high_resolution_clock
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
 #include <omp.h> // OpenMP header
+#include "buffer_pool.h"
+#include "cli_options.h"
+#include "covariance_denoise.h"
+#include "cpu_dispatch.h"
+#include "frame_stream.h"
+#include "mat_allocator.h"
+#include "perf_counters.h"
+#include "result_cache.h"
+#include "roofline.h"
+#include "scaled_imread.h"
+#include "shard.h"
+#include "temporal_denoise.h"
+#include "tile_scheduler.h"
+#include "trace.h"
 
 using namespace std;
 
-cv::Mat calculateCovarianceMatrix(const cv::Mat& image, int x, int y, int neighborhoodSize) {
-    int halfSize = neighborhoodSize / 2;
-    int xStart = std::max(0, x - halfSize);
-    int yStart = std::max(0, y - halfSize);
-    int xEnd = std::min(image.cols, x + halfSize);
-    int yEnd = std::min(image.rows, y + halfSize);
+perf::Stage denoiseStage("denoise");
+perf::Stage bilateralStage("denoise.bilateral");
 
-    cv::Mat neighborhood = image(cv::Rect(xStart, yStart, xEnd - xStart, yEnd - yStart)).clone();
-    cv::Mat reshapedNeighborhood = neighborhood.reshape(1, neighborhood.total());
+// Bump whenever a change alters the output; it is part of the result cache key
+const int ENGINE_VERSION = 1;
 
-    cv::Mat mean, covariance;
-    cv::calcCovarMatrix(reshapedNeighborhood, covariance, mean, cv::COVAR_NORMAL | cv::COVAR_ROWS | cv::COVAR_SCALE);
-    return covariance;
+// Per-thread busy and idle time of the covariance denoise
+ScheduleStats denoiseSchedule;
+
+// Split the covariance denoise into cost-estimated tiles scheduled
+// largest-first with work stealing (default), or into rows split statically
+bool balancedDenoise = true;
+
+// Tiles of at most 32 x 32 pixels, smaller when that leaves fewer than 8 per
+// thread, with their cost estimated from the kernel size at one pixel per
+// 8 x 8 cell
+std::vector<ScheduledTile> denoiseTiles(const cv::Mat& src, int neighborhoodSize, double factorRatio, int threads) {
+    TRACE_SCOPE("denoise.cost");
+    int edge = 32;
+    while (edge > 8 && static_cast<long>((src.cols + edge - 1) / edge) * ((src.rows + edge - 1) / edge) < 8L * threads) {
+        edge /= 2;
+    }
+    std::vector<ScheduledTile> tiles;
+    for (int y = 0; y < src.rows; y += edge) {
+        for (int x = 0; x < src.cols; x += edge) {
+            tiles.push_back({cv::Rect(x, y, std::min(edge, src.cols - x), std::min(edge, src.rows - y)), 0.0});
+        }
+    }
+    #pragma omp parallel for
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        tiles[t].cost = estimateDenoiseCost(src, neighborhoodSize, factorRatio, tiles[t].rect, 8);
+    }
+    return tiles;
 }
 
+// The result comes from the buffer pool; release it there when done
 cv::Mat denoiseByCovariance(const cv::Mat& src, int neighborhoodSize, double factorRatio) {
-    cv::Mat dst(src.size(), src.type());
+    cv::Mat dst = BufferPool::instance().acquire(src.size(), src.type());
 
-    #pragma omp parallel for
+    if (balancedDenoise) {
+        TileScheduler scheduler(denoiseTiles(src, neighborhoodSize, factorRatio, omp_get_max_threads()), omp_get_max_threads());
+        #pragma omp parallel
+        {
+        TRACE_SCOPE("denoise.tiles");
+        PERF_SCOPE(denoiseStage);
+        scheduler.work([&](const cv::Rect& tile) {
+            denoiseByCovarianceRect(src, dst, neighborhoodSize, factorRatio, tile);
+        });
+        }
+        scheduler.report(denoiseSchedule);
+        return dst;
+    }
+
+    // Each thread records its own span so load imbalance shows up in the trace
+    std::vector<double> busy(omp_get_max_threads(), 0.0);
+    std::vector<long> rows(omp_get_max_threads(), 0);
+    auto begin = chrono::steady_clock::now();
+    #pragma omp parallel
+    {
+    TRACE_SCOPE("denoise.rows");
+    PERF_SCOPE(denoiseStage);
+    int self = omp_get_thread_num();
+    auto start = chrono::steady_clock::now();
+    #pragma omp for nowait
     for (int y = 0; y < src.rows; ++y) {
-        for (int x = 0; x < src.cols; ++x) {
-            cv::Mat covariance = calculateCovarianceMatrix(src, x, y, neighborhoodSize);
-            double determinant = cv::determinant(covariance);
-
-            int kernelSize;
-            if (determinant != 0) {
-                kernelSize = static_cast<int>(std::round(factorRatio / determinant));
-                kernelSize = kernelSize % 2 == 0 ? kernelSize + 1 : kernelSize;
-            } else {
-                kernelSize = neighborhoodSize;
+        denoiseByCovarianceRows(src, dst, neighborhoodSize, factorRatio, y, y + 1);
+        ++rows[self];
+    }
+    busy[self] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    double total = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    for (size_t t = 0; t < busy.size(); ++t) {
+        denoiseSchedule.add(static_cast<int>(t), busy[t], std::max(0.0, total - busy[t]), rows[t], 0);
+    }
+
+    return dst;
+}
+
+// Bilateral grid denoise (Paris & Durand): pixels are splatted into a grid
+// downsampled by sigmaSpace in x and y and by sigmaRange in luma, the grid is
+// blurred with a [1 4 6 4 1] / 16 kernel (sigma of one cell) along all three
+// axes, and every pixel is sliced back out with trilinear interpolation. Each
+// cell holds the summed B, G, R and the pixel count, so slicing divides out
+// the weight. Cost is linear in the pixel count plus the grid size, and the
+// grid shrinks as sigmaSpace grows.
+const int GRID_PADDING = 2;
+
+CPU_DISPATCH_INLINE int gridLuma(const uchar* pixel) {
+    return (29 * pixel[0] + 150 * pixel[1] + 77 * pixel[2]) >> 8;
+}
+
+// Cells of the grid along x, y and luma, padding included
+struct GridSize {
+    int width;
+    int height;
+    int depth;
+};
+
+GridSize bilateralGridSize(const cv::Mat& src, double sigmaSpace, double sigmaRange) {
+    return GridSize{
+        static_cast<int>((src.cols - 1) / sigmaSpace) + 1 + 2 * GRID_PADDING,
+        static_cast<int>((src.rows - 1) / sigmaSpace) + 1 + 2 * GRID_PADDING,
+        static_cast<int>(255 / sigmaRange) + 1 + 2 * GRID_PADDING
+    };
+}
+
+enum GridAxis {
+    GRID_RANGE = 0,
+    GRID_X,
+    GRID_Y
+};
+
+const float GRID_WEIGHTS[5] = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16};
+
+// Blurs cell (gx, gz) of grid row gy along axis, dropping the taps that fall
+// outside the grid
+CPU_DISPATCH_INLINE void blurGridCell(const cv::Mat& src, cv::Mat& dst, int gridWidth, int gridDepth, GridAxis axis, int gy, int gx, int gz) {
+    const int extent = axis == GRID_RANGE ? gridDepth : (axis == GRID_X ? gridWidth : src.rows);
+    // Floats between neighbouring cells of the axis within a grid row
+    const int step = axis == GRID_RANGE ? 4 : gridDepth * 4;
+    int cell = (gx * gridDepth + gz) * 4;
+    int position = axis == GRID_RANGE ? gz : (axis == GRID_X ? gx : gy);
+    float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (int k = std::max(-2, -position); k <= std::min(2, extent - 1 - position); ++k) {
+        const float* in = axis == GRID_Y ? src.ptr<float>(gy + k) + cell : src.ptr<float>(gy) + cell + k * step;
+        for (int c = 0; c < 4; ++c) {
+            sum[c] += GRID_WEIGHTS[k + 2] * in[c];
+        }
+    }
+    for (int c = 0; c < 4; ++c) {
+        dst.ptr<float>(gy)[cell + c] = sum[c];
+    }
+}
+
+// Writes count floats of out, each the weighted sum of the floats at the same
+// index of the five inputs, added in the same order as blurGridCell
+CPU_DISPATCH_INLINE void blurGridRun(const float* const* in, float* out, int count) {
+    std::fill(out, out + count, 0.0f);
+    for (int k = 0; k < 5; ++k) {
+        const float* values = in[k];
+        for (int f = 0; f < count; ++f) {
+            out[f] += GRID_WEIGHTS[k] * values[f];
+        }
+    }
+}
+
+// Blurs grid row gy along axis. Cells whose five taps all lie inside the grid
+// form contiguous runs of floats (the whole row along y, all but two cells at
+// either end along x, and along luma the same within each column of cells),
+// which are blurred along the run so the loop vectorizes.
+CPU_DISPATCH_INLINE void blurGridRowKernel(const cv::Mat& src, cv::Mat& dst, int gridWidth, int gridDepth, GridAxis axis, int gy) {
+    const int step = axis == GRID_RANGE ? 4 : gridDepth * 4;
+    const float* in[5];
+    float* out = dst.ptr<float>(gy);
+
+    if (axis == GRID_Y) {
+        if (gy < 2 || gy >= src.rows - 2) {
+            for (int gx = 0; gx < gridWidth; ++gx) {
+                for (int gz = 0; gz < gridDepth; ++gz) {
+                    blurGridCell(src, dst, gridWidth, gridDepth, axis, gy, gx, gz);
+                }
             }
+            return;
+        }
+        for (int k = 0; k < 5; ++k) {
+            in[k] = src.ptr<float>(gy + k - 2);
+        }
+        blurGridRun(in, out, gridWidth * gridDepth * 4);
+        return;
+    }
+
+    // Columns of cells (x) or cells within a column (luma) along the axis
+    const int extent = axis == GRID_X ? gridWidth : gridDepth;
+    const int interiorBegin = std::min(2, extent);
+    const int interiorEnd = std::max(interiorBegin, extent - 2);
+    for (int gx = 0; gx < gridWidth; ++gx) {
+        for (int gz = 0; gz < gridDepth; ++gz) {
+            int position = axis == GRID_X ? gx : gz;
+            if (position < interiorBegin || position >= interiorEnd) {
+                blurGridCell(src, dst, gridWidth, gridDepth, axis, gy, gx, gz);
+            }
+        }
+    }
+    const int runs = axis == GRID_X ? 1 : gridWidth;
+    const int length = (interiorEnd - interiorBegin) * (axis == GRID_X ? gridDepth * 4 : 4);
+    for (int run = 0; run < runs; ++run) {
+        int first = axis == GRID_X ? interiorBegin * gridDepth * 4 : (run * gridDepth + interiorBegin) * 4;
+        for (int k = 0; k < 5; ++k) {
+            in[k] = src.ptr<float>(gy) + first + (k - 2) * step;
+        }
+        blurGridRun(in, out + first, length);
+    }
+}
 
-            // GaussianBlur kernel size should be positive and odd
-            kernelSize = std::max(1, kernelSize);
-            kernelSize |= 1; // Ensure it's odd
+CPU_DISPATCH(blurGridRow, blurGridRowKernel, (const cv::Mat& src, cv::Mat& dst, int gridWidth, int gridDepth, GridAxis axis, int gy),
+             (src, dst, gridWidth, gridDepth, axis, gy))
 
-            cv::GaussianBlur(src(cv::Rect(x, y, 1, 1)), dst(cv::Rect(x, y, 1, 1)), cv::Size(kernelSize, kernelSize), 0, 0);
+// Blurs the grid along one axis from src into dst. Called inside a parallel
+// region; the loop over grid rows ends with a barrier.
+void blurGridAxis(const cv::Mat& src, cv::Mat& dst, int gridWidth, int gridDepth, GridAxis axis) {
+    #pragma omp for
+    for (int gy = 0; gy < src.rows; ++gy) {
+        blurGridRow(src, dst, gridWidth, gridDepth, axis, gy);
+    }
+}
 
+// Row y of the slice: every pixel of src interpolated trilinearly from the
+// blurred grid into dst
+CPU_DISPATCH_INLINE void sliceGridRowKernel(const cv::Mat& src, const cv::Mat& blurred, cv::Mat& dst, int gridDepth, double sigmaSpace,
+                                            double sigmaRange, int y) {
+    float fy = static_cast<float>(y / sigmaSpace) + GRID_PADDING;
+    int gy = static_cast<int>(fy);
+    float wy = fy - gy;
+    const uchar* pixel = src.ptr<uchar>(y);
+    uchar* out = dst.ptr<uchar>(y);
+    for (int x = 0; x < src.cols; ++x, pixel += 3, out += 3) {
+        float fx = static_cast<float>(x / sigmaSpace) + GRID_PADDING;
+        float fz = static_cast<float>(gridLuma(pixel) / sigmaRange) + GRID_PADDING;
+        int gx = static_cast<int>(fx);
+        int gz = static_cast<int>(fz);
+        float wx = fx - gx;
+        float wz = fz - gz;
+
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (int dy = 0; dy < 2; ++dy) {
+            const float* cells = blurred.ptr<float>(gy + dy);
+            for (int dx = 0; dx < 2; ++dx) {
+                for (int dz = 0; dz < 2; ++dz) {
+                    float weight = (dy ? wy : 1 - wy) * (dx ? wx : 1 - wx) * (dz ? wz : 1 - wz);
+                    const float* cell = cells + ((gx + dx) * gridDepth + gz + dz) * 4;
+                    for (int c = 0; c < 4; ++c) {
+                        sum[c] += weight * cell[c];
+                    }
+                }
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            out[c] = sum[3] > 1e-6f ? cv::saturate_cast<uchar>(sum[c] / sum[3]) : pixel[c];
         }
     }
+}
 
+CPU_DISPATCH(sliceGridRow, sliceGridRowKernel,
+             (const cv::Mat& src, const cv::Mat& blurred, cv::Mat& dst, int gridDepth, double sigmaSpace, double sigmaRange, int y),
+             (src, blurred, dst, gridDepth, sigmaSpace, sigmaRange, y))
+
+// The result comes from the buffer pool; release it there when done
+cv::Mat denoiseByBilateralGrid(const cv::Mat& src, double sigmaSpace, double sigmaRange) {
+    const GridSize size = bilateralGridSize(src, sigmaSpace, sigmaRange);
+    const int gridWidth = size.width;
+    const int gridHeight = size.height;
+    const int gridDepth = size.depth;
+
+    // Grid rows are gy; a row holds gridWidth x gridDepth cells of 4 floats
+    cv::Mat grid = BufferPool::instance().acquire(gridHeight, gridWidth * gridDepth, CV_32FC4);
+    cv::Mat blurred = BufferPool::instance().acquire(gridHeight, gridWidth * gridDepth, CV_32FC4);
+    cv::Mat dst = BufferPool::instance().acquire(src.size(), src.type());
+
+    #pragma omp parallel
+    {
+    TRACE_SCOPE("denoise.bilateral");
+    PERF_SCOPE(bilateralStage);
+
+    // Splat: every thread owns whole grid rows, so no two threads add to the
+    // same cell
+    #pragma omp for
+    for (int gy = 0; gy < gridHeight; ++gy) {
+        float* cells = grid.ptr<float>(gy);
+        std::fill(cells, cells + gridWidth * gridDepth * 4, 0.0f);
+        int yBegin = std::max(0, static_cast<int>(std::ceil((gy - GRID_PADDING - 0.5) * sigmaSpace)) - 1);
+        int yEnd = std::min(src.rows, static_cast<int>(std::ceil((gy - GRID_PADDING + 0.5) * sigmaSpace)) + 1);
+        for (int y = yBegin; y < yEnd; ++y) {
+            if (static_cast<int>(y / sigmaSpace + 0.5) + GRID_PADDING != gy) {
+                continue;
+            }
+            const uchar* pixel = src.ptr<uchar>(y);
+            for (int x = 0; x < src.cols; ++x, pixel += 3) {
+                int gx = static_cast<int>(x / sigmaSpace + 0.5) + GRID_PADDING;
+                int gz = static_cast<int>(gridLuma(pixel) / sigmaRange + 0.5) + GRID_PADDING;
+                float* cell = cells + (gx * gridDepth + gz) * 4;
+                cell[0] += pixel[0];
+                cell[1] += pixel[1];
+                cell[2] += pixel[2];
+                cell[3] += 1.0f;
+            }
+        }
+    }
+
+    // Blur along range, x and y; the implicit barriers order the passes
+    blurGridAxis(grid, blurred, gridWidth, gridDepth, GRID_RANGE);
+    blurGridAxis(blurred, grid, gridWidth, gridDepth, GRID_X);
+    blurGridAxis(grid, blurred, gridWidth, gridDepth, GRID_Y);
+
+    // Slice with trilinear interpolation
+    #pragma omp for nowait
+    for (int y = 0; y < src.rows; ++y) {
+        sliceGridRow(src, blurred, dst, gridDepth, sigmaSpace, sigmaRange, y);
+    }
+    }
+
+    BufferPool::instance().release(grid);
+    BufferPool::instance().release(blurred);
     return dst;
 }
 
+// Adds zero-mean Gaussian noise with a fixed seed, so runs are comparable
+cv::Mat addGaussianNoise(const cv::Mat& src, double sigma) {
+    std::mt19937 generator(2024);
+    std::normal_distribution<double> noise(0.0, sigma);
+    cv::Mat noisy(src.size(), src.type());
+    for (int y = 0; y < src.rows; ++y) {
+        for (int i = 0; i < src.cols * src.channels(); ++i) {
+            noisy.ptr<uchar>(y)[i] = cv::saturate_cast<uchar>(src.ptr<uchar>(y)[i] + noise(generator));
+        }
+    }
+    return noisy;
+}
+
+// Denoises a noisy copy of the input with both engines and prints the time
+// per frame and the PSNR against the input, for the covariance engine and the
+// bilateral grid at several sigma settings
+void compareEngines(const cv::Mat& clean, int neighborhoodSize, double factorRatio) {
+    const double noiseSigma = 10.0;
+    const int runs = 3;
+    const double settings[][2] = {{4, 10}, {8, 20}, {16, 30}, {32, 50}};
+
+    cv::Mat noisy = addGaussianNoise(clean, noiseSigma);
+    cout << "Noisy input (noise sigma " << noiseSigma << "): PSNR " << cv::PSNR(clean, noisy) << " dB" << endl;
+
+    auto measure = [&](const std::string& name, const std::function<cv::Mat()>& engine) {
+        cv::Mat result;
+        auto begin = chrono::high_resolution_clock::now();
+        for (int run = 0; run < runs; ++run) {
+            BufferPool::instance().release(result);
+            result = engine();
+        }
+        std::chrono::duration<double> diff = chrono::high_resolution_clock::now() - begin;
+        cout << name << ": " << 1000.0 * diff.count() / runs << " ms, PSNR " << cv::PSNR(clean, result) << " dB" << endl;
+        BufferPool::instance().release(result);
+    };
+
+    std::ostringstream name;
+    name << "Covariance neighborhood=" << neighborhoodSize << " factor=" << factorRatio;
+    measure(name.str(), [&]() {
+        return denoiseByCovariance(noisy, neighborhoodSize, factorRatio);
+    });
+    for (const auto& setting : settings) {
+        name.str("");
+        name << "Bilateral grid sigma_space=" << setting[0] << " sigma_range=" << setting[1];
+        measure(name.str(), [&]() {
+            return denoiseByBilateralGrid(noisy, setting[0], setting[1]);
+        });
+    }
+}
+
 int main( int argc, char** argv )
 {
     if (argc < 4) {
@@ -58,11 +387,50 @@ int main( int argc, char** argv )
         return -1;
     }
 
+    // Optional Chrome trace output
+    const char* trace_path = findOption(argc, argv, "--trace");
+    if (trace_path) {
+        trace::enable();
+    }
+
+    // Optional hardware performance counters
+    if (hasFlag(argc, argv, "--perf") && !perf::enable()) {
+        cerr << "Warning: Hardware performance counters unavailable, reporting timing only." << endl;
+    }
+
+    // Optional aligned / huge-page allocator for every image, selected before
+    // the first image is created
+    const char* allocator_name = findOption(argc, argv, "--allocator");
+    if (allocator_name && !installMatAllocator(allocator_name, hasFlag(argc, argv, "--pad-rows"))) {
+        cerr << "Error: Invalid allocator, use default, aligned, thp or hugetlb." << endl;
+        return -1;
+    }
+
+    // Optional raw-frame filter mode: an image path of "-" reads video frames
+    // from stdin and writes the results to stdout (see frame_stream.h)
+    bool streaming = strcmp(argv[1], "-") == 0;
+    StreamFormat stream_format = StreamFormat::BGR24;
+    int stream_width = 0;
+    int stream_height = 0;
+    if (streaming && !parseStreamOptions(argc, argv, stream_format, stream_width, stream_height)) {
+        cerr << "Error: Invalid stream options, use --stream-format=bgr24 with --stream-size=<w>x<h>, or --stream-format=y4m." << endl;
+        return -1;
+    }
+
+    // Optional output width; the input is decoded (and processed) at that size
+    const char* width_option = findOption(argc, argv, "--output-width");
+    int output_width = width_option ? atoi(width_option) : 0;
+    double scale = 1.0;
+
     // Read the stereo image
-    cv::Mat stereo_image = cv::imread(argv[1], cv::IMREAD_COLOR);
+    cv::Mat stereo_image;
+    if (!streaming) {
+        TRACE_SCOPE("imread");
+        stereo_image = imreadWithWidth(argv[1], output_width, scale);
+    }
 
     // Check if the image is loaded successfully
-    if (stereo_image.empty()) {
+    if (!streaming && stereo_image.empty()) {
         cerr << "Error: Unable to load image." << endl;
         return -1;
     }
@@ -87,8 +455,173 @@ int main( int argc, char** argv )
         return -1;
     }
 
+    // Denoise engine: the covariance-adaptive one (default), the
+    // edge-preserving bilateral grid or, for streams, the recursive temporal
+    // filter
+    const char* mode_option = findOption(argc, argv, "--mode");
+    bool bilateral = mode_option && strcmp(mode_option, "bilateral") == 0;
+    bool temporal = mode_option && strcmp(mode_option, "temporal") == 0;
+    if (mode_option && !bilateral && !temporal && strcmp(mode_option, "covariance") != 0) {
+        cerr << "Error: Invalid mode, use covariance, bilateral or temporal." << endl;
+        return -1;
+    }
+    if (temporal && !streaming) {
+        cerr << "Error: The temporal mode needs a video stream (image path -)." << endl;
+        return -1;
+    }
+    const char* alpha_option = findOption(argc, argv, "--temporal-alpha");
+    const char* motion_option = findOption(argc, argv, "--motion-threshold");
+    double temporalAlpha = alpha_option ? atof(alpha_option) : 0.125;
+    double motionThreshold = motion_option ? atof(motion_option) : 4.0;
+    if (temporalAlpha <= 0 || temporalAlpha > 1 || motionThreshold <= 1) {
+        cerr << "Error: Temporal alpha must be in (0, 1] and the motion threshold greater than 1." << endl;
+        return -1;
+    }
+    // Scheduling of the covariance denoise: cost-estimated tiles with work
+    // stealing (default) or the static split of rows
+    const char* schedule_option = findOption(argc, argv, "--schedule");
+    if (schedule_option && strcmp(schedule_option, "static") != 0 && strcmp(schedule_option, "tiles") != 0) {
+        cerr << "Error: Invalid schedule, use tiles or static." << endl;
+        return -1;
+    }
+    balancedDenoise = !schedule_option || strcmp(schedule_option, "tiles") == 0;
+
+    const char* sigma_space_option = findOption(argc, argv, "--sigma-space");
+    const char* sigma_range_option = findOption(argc, argv, "--sigma-range");
+    double sigmaSpace = sigma_space_option ? atof(sigma_space_option) : 8.0;
+    double sigmaRange = sigma_range_option ? atof(sigma_range_option) : 20.0;
+    if (sigmaSpace <= 0 || sigmaRange <= 0) {
+        cerr << "Error: Sigma space and sigma range must be greater than 0." << endl;
+        return -1;
+    }
+
+    // The temporal filter carries its statistics from frame to frame and
+    // writes every frame into the same buffer
+    if (temporal) {
+        TemporalDenoiser denoiser(temporalAlpha, motionThreshold);
+        cv::Mat denoisedImage;
+        int status = runFrameStream(stream_format, stream_width, stream_height, [&](const cv::Mat& frame) {
+            PERF_SCOPE(denoiseStage);
+            denoiser.process(frame, denoisedImage);
+            return denoisedImage;
+        });
+        cerr << "Temporal denoise: noise sigma " << denoiser.noiseSigma() << ", " << 100.0 * denoiser.resetRate()
+             << "% of tiles reset per frame" << endl;
+        return status;
+    }
+
+    // Each frame is denoised as a whole; the previous result goes back to the
+    // pool once it has been written
+    if (streaming) {
+        cv::Mat denoisedImage;
+        return runFrameStream(stream_format, stream_width, stream_height, [&](const cv::Mat& frame) {
+            BufferPool::instance().release(denoisedImage);
+            if (bilateral) {
+                denoisedImage = denoiseByBilateralGrid(frame, sigmaSpace, sigmaRange);
+            } else {
+                denoisedImage = denoiseByCovariance(frame, neighborhoodSize, factorRatio);
+            }
+            return denoisedImage;
+        });
+    }
+
+    // A smaller output keeps the neighborhood and the derived kernel sizes
+    // proportional to the image
+    if (scale < 1.0) {
+        neighborhoodSize = scaleWindowSize(neighborhoodSize, scale);
+        factorRatio *= scale;
+        sigmaSpace *= scale;
+        cout << "Processing at " << stereo_image.cols << "x" << stereo_image.rows << " (scale " << scale
+             << "), neighborhood size " << neighborhoodSize << ", factor ratio " << factorRatio << endl;
+    }
+
+    // Quality and speed of both engines instead of the benchmark
+    if (hasFlag(argc, argv, "--compare")) {
+        compareEngines(stereo_image, neighborhoodSize, factorRatio);
+        return 0;
+    }
+
+    // Optional roofline analysis instead of the benchmark: measures the
+    // host's bandwidth and FLOP roofs and places both engines under them.
+    // --roofline=<file> also writes the report as JSON.
+    const char* roofline_json = findOption(argc, argv, "--roofline");
+    if (roofline_json || hasFlag(argc, argv, "--roofline")) {
+        roofline::Machine machine = roofline::measureMachine();
+        double pixels = static_cast<double>(stereo_image.total());
+
+        // Per pixel: the mean (3 adds) and covariance (3 subtracts, 9
+        // multiply-adds) of a (n - 1)^2 window, the determinant, and the
+        // adaptive blur, whose size depends on the data and is counted at the
+        // neighborhood size. The image is read and written once.
+        double window = static_cast<double>(neighborhoodSize - 1) * (neighborhoodSize - 1);
+        roofline::Kernel covariance = {"denoise", roofline::DOUBLE,
+                                       pixels * (24 * window + 12 * neighborhoodSize + 17), pixels * 6, 0.0};
+        cv::Mat result;
+        covariance.seconds = roofline::bestSeconds([&]() {
+            BufferPool::instance().release(result);
+            result = denoiseByCovariance(stereo_image, neighborhoodSize, factorRatio);
+        });
+
+        // Per pixel: the splat (4 adds) and the trilinear slice (8 cells of
+        // 2 weight multiplies and 4 multiply-adds, plus the division); per
+        // cell: 3 blur passes of 5 taps over 4 floats. The image is read by
+        // splat and slice and written once; the grid is written by the
+        // splat, read and written by every blur pass and read by the slice.
+        GridSize grid = bilateralGridSize(stereo_image, sigmaSpace, sigmaRange);
+        double cells = static_cast<double>(grid.width) * grid.height * grid.depth;
+        roofline::Kernel bilateralGrid = {"denoise.bilateral", roofline::SINGLE,
+                                          pixels * 93 + cells * 120, pixels * 9 + cells * 16 * 8, 0.0};
+        bilateralGrid.seconds = roofline::bestSeconds([&]() {
+            BufferPool::instance().release(result);
+            result = denoiseByBilateralGrid(stereo_image, sigmaSpace, sigmaRange);
+        });
+        BufferPool::instance().release(result);
+
+        if (!roofline::report(machine, {covariance, bilateralGrid}, roofline_json)) {
+            cerr << "Error: Unable to write roofline file." << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Optional result cache keyed by the decoded input and every parameter
+    // that affects the output
+    const char* cache_dir = findOption(argc, argv, "--cache");
+    const char* cache_size = findOption(argc, argv, "--cache-size");
+    std::unique_ptr<ResultCache> cache;
+    uint64_t input_hash = 0;
+    std::ostringstream operation;
+    operation.precision(17);
+    operation << "2.1.3 denoise neighborhood=" << neighborhoodSize << " factor=" << factorRatio << " engine=" << ENGINE_VERSION;
+    if (bilateral) {
+        operation << " bilateral space=" << sigmaSpace << " range=" << sigmaRange;
+    }
+    std::vector<cv::Mat> cached_outputs;
+    bool cache_hit = false;
+    if (cache_dir) {
+        TRACE_SCOPE("cache.lookup");
+        cache.reset(new ResultCache(cache_dir, (cache_size ? strtoull(cache_size, nullptr, 10) : 1024) * 1024 * 1024));
+        input_hash = ResultCache::hashImage(stereo_image);
+        cache_hit = cache->lookup(input_hash, operation.str(), 1, cached_outputs);
+    }
+
+    // Optional multi-process mode: the result is assembled in shared memory
+    // by one worker process per band of rows
+    const char* shards_option = findOption(argc, argv, "--shards");
+    int shards = shards_option ? atoi(shards_option) : 0;
+    std::unique_ptr<SharedImage> shared_output;
+    std::vector<ShardTiming> shard_timings;
+    if (shards > 0 && bilateral) {
+        cerr << "Error: Sharding needs the row-local covariance engine." << endl;
+        return -1;
+    }
+
     // Apply denoising
     cv::Mat denoisedImage;
+    if (shards > 0 && !cache_hit) {
+        shared_output.reset(new SharedImage(stereo_image.rows, stereo_image.cols, stereo_image.type()));
+        denoisedImage = shared_output->mat();
+    }
 
     // Start the timer
     auto begin = chrono::high_resolution_clock::now();
@@ -96,14 +629,42 @@ int main( int argc, char** argv )
     // Number of iterations
     const int iter = 2500;
 
-    // Perform the operation iter times
-    for (int it = 0; it < iter; it++) {
-        denoisedImage = denoiseByCovariance(stereo_image, neighborhoodSize, factorRatio);
+    // Perform the operation iter times; each shard runs all iterations on its
+    // own band
+    if (shards > 0 && !cache_hit) {
+        TRACE_SCOPE("shards");
+        shard_timings = runShards(shards, stereo_image.rows, [&](int y0, int y1) {
+            for (int it = 0; it < iter; it++) {
+                denoiseByCovarianceRows(stereo_image, denoisedImage, neighborhoodSize, factorRatio, y0, y1);
+            }
+        });
+        if (!allShardsOk(shard_timings)) {
+            printShardTimings(shard_timings, cerr);
+            cerr << "Error: A shard worker failed." << endl;
+            return -1;
+        }
+    }
+    for (int it = 0; it < iter && !cache_hit && shards <= 0; it++) {
+        TRACE_SCOPE("iteration");
+        // The previous result goes back to the pool, so this call reuses it
+        BufferPool::instance().release(denoisedImage);
+        if (bilateral) {
+            denoisedImage = denoiseByBilateralGrid(stereo_image, sigmaSpace, sigmaRange);
+        } else {
+            denoisedImage = denoiseByCovariance(stereo_image, neighborhoodSize, factorRatio);
+        }
     }
 
     // Stop the timer
     auto end = std::chrono::high_resolution_clock::now();
 
+    if (cache_hit) {
+        denoisedImage = cached_outputs[0];
+    } else if (cache) {
+        TRACE_SCOPE("cache.store");
+        cache->store(input_hash, operation.str(), {denoisedImage});
+    }
+
     // Calculate the time difference
     std::chrono::duration<double> diff = end - begin;
 
@@ -113,12 +674,39 @@ int main( int argc, char** argv )
 
     // Save the anaglyph image
     std::string filename =  "output/2.1.3/denoised-image.jpg";
-    cv::imwrite(filename, denoisedImage);
+    {
+        TRACE_SCOPE("imwrite");
+        cv::imwrite(filename, denoisedImage);
+    }
 
     // Display performance metrics
-    cout << "Total time for " << iter << " iterations: " << diff.count() << " s" << endl;
-    cout << "Time for 1 iteration: " << diff.count() / iter << " s" << endl;
-    cout << "IPS: " << iter / diff.count() << endl;
+    if (cache_hit) {
+        cout << "Result served from cache" << endl;
+    } else {
+        cout << "Total time for " << iter << " iterations: " << diff.count() << " s" << endl;
+        cout << "Time for 1 iteration: " << diff.count() / iter << " s" << endl;
+        cout << "IPS: " << iter / diff.count() << endl;
+        perf::report(bilateral ? bilateralStage : denoiseStage, static_cast<double>(iter) * stereo_image.total());
+        printShardTimings(shard_timings, cout);
+    }
+    if (cache) {
+        cache->printStats(cout);
+    }
+    if (hasFlag(argc, argv, "--pool-stats")) {
+        BufferPool::instance().printStats(cout);
+    }
+    if (hasFlag(argc, argv, "--schedule-stats") && !bilateral && !cache_hit && shards <= 0) {
+        denoiseSchedule.print(cout, balancedDenoise ? "Tiled schedule" : "Static schedule");
+    }
+
+    // Write the per-stage trace
+    if (trace_path) {
+        if (trace::writeChromeTrace(trace_path)) {
+            cout << "Trace written to " << trace_path << endl;
+        } else {
+            cerr << "Error: Unable to write trace file." << endl;
+        }
+    }
 
     // Wait for a key press before closing the windows
     cv::waitKey();
@@ -0,0 +1,186 @@
+#ifndef ANAGLYPH_LUT_H
+#define ANAGLYPH_LUT_H
+
+// Table-driven integer anaglyph mixer.
+//
+// Every anaglyph mode is a linear map from the six input channels (left B, G, R
+// and right B, G, R) to the three output channels. Each term depends on a
+// single 8-bit value, so it is precomputed once per mode into a 256-entry table
+// of 16-bit fixed-point products (8 fractional bits, rounded). An output channel
+// is then a few table lookups, integer adds, one rounding shift and a
+// saturating narrow to 8 bits.
+//
+// On x86 CPUs with AVX2 the row mixer gathers 8 pixels at a time: one gather
+// pulls a channel of 8 interleaved BGR pixels, a second one looks the values up
+// in the table. It is used when cpu::activeIsa() is AVX2 or wider, so
+// STEREO_ISA can turn it off.
+//
+// The True and Gray modes only use the luminance of each eye. For them
+// LumaAnaglyphMixer builds the output from two luma planes (for instance the
+// Y plane of a JPEG decoded with IMREAD_GRAYSCALE), which skips the chroma
+// decode and the per-pixel luminance sums.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "cpu_dispatch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ANAGLYPH_LUT_X86 1
+#endif
+
+// Output channel c is the sum over i of coeff[c][i] * input i, with inputs
+// ordered left B, G, R, right B, G, R. Coefficients must lie in [0, 1].
+struct AnaglyphCoefficients {
+    double coeff[3][6];
+};
+
+class AnaglyphLut {
+public:
+    static const int FRACTION_BITS = 8;
+
+    explicit AnaglyphLut(const AnaglyphCoefficients& coefficients) {
+        for (int c = 0; c < 3; ++c) {
+            termCount_[c] = 0;
+            for (int i = 0; i < 6; ++i) {
+                double coeff = coefficients.coeff[c][i];
+                if (coeff == 0.0) {
+                    continue;
+                }
+                Term& term = terms_[c][termCount_[c]++];
+                term.input = i;
+                // One padding entry keeps 32-bit gathers at index 255 in bounds
+                for (int v = 0; v < 256; ++v) {
+                    term.table[v] = static_cast<uint16_t>(std::lround(coeff * v * (1 << FRACTION_BITS)));
+                }
+                term.table[256] = 0;
+            }
+        }
+    }
+
+    // Table lookups per pixel, summed over the three output channels
+    int termCount() const {
+        return termCount_[0] + termCount_[1] + termCount_[2];
+    }
+
+    // Mixes one row of interleaved BGR pixels
+    void mixRow(const uint8_t* left, const uint8_t* right, uint8_t* dst, int cols) const {
+        int j = 0;
+#ifdef ANAGLYPH_LUT_X86
+        if (cpu::activeIsa() >= cpu::Isa::AVX2) {
+            j = mixRowAvx2(left, right, dst, cols);
+        }
+#endif
+        for (; j < cols; ++j) {
+            const uint8_t* inputs[2] = {left + 3 * j, right + 3 * j};
+            for (int c = 0; c < 3; ++c) {
+                uint32_t sum = 1u << (FRACTION_BITS - 1);
+                for (int t = 0; t < termCount_[c]; ++t) {
+                    const Term& term = terms_[c][t];
+                    sum += term.table[inputs[term.input / 3][term.input % 3]];
+                }
+                dst[3 * j + c] = static_cast<uint8_t>(std::min<uint32_t>(sum >> FRACTION_BITS, 255));
+            }
+        }
+    }
+
+private:
+    struct Term {
+        int input;
+        uint16_t table[257];
+    };
+
+    Term terms_[3][6];
+    int termCount_[3];
+
+#ifdef ANAGLYPH_LUT_X86
+    // Processes blocks of 8 pixels and returns the first column left for the
+    // scalar loop. The last two pixels of a row always go to the scalar loop so
+    // the 4-byte gathers and 16-byte stores stay inside the row.
+    __attribute__((target("avx2")))
+    int mixRowAvx2(const uint8_t* left, const uint8_t* right, uint8_t* dst, int cols) const {
+        const __m256i pixelOffsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+        const __m256i byteMask = _mm256_set1_epi32(0xFF);
+        const __m256i wordMask = _mm256_set1_epi32(0xFFFF);
+        const __m256i rounding = _mm256_set1_epi32(1 << (FRACTION_BITS - 1));
+        const __m256i maxValue = _mm256_set1_epi32(255);
+        const __m256i packBgr = _mm256_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+        bool used[6] = {false, false, false, false, false, false};
+        for (int c = 0; c < 3; ++c) {
+            for (int t = 0; t < termCount_[c]; ++t) {
+                used[terms_[c][t].input] = true;
+            }
+        }
+
+        int j = 0;
+        for (; j + 10 <= cols; j += 8) {
+            __m256i values[6];
+            for (int i = 0; i < 6; ++i) {
+                if (used[i]) {
+                    const uint8_t* base = (i < 3 ? left : right) + 3 * j + i % 3;
+                    values[i] = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(base), pixelOffsets, 1), byteMask);
+                }
+            }
+
+            __m256i packed = _mm256_setzero_si256();
+            for (int c = 0; c < 3; ++c) {
+                __m256i sum = rounding;
+                for (int t = 0; t < termCount_[c]; ++t) {
+                    const Term& term = terms_[c][t];
+                    __m256i product = _mm256_i32gather_epi32(reinterpret_cast<const int*>(term.table), values[term.input], 2);
+                    sum = _mm256_add_epi32(sum, _mm256_and_si256(product, wordMask));
+                }
+                sum = _mm256_min_epu32(_mm256_srli_epi32(sum, FRACTION_BITS), maxValue);
+                packed = _mm256_or_si256(packed, _mm256_slli_epi32(sum, 8 * c));
+            }
+
+            packed = _mm256_shuffle_epi8(packed, packBgr);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * j), _mm256_castsi256_si128(packed));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * j + 12), _mm256_extracti128_si256(packed, 1));
+        }
+        return j;
+    }
+#endif
+};
+
+CPU_DISPATCH_INLINE void mixLumaRowKernel(const uint8_t* left, const uint8_t* right, uint8_t* dst, int cols, bool grayGreen) {
+    if (grayGreen) {
+        for (int j = 0; j < cols; ++j) {
+            dst[3 * j] = right[j];
+            dst[3 * j + 1] = right[j];
+            dst[3 * j + 2] = left[j];
+        }
+    } else {
+        for (int j = 0; j < cols; ++j) {
+            dst[3 * j] = right[j];
+            dst[3 * j + 1] = 0;
+            dst[3 * j + 2] = left[j];
+        }
+    }
+}
+
+CPU_DISPATCH(mixLumaRow, mixLumaRowKernel, (const uint8_t* left, const uint8_t* right, uint8_t* dst, int cols, bool grayGreen),
+             (left, right, dst, cols, grayGreen))
+
+// True (green channel empty) or Gray (green from the right eye) anaglyph of
+// two CV_8UC1 luma rows: blue takes the right eye's luma, red the left eye's
+class LumaAnaglyphMixer {
+public:
+    explicit LumaAnaglyphMixer(bool grayGreen) : grayGreen_(grayGreen) {}
+
+    // Mixes one row of luma pixels into interleaved BGR pixels
+    void mixRow(const uint8_t* left, const uint8_t* right, uint8_t* dst, int cols) const {
+        mixLumaRow(left, right, dst, cols, grayGreen_);
+    }
+
+private:
+    bool grayGreen_;
+};
+
+#endif // ANAGLYPH_LUT_H
@@ -0,0 +1,116 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+// Process-wide pool of image buffers keyed by size and type.
+//
+// Engines acquire their output and scratch images from the pool and hand them
+// back with release() when done, so iterations and jobs reuse the same memory
+// instead of allocating (and page-faulting) large buffers every time. New
+// buffers are touched by all threads right after allocation, so first-touch
+// page faults happen once, in parallel, and outside the hot loops.
+//
+// Only whole buffers may be released, never ROIs, and the caller must not keep
+// other references to a released buffer.
+
+#include <opencv2/opencv.hpp>
+
+#include <sys/resource.h>
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <tuple>
+#include <vector>
+
+class BufferPool {
+public:
+    struct Stats {
+        uint64_t bytesAllocated = 0;
+        uint64_t buffersAllocated = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    static BufferPool& instance() {
+        static BufferPool pool;
+        return pool;
+    }
+
+    cv::Mat acquire(int rows, int cols, int type) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<cv::Mat>& buffers = free_[std::make_tuple(rows, cols, type)];
+            if (!buffers.empty()) {
+                cv::Mat buffer = buffers.back();
+                buffers.pop_back();
+                ++stats_.hits;
+                return buffer;
+            }
+            ++stats_.misses;
+        }
+
+        cv::Mat buffer(rows, cols, type);
+        prefault(buffer);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.bytesAllocated += buffer.total() * buffer.elemSize();
+        ++stats_.buffersAllocated;
+        return buffer;
+    }
+
+    cv::Mat acquire(cv::Size size, int type) {
+        return acquire(size.height, size.width, type);
+    }
+
+    void release(const cv::Mat& buffer) {
+        if (buffer.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_[std::make_tuple(buffer.rows, buffer.cols, buffer.type())].push_back(buffer);
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // Page faults of the whole process since the pool was created
+    long pageFaults() const {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_minflt + usage.ru_majflt - initialFaults_;
+    }
+
+    void printStats(std::ostream& out) {
+        Stats current = stats();
+        out << "Buffer pool: " << current.bytesAllocated / (1024.0 * 1024.0) << " MB allocated in "
+            << current.buffersAllocated << " buffers, " << current.hits << " hits, " << current.misses << " misses, "
+            << pageFaults() << " page faults" << std::endl;
+    }
+
+private:
+    std::mutex mutex_;
+    std::map<std::tuple<int, int, int>, std::vector<cv::Mat>> free_;
+    Stats stats_;
+    long initialFaults_;
+
+    BufferPool() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        initialFaults_ = usage.ru_minflt + usage.ru_majflt;
+    }
+
+    // Touches every page from the threads that will later work on the rows
+    static void prefault(cv::Mat& buffer) {
+        size_t rowBytes = buffer.cols * buffer.elemSize();
+        #pragma omp parallel for
+        for (int y = 0; y < buffer.rows; ++y) {
+            memset(buffer.ptr(y), 0, rowBytes);
+        }
+    }
+};
+
+#endif // BUFFER_POOL_H
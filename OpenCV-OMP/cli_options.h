@@ -0,0 +1,29 @@
+#ifndef CLI_OPTIONS_H
+#define CLI_OPTIONS_H
+
+// Optional "--name=value" / "--name" arguments that follow the positional ones.
+
+#include <cstring>
+
+// Returns the value of "--name=value", or nullptr when the option is absent.
+inline const char* findOption(int argc, char** argv, const char* name) {
+    size_t length = strlen(name);
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], name, length) == 0 && argv[i][length] == '=') {
+            return argv[i] + length + 1;
+        }
+    }
+    return nullptr;
+}
+
+// Returns true when the bare flag "--name" is present.
+inline bool hasFlag(int argc, char** argv, const char* name) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif // CLI_OPTIONS_H
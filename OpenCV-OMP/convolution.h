@@ -0,0 +1,534 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+// General 2D convolution of 8-bit images with arbitrary kernels.
+//
+// A kernel is any CV_64FC1 matrix. It is applied the way cv::filter2D applies
+// it (correlation, anchor at the centre), with replicated borders. Three
+// engines compute the same result on float planes:
+//  - direct: every non-zero tap is a multiply-add over a row of the output,
+//    so the cost per pixel is the number of non-zero taps;
+//  - separable: a rank-1 kernel, detected from its singular values, is split
+//    into a column and a row kernel, so the cost is rows + columns per pixel;
+//  - fft: overlapping tiles of the padded image are transformed with cv::dft,
+//    multiplied by the kernel's spectrum and transformed back. Each tile keeps
+//    only the outputs that do not wrap around (overlap-save, the read-side
+//    form of overlap-add), so tiles write disjoint outputs in parallel. The
+//    cost per pixel grows with the log of the tile size, not with the kernel.
+//
+// A Plan estimates the time of every engine from per-operation costs measured
+// once on this host (hostCosts) and picks the cheapest, and for the FFT the
+// tile size with the least total work.
+
+#include <opencv2/opencv.hpp>
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "trace.h"
+
+namespace convolution {
+
+enum class Engine {
+    AUTO,
+    DIRECT,
+    SEPARABLE,
+    FFT
+};
+
+inline const char* engineName(Engine engine) {
+    switch (engine) {
+        case Engine::DIRECT:
+            return "direct";
+        case Engine::SEPARABLE:
+            return "separable";
+        case Engine::FFT:
+            return "fft";
+        default:
+            return "auto";
+    }
+}
+
+// Resolves "auto", "direct", "separable" or "fft"; false for anything else
+inline bool parseEngine(const char* name, Engine& engine) {
+    for (Engine candidate : {Engine::AUTO, Engine::DIRECT, Engine::SEPARABLE, Engine::FFT}) {
+        if (strcmp(name, engineName(candidate)) == 0) {
+            engine = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// size x size Gaussian, normalized
+inline cv::Mat gaussianKernel(int size, double sigma) {
+    cv::Mat line(size, 1, CV_64F);
+    double total = 0.0;
+    for (int i = 0; i < size; ++i) {
+        double x = i - (size - 1) / 2.0;
+        line.at<double>(i, 0) = std::exp(-x * x / (2.0 * sigma * sigma));
+        total += line.at<double>(i, 0);
+    }
+    cv::Mat kernel(size, size, CV_64F);
+    for (int i = 0; i < size; ++i) {
+        for (int j = 0; j < size; ++j) {
+            kernel.at<double>(i, j) = line.at<double>(i, 0) * line.at<double>(j, 0) / (total * total);
+        }
+    }
+    return kernel;
+}
+
+// Bokeh disk of the given diameter, normalized. Edge pixels are weighted by
+// the part of them inside the circle (4 x 4 samples), so the rim is smooth.
+inline cv::Mat diskKernel(int diameter) {
+    cv::Mat kernel(diameter, diameter, CV_64F);
+    double centre = (diameter - 1) / 2.0;
+    double radius = diameter / 2.0;
+    double total = 0.0;
+    for (int i = 0; i < diameter; ++i) {
+        for (int j = 0; j < diameter; ++j) {
+            int inside = 0;
+            for (int s = 0; s < 16; ++s) {
+                double y = i + (s / 4 + 0.5) / 4.0 - 0.5 - centre;
+                double x = j + (s % 4 + 0.5) / 4.0 - 0.5 - centre;
+                inside += x * x + y * y <= radius * radius ? 1 : 0;
+            }
+            kernel.at<double>(i, j) = inside / 16.0;
+            total += inside / 16.0;
+        }
+    }
+    return kernel / total;
+}
+
+// Linear motion blur of the given length (pixels) and angle (degrees,
+// counter-clockwise from the x axis), normalized. The line is sampled every
+// quarter pixel and each sample split bilinearly over its four pixels.
+inline cv::Mat motionKernel(int length, double angle) {
+    int size = length | 1;
+    cv::Mat kernel = cv::Mat::zeros(size, size, CV_64F);
+    double centre = (size - 1) / 2.0;
+    double dx = std::cos(angle * CV_PI / 180.0);
+    double dy = -std::sin(angle * CV_PI / 180.0);
+    double half = (length - 1) / 2.0;
+    double total = 0.0;
+    for (double t = -half; t <= half + 1e-9; t += 0.25) {
+        double x = centre + t * dx;
+        double y = centre + t * dy;
+        int x0 = static_cast<int>(std::floor(x));
+        int y0 = static_cast<int>(std::floor(y));
+        double fx = x - x0;
+        double fy = y - y0;
+        for (int k = 0; k < 4; ++k) {
+            int xi = x0 + (k & 1);
+            int yi = y0 + (k >> 1);
+            double weight = ((k & 1) ? fx : 1.0 - fx) * ((k >> 1) ? fy : 1.0 - fy);
+            if (xi >= 0 && xi < size && yi >= 0 && yi < size && weight > 0) {
+                kernel.at<double>(yi, xi) += weight;
+                total += weight;
+            }
+        }
+    }
+    return kernel / total;
+}
+
+// Kernel from a text file, one row per line, values separated by spaces;
+// empty when the file is missing or the rows differ in length. The values are
+// used as they are, not normalized.
+inline cv::Mat readKernel(const std::string& path) {
+    std::ifstream in(path);
+    std::vector<std::vector<double>> rows;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream values(line);
+        std::vector<double> row;
+        double value;
+        while (values >> value) {
+            row.push_back(value);
+        }
+        if (!row.empty()) {
+            rows.push_back(row);
+        }
+    }
+    if (rows.empty()) {
+        return cv::Mat();
+    }
+    cv::Mat kernel(static_cast<int>(rows.size()), static_cast<int>(rows[0].size()), CV_64F);
+    for (int i = 0; i < kernel.rows; ++i) {
+        if (rows[i].size() != rows[0].size()) {
+            return cv::Mat();
+        }
+        for (int j = 0; j < kernel.cols; ++j) {
+            kernel.at<double>(i, j) = rows[i][j];
+        }
+    }
+    return kernel;
+}
+
+// gaussian:<size>:<sigma>, disk:<diameter>, motion:<length>:<angle> or
+// file:<path>; empty for an invalid specification
+inline cv::Mat parseKernel(const std::string& spec) {
+    std::vector<std::string> fields;
+    std::stringstream parts(spec);
+    std::string field;
+    while (std::getline(parts, field, ':')) {
+        fields.push_back(field);
+    }
+    if (fields.size() == 2 && fields[0] == "file") {
+        return readKernel(fields[1]);
+    }
+    if (fields.size() == 3 && fields[0] == "gaussian" && atoi(fields[1].c_str()) > 0 && atof(fields[2].c_str()) > 0) {
+        return gaussianKernel(atoi(fields[1].c_str()), atof(fields[2].c_str()));
+    }
+    if (fields.size() == 2 && fields[0] == "disk" && atoi(fields[1].c_str()) > 0) {
+        return diskKernel(atoi(fields[1].c_str()));
+    }
+    if (fields.size() == 3 && fields[0] == "motion" && atoi(fields[1].c_str()) > 0) {
+        return motionKernel(atoi(fields[1].c_str()), atof(fields[2].c_str()));
+    }
+    return cv::Mat();
+}
+
+// True when the kernel has rank 1, i.e. its second singular value is
+// negligible; column and row, when given, receive the two 1D kernels whose
+// outer product it is
+inline bool isSeparable(const cv::Mat& kernel, std::vector<float>* column = nullptr, std::vector<float>* row = nullptr) {
+    cv::Mat w, u, vt;
+    cv::SVDecomp(kernel, w, u, vt);
+    double first = w.at<double>(0, 0);
+    if (first == 0 || (w.rows > 1 && w.at<double>(1, 0) > 1e-6 * first)) {
+        return false;
+    }
+    double scale = std::sqrt(first);
+    if (column) {
+        column->resize(kernel.rows);
+        for (int i = 0; i < kernel.rows; ++i) {
+            (*column)[i] = static_cast<float>(u.at<double>(i, 0) * scale);
+        }
+    }
+    if (row) {
+        row->resize(kernel.cols);
+        for (int j = 0; j < kernel.cols; ++j) {
+            (*row)[j] = static_cast<float>(vt.at<double>(0, j) * scale);
+        }
+    }
+    return true;
+}
+
+// The engines work on single-channel float planes: padded has kernel rows - 1
+// more rows and kernel columns - 1 more columns than out, which they fill.
+
+// Adds weight times the cols values of in to out
+CPU_DISPATCH_INLINE void accumulateRowKernel(const float* in, float weight, float* out, int cols) {
+    #pragma omp simd
+    for (int x = 0; x < cols; ++x) {
+        out[x] += weight * in[x];
+    }
+}
+
+// Row y of the direct convolution
+CPU_DISPATCH_INLINE void directRowKernel(const cv::Mat& padded, const cv::Mat& kernel, cv::Mat& out, int y) {
+    float* o = out.ptr<float>(y);
+    std::fill(o, o + out.cols, 0.0f);
+    for (int i = 0; i < kernel.rows; ++i) {
+        const float* in = padded.ptr<float>(y + i);
+        for (int j = 0; j < kernel.cols; ++j) {
+            float weight = static_cast<float>(kernel.at<double>(i, j));
+            if (weight != 0.0f) {
+                accumulateRowKernel(in + j, weight, o, out.cols);
+            }
+        }
+    }
+}
+
+// One output row of a 1D pass: the sum of taps.size() input rows, or of the
+// shifted copies of one row, weighted by taps
+CPU_DISPATCH_INLINE void separableRowKernel(const float* const* inputs, const std::vector<float>& taps, float* out, int cols) {
+    std::fill(out, out + cols, 0.0f);
+    for (size_t t = 0; t < taps.size(); ++t) {
+        accumulateRowKernel(inputs[t], taps[t], out, cols);
+    }
+}
+
+CPU_DISPATCH(directRow, directRowKernel, (const cv::Mat& padded, const cv::Mat& kernel, cv::Mat& out, int y), (padded, kernel, out, y))
+
+CPU_DISPATCH(separableRow, separableRowKernel, (const float* const* inputs, const std::vector<float>& taps, float* out, int cols),
+             (inputs, taps, out, cols))
+
+inline void convolveDirect(const cv::Mat& padded, const cv::Mat& kernel, cv::Mat& out) {
+    #pragma omp parallel for
+    for (int y = 0; y < out.rows; ++y) {
+        directRow(padded, kernel, out, y);
+    }
+}
+
+inline void convolveSeparable(const cv::Mat& padded, const std::vector<float>& column, const std::vector<float>& row, cv::Mat& out) {
+    cv::Mat tmp(padded.rows, out.cols, CV_32F);
+
+    #pragma omp parallel
+    {
+    std::vector<const float*> inputs(std::max(row.size(), column.size()));
+
+    #pragma omp for
+    for (int y = 0; y < padded.rows; ++y) {
+        for (size_t j = 0; j < row.size(); ++j) {
+            inputs[j] = padded.ptr<float>(y) + j;
+        }
+        separableRow(inputs.data(), row, tmp.ptr<float>(y), out.cols);
+    }
+
+    #pragma omp for nowait
+    for (int y = 0; y < out.rows; ++y) {
+        for (size_t i = 0; i < column.size(); ++i) {
+            inputs[i] = tmp.ptr<float>(y + static_cast<int>(i));
+        }
+        separableRow(inputs.data(), column, out.ptr<float>(y), out.cols);
+    }
+    }
+}
+
+// Spectrum of the kernel zero-padded to size x size, as convolveFft uses it
+inline cv::Mat kernelSpectrum(const cv::Mat& kernel, int size) {
+    cv::Mat padded = cv::Mat::zeros(size, size, CV_32F);
+    kernel.convertTo(padded(cv::Rect(0, 0, kernel.cols, kernel.rows)), CV_32F);
+    cv::Mat spectrum;
+    cv::dft(padded, spectrum, cv::DFT_COMPLEX_OUTPUT);
+    return spectrum;
+}
+
+// Waves of tasks when tasks run on every thread
+inline double waves(double tasks) {
+    return std::ceil(tasks / omp_get_max_threads());
+}
+
+// Tiles of size x size points covering an image, each keeping the outputs of
+// the kernel that do not wrap around
+inline int fftTileCount(cv::Size imageSize, cv::Size kernelSize, int size) {
+    int tileRows = size - kernelSize.height + 1;
+    int tileCols = size - kernelSize.width + 1;
+    return ((imageSize.height + tileRows - 1) / tileRows) * ((imageSize.width + tileCols - 1) / tileCols);
+}
+
+// Convolves every padded plane into the output of the same index. The tiles
+// of all planes are one parallel loop, so even a single tile per plane keeps
+// a thread per plane busy. A thread allocates its tile once it takes one.
+inline void convolveFft(const std::vector<cv::Mat>& planes, const cv::Mat& spectrum, int size, cv::Size kernelSize,
+                        std::vector<cv::Mat>& outputs) {
+    const int tileRows = size - kernelSize.height + 1;
+    const int tileCols = size - kernelSize.width + 1;
+    const int tilesX = (outputs[0].cols + tileCols - 1) / tileCols;
+    const int tiles = fftTileCount(outputs[0].size(), kernelSize, size);
+    const int tasks = tiles * static_cast<int>(planes.size());
+
+    #pragma omp parallel
+    {
+    cv::Mat tile;
+    cv::Mat frequency;
+    cv::Mat result;
+    #pragma omp for schedule(dynamic)
+    for (int task = 0; task < tasks; ++task) {
+        const cv::Mat& padded = planes[task / tiles];
+        cv::Mat& out = outputs[task / tiles];
+        int t = task % tiles;
+        int y0 = (t / tilesX) * tileRows;
+        int x0 = (t % tilesX) * tileCols;
+        int rows = std::min(tileRows, out.rows - y0);
+        int cols = std::min(tileCols, out.cols - x0);
+        cv::Rect input(0, 0, cols + kernelSize.width - 1, rows + kernelSize.height - 1);
+
+        tile.create(size, size, CV_32F);
+        tile.setTo(cv::Scalar(0));
+        padded(input + cv::Point(x0, y0)).copyTo(tile(input));
+        cv::dft(tile, frequency, cv::DFT_COMPLEX_OUTPUT);
+        // Conjugating the kernel's spectrum turns the product into correlation
+        cv::mulSpectrums(frequency, spectrum, frequency, 0, true);
+        cv::dft(frequency, result, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+        result(cv::Rect(0, 0, cols, rows)).copyTo(out(cv::Rect(x0, y0, cols, rows)));
+    }
+    }
+}
+
+// Seconds per unit of work of each engine: per tap and pixel on all threads
+// (direct, separable, which split rows among them), and per point and log2 of
+// points of a tile on one thread while the others transform tiles of their
+// own (fft, which gives every thread whole tiles)
+struct Costs {
+    double tap;
+    double separableTap;
+    double fftPoint;
+};
+
+// Times each engine on a 512 x 512 plane (best of 3 runs)
+inline Costs measureCosts() {
+    TRACE_SCOPE("convolution.calibrate");
+    const int n = 512;
+    const int fftSize = 256;
+    cv::Mat plane(n + 32, n + 32, CV_32F);
+    for (int y = 0; y < plane.rows; ++y) {
+        for (int x = 0; x < plane.cols; ++x) {
+            plane.at<float>(y, x) = static_cast<float>((y * 31 + x * 17) % 255);
+        }
+    }
+    cv::Mat out(n, n, CV_32F);
+
+    auto best = [](const std::function<void()>& run) {
+        double seconds = std::numeric_limits<double>::max();
+        for (int i = 0; i < 3; ++i) {
+            auto begin = std::chrono::steady_clock::now();
+            run();
+            seconds = std::min(seconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+        }
+        return seconds;
+    };
+
+    cv::Mat box = cv::Mat::ones(9, 9, CV_64F) / 81.0;
+    std::vector<float> line(17, 1.0f / 17);
+    cv::Mat spectrum = kernelSpectrum(box, fftSize);
+    std::vector<cv::Mat> fftPlanes = {plane(cv::Rect(0, 0, n + 8, n + 8))};
+    std::vector<cv::Mat> fftOutputs = {out};
+
+    Costs costs;
+    costs.tap = best([&]() {
+        convolveDirect(plane(cv::Rect(0, 0, n + 8, n + 8)), box, out);
+    }) / (static_cast<double>(n) * n * 81);
+    costs.separableTap = best([&]() {
+        convolveSeparable(plane(cv::Rect(0, 0, n + 16, n + 16)), line, line, out);
+    }) / (static_cast<double>(n) * n * 34);
+    costs.fftPoint = best([&]() {
+        convolveFft(fftPlanes, spectrum, fftSize, box.size(), fftOutputs);
+    }) / (waves(fftTileCount(out.size(), box.size(), fftSize)) * fftSize * fftSize * std::log2(static_cast<double>(fftSize) * fftSize));
+    return costs;
+}
+
+// Measured on first use
+inline const Costs& hostCosts() {
+    static const Costs costs = measureCosts();
+    return costs;
+}
+
+// A kernel prepared for images of one size: the engine, the 1D kernels of a
+// separable kernel and the spectrum for the chosen FFT tile size
+class Plan {
+public:
+    // engine AUTO picks the lowest estimate; SEPARABLE needs a rank-1 kernel
+    Plan(const cv::Mat& kernel, cv::Size imageSize, int channels, Engine engine = Engine::AUTO)
+        : kernel_(kernel), separable_(isSeparable(kernel, &column_, &row_)), fftSize_(0) {
+        if (engine == Engine::SEPARABLE && !separable_) {
+            throw std::invalid_argument("convolution: the kernel is not separable");
+        }
+
+        const Costs& costs = hostCosts();
+        double pixels = static_cast<double>(imageSize.area()) * channels;
+        int taps = 0;
+        for (int i = 0; i < kernel.rows; ++i) {
+            for (int j = 0; j < kernel.cols; ++j) {
+                taps += static_cast<float>(kernel.at<double>(i, j)) != 0.0f ? 1 : 0;
+            }
+        }
+        estimates_[0] = pixels * taps * costs.tap;
+        estimates_[1] = separable_ ? pixels * (kernel.rows + kernel.cols) * costs.separableTap
+                                   : std::numeric_limits<double>::infinity();
+
+        // Larger tiles waste less on the overlap but cost more per point, and
+        // fewer tiles than threads leave threads idle: the time is the number
+        // of waves of tiles (of all channels) times the time of one tile. Try
+        // every efficient DFT size up to one tile for the whole image.
+        estimates_[2] = std::numeric_limits<double>::infinity();
+        int largest = std::max(imageSize.height + kernel.rows, imageSize.width + kernel.cols);
+        for (int size = cv::getOptimalDFTSize(std::max(kernel.rows, kernel.cols) + 1);; size = cv::getOptimalDFTSize(size + 1)) {
+            double points = static_cast<double>(size) * size;
+            double estimate = waves(static_cast<double>(fftTileCount(imageSize, kernel.size(), size)) * channels) * points *
+                              std::log2(points) * costs.fftPoint;
+            if (estimate < estimates_[2]) {
+                estimates_[2] = estimate;
+                fftSize_ = size;
+            }
+            if (size >= largest) {
+                break;
+            }
+        }
+
+        engine_ = engine;
+        if (engine_ == Engine::AUTO) {
+            engine_ = Engine::DIRECT;
+            if (estimates_[1] < estimate(engine_)) {
+                engine_ = Engine::SEPARABLE;
+            }
+            if (estimates_[2] < estimate(engine_)) {
+                engine_ = Engine::FFT;
+            }
+        }
+        if (engine_ == Engine::FFT) {
+            spectrum_ = kernelSpectrum(kernel, fftSize_);
+        }
+    }
+
+    Engine engine() const {
+        return engine_;
+    }
+
+    int fftSize() const {
+        return fftSize_;
+    }
+
+    // Estimated seconds for one image; infinity when the engine does not apply
+    double estimate(Engine engine) const {
+        return engine == Engine::DIRECT ? estimates_[0] : engine == Engine::SEPARABLE ? estimates_[1] : estimates_[2];
+    }
+
+    // Convolves src (8-bit, any channel count) into dst of the same size and
+    // type; dst may be a view into a larger image, it is written in place
+    void apply(const cv::Mat& src, cv::Mat& dst) const {
+        TRACE_SCOPE("convolve");
+        int anchorX = kernel_.cols / 2;
+        int anchorY = kernel_.rows / 2;
+        cv::Mat image;
+        src.convertTo(image, CV_32F);
+        cv::Mat padded;
+        cv::copyMakeBorder(image, padded, anchorY, kernel_.rows - 1 - anchorY, anchorX, kernel_.cols - 1 - anchorX, cv::BORDER_REPLICATE);
+
+        std::vector<cv::Mat> planes;
+        cv::split(padded, planes);
+        std::vector<cv::Mat> outputs(planes.size());
+        for (size_t c = 0; c < planes.size(); ++c) {
+            outputs[c].create(src.rows, src.cols, CV_32F);
+        }
+        if (engine_ == Engine::FFT) {
+            convolveFft(planes, spectrum_, fftSize_, kernel_.size(), outputs);
+        }
+        for (size_t c = 0; c < planes.size() && engine_ != Engine::FFT; ++c) {
+            if (engine_ == Engine::DIRECT) {
+                convolveDirect(planes[c], kernel_, outputs[c]);
+            } else {
+                convolveSeparable(planes[c], column_, row_, outputs[c]);
+            }
+        }
+        cv::Mat result;
+        cv::merge(outputs, result);
+        result.convertTo(dst, src.depth());
+    }
+
+private:
+    cv::Mat kernel_;
+    std::vector<float> column_;
+    std::vector<float> row_;
+    bool separable_;
+    int fftSize_;
+    double estimates_[3];
+    Engine engine_;
+    cv::Mat spectrum_;
+};
+
+} // namespace convolution
+
+#endif // CONVOLUTION_H
@@ -0,0 +1,86 @@
+#ifndef COVARIANCE_DENOISE_H
+#define COVARIANCE_DENOISE_H
+
+// Covariance-driven denoise: every pixel is replaced by a Gaussian blur whose
+// kernel size is factorRatio over the determinant of its neighborhood's colour
+// covariance, so flat regions are smoothed more than textured ones. Shared by
+// 2.1.3 and the C API.
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// Writes the covariance of the neighborhood into covariance. The neighborhood
+// copy and the mean live in per-thread scratch images that keep their buffers
+// between pixels, so interior pixels do not allocate.
+inline void calculateCovarianceMatrix(const cv::Mat& image, int x, int y, int neighborhoodSize, cv::Mat& covariance) {
+    int halfSize = neighborhoodSize / 2;
+    int xStart = std::max(0, x - halfSize);
+    int yStart = std::max(0, y - halfSize);
+    int xEnd = std::min(image.cols, x + halfSize);
+    int yEnd = std::min(image.rows, y + halfSize);
+
+    thread_local cv::Mat neighborhood;
+    thread_local cv::Mat mean;
+    image(cv::Rect(xStart, yStart, xEnd - xStart, yEnd - yStart)).copyTo(neighborhood);
+    cv::Mat reshapedNeighborhood = neighborhood.reshape(1, neighborhood.total());
+
+    cv::calcCovarMatrix(reshapedNeighborhood, covariance, mean, cv::COVAR_NORMAL | cv::COVAR_ROWS | cv::COVAR_SCALE);
+}
+
+// Kernel size of the blur at (x, y); covariance is scratch space
+inline int adaptiveKernelSize(const cv::Mat& src, int x, int y, int neighborhoodSize, double factorRatio, cv::Mat& covariance) {
+    calculateCovarianceMatrix(src, x, y, neighborhoodSize, covariance);
+    double determinant = cv::determinant(covariance);
+
+    int kernelSize;
+    if (determinant != 0) {
+        kernelSize = static_cast<int>(std::round(factorRatio / determinant));
+        kernelSize = kernelSize % 2 == 0 ? kernelSize + 1 : kernelSize;
+    } else {
+        kernelSize = neighborhoodSize;
+    }
+
+    // GaussianBlur kernel size should be positive and odd
+    kernelSize = std::max(1, kernelSize);
+    kernelSize |= 1; // Ensure it's odd
+    return kernelSize;
+}
+
+// Denoises the pixels of rect in src into dst
+inline void denoiseByCovarianceRect(const cv::Mat& src, cv::Mat& dst, int neighborhoodSize, double factorRatio, const cv::Rect& rect) {
+    cv::Mat covariance;
+    for (int y = rect.y; y < rect.y + rect.height; ++y) {
+        for (int x = rect.x; x < rect.x + rect.width; ++x) {
+            int kernelSize = adaptiveKernelSize(src, x, y, neighborhoodSize, factorRatio, covariance);
+            cv::GaussianBlur(src(cv::Rect(x, y, 1, 1)), dst(cv::Rect(x, y, 1, 1)), cv::Size(kernelSize, kernelSize), 0, 0);
+        }
+    }
+}
+
+// Denoises rows [rowBegin, rowEnd) of src into dst
+inline void denoiseByCovarianceRows(const cv::Mat& src, cv::Mat& dst, int neighborhoodSize, double factorRatio, int rowBegin, int rowEnd) {
+    denoiseByCovarianceRect(src, dst, neighborhoodSize, factorRatio, cv::Rect(0, rowBegin, src.cols, rowEnd - rowBegin));
+}
+
+// Estimated cost of denoising rect, in pixel reads. The kernel size is
+// sampled at the centre of every step x step cell; each sample stands for the
+// cell's pixels, which cost the covariance window plus the blur: k rows of k
+// taps and one column of k taps for kernel size k.
+inline double estimateDenoiseCost(const cv::Mat& src, int neighborhoodSize, double factorRatio, const cv::Rect& rect, int step) {
+    cv::Mat covariance;
+    double window = static_cast<double>(neighborhoodSize - 1) * (neighborhoodSize - 1);
+    double cost = 0;
+    for (int y0 = rect.y; y0 < rect.y + rect.height; y0 += step) {
+        int height = std::min(step, rect.y + rect.height - y0);
+        for (int x0 = rect.x; x0 < rect.x + rect.width; x0 += step) {
+            int width = std::min(step, rect.x + rect.width - x0);
+            double kernelSize = adaptiveKernelSize(src, x0 + width / 2, y0 + height / 2, neighborhoodSize, factorRatio, covariance);
+            cost += static_cast<double>(width) * height * (window + kernelSize * (kernelSize + 1));
+        }
+    }
+    return cost;
+}
+
+#endif // COVARIANCE_DENOISE_H
@@ -0,0 +1,154 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+// Runtime selection of instruction-set variants of the hot loops.
+//
+// The programs are built without -march flags, so one binary runs on every
+// node. A hot loop is written once as a CPU_DISPATCH_INLINE function and
+// CPU_DISPATCH compiles it again for each instruction set: every variant is a
+// wrapper with a target attribute into which the body is inlined, so the
+// compiler vectorizes it for that ISA. The wrapper named by CPU_DISPATCH calls
+// the variant of activeIsa(): the widest one the CPU supports, detected once
+// with CPUID, or a narrower one named by the STEREO_ISA environment variable
+// (baseline, sse4.2, avx2, avx512 or neon), e.g. to compare the variants or
+// to reproduce a run of an older node.
+//
+// Variants do not contract multiplies and adds into FMAs, so they round
+// exactly as the baseline and their results are bit-identical. On AArch64
+// NEON is part of the baseline, so there is a single variant.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_DISPATCH_X86 1
+#endif
+
+namespace cpu {
+
+enum class Isa {
+    BASELINE,
+    SSE42,
+    AVX2,
+    AVX512,
+    NEON
+};
+
+inline const char* isaName(Isa isa) {
+    switch (isa) {
+        case Isa::SSE42:
+            return "sse4.2";
+        case Isa::AVX2:
+            return "avx2";
+        case Isa::AVX512:
+            return "avx512";
+        case Isa::NEON:
+            return "neon";
+        default:
+            return "baseline";
+    }
+}
+
+// Widest instruction set of this CPU that the variants use
+inline Isa detectIsa() {
+#ifdef CPU_DISPATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+        return Isa::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return Isa::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return Isa::SSE42;
+    }
+    return Isa::BASELINE;
+#elif defined(__aarch64__)
+    return Isa::NEON;
+#else
+    return Isa::BASELINE;
+#endif
+}
+
+// The detected ISA, or the one STEREO_ISA names if this CPU supports it
+inline Isa selectIsa() {
+    Isa detected = detectIsa();
+    const char* name = std::getenv("STEREO_ISA");
+    if (!name) {
+        return detected;
+    }
+    for (Isa isa : {Isa::BASELINE, Isa::SSE42, Isa::AVX2, Isa::AVX512, Isa::NEON}) {
+        if (strcmp(name, isaName(isa)) != 0) {
+            continue;
+        }
+#ifdef CPU_DISPATCH_X86
+        bool supported = isa != Isa::NEON && isa <= detected;
+#else
+        bool supported = isa == Isa::BASELINE || isa == detected;
+#endif
+        if (supported) {
+            std::cerr << "Using " << isaName(isa) << " kernels (STEREO_ISA)" << std::endl;
+            return isa;
+        }
+        std::cerr << "Warning: STEREO_ISA=" << name << " is not supported by this CPU, using " << isaName(detected) << std::endl;
+        return detected;
+    }
+    std::cerr << "Warning: Invalid STEREO_ISA=" << name << ", use baseline, sse4.2, avx2, avx512 or neon; using " << isaName(detected) << std::endl;
+    return detected;
+}
+
+// Selected on first use
+inline Isa activeIsa() {
+    static const Isa isa = selectIsa();
+    return isa;
+}
+
+} // namespace cpu
+
+// Bodies of dispatched loops, and every function they call, must be inlined
+// into the variants to be compiled for their ISA
+#define CPU_DISPATCH_INLINE inline __attribute__((always_inline))
+
+#if defined(__clang__)
+#define CPU_DISPATCH_NO_CONTRACT
+#else
+#define CPU_DISPATCH_NO_CONTRACT , optimize("fp-contract=off")
+#endif
+
+// Defines void name params, which runs body args compiled for the active ISA.
+// params is the parenthesized parameter list, args the parenthesized names.
+#ifdef CPU_DISPATCH_X86
+#define CPU_DISPATCH(name, body, params, args)                                                      \
+    inline void name##Baseline params { body args; }                                                \
+    __attribute__((target("sse4.2") CPU_DISPATCH_NO_CONTRACT)) inline void name##Sse42 params {     \
+        body args;                                                                                  \
+    }                                                                                               \
+    __attribute__((target("avx2") CPU_DISPATCH_NO_CONTRACT)) inline void name##Avx2 params {        \
+        body args;                                                                                  \
+    }                                                                                               \
+    __attribute__((target("avx512f,avx512bw,avx512vl") CPU_DISPATCH_NO_CONTRACT)) inline void       \
+    name##Avx512 params {                                                                           \
+        body args;                                                                                  \
+    }                                                                                               \
+    inline void name params {                                                                       \
+        switch (cpu::activeIsa()) {                                                                 \
+            case cpu::Isa::AVX512:                                                                  \
+                name##Avx512 args;                                                                  \
+                break;                                                                              \
+            case cpu::Isa::AVX2:                                                                    \
+                name##Avx2 args;                                                                    \
+                break;                                                                              \
+            case cpu::Isa::SSE42:                                                                   \
+                name##Sse42 args;                                                                   \
+                break;                                                                              \
+            default:                                                                                \
+                name##Baseline args;                                                                \
+        }                                                                                           \
+    }
+#else
+#define CPU_DISPATCH(name, body, params, args) \
+    inline void name params { body args; }
+#endif
+
+#endif // CPU_DISPATCH_H
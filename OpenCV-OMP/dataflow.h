@@ -0,0 +1,283 @@
+#ifndef DATAFLOW_H
+#define DATAFLOW_H
+
+// Lazy dataflow graph of image stages.
+//
+// A pipeline is built once as a DAG of nodes and then evaluated on demand:
+// evaluate(outputs) runs only the nodes the requested outputs depend on, and
+// only those not computed since the last invalidate(), so asking for one more
+// output later runs just the stages it adds. Nodes write into buffers their
+// closures captured when the pipeline was built; the graph only orders them.
+//
+// Image nodes are computed as a whole once their inputs are. Row nodes are
+// computed in blocks of rows: rows(y0, y1) writes rows [y0, y1) of the node's
+// output and reads up to `halo` rows above and below from its row inputs. Runs
+// of row nodes between image nodes become one OpenMP task graph over blocks.
+// A block of a node depends only on the blocks of its inputs that its halo
+// reaches, so there is no barrier between stages. A row node without halo
+// whose only row input is the node just before it in its chain is fused into
+// that node's task: its block runs right after the producer's, while those
+// rows are still in cache.
+//
+// Inputs must be added before the nodes that read them, so node ids are in
+// topological order.
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include "perf_counters.h"
+#include "trace.h"
+
+namespace dataflow {
+
+// Row inputs of a row node; bounds the dependencies of its tasks
+const int MAX_ROW_INPUTS = 2;
+
+class Graph {
+public:
+    // Every row node covers rows [0, rows)
+    explicit Graph(int rows) : rows_(rows) {}
+
+    int addImage(const char* span, const std::vector<int>& inputs, std::function<void()> run) {
+        Node node;
+        node.span = span;
+        node.inputs = inputs;
+        node.run = std::move(run);
+        return add(node);
+    }
+
+    int addRows(const char* span, const std::vector<int>& inputs, int halo, perf::Stage& stage, std::function<void(int, int)> rows) {
+        Node node;
+        node.span = span;
+        node.inputs = inputs;
+        node.halo = halo;
+        node.stage = &stage;
+        node.rows = std::move(rows);
+        return add(node);
+    }
+
+    // Marks every node as not computed, e.g. when the input pixels changed
+    void invalidate() {
+        for (Node& node : nodes_) {
+            node.valid = false;
+        }
+    }
+
+    // Marks nodes and everything they depend on as computed elsewhere, e.g.
+    // by shard workers, so a later output that shares those inputs does not
+    // recompute them. Only the results of ids and of nodes writing to shared
+    // buffers are then visible here.
+    void markComputed(const std::vector<int>& ids) {
+        std::vector<char> needed(nodes_.size(), 0);
+        for (int id : ids) {
+            needed[id] = 1;
+        }
+        for (int id = static_cast<int>(nodes_.size()) - 1; id >= 0; --id) {
+            if (!needed[id]) {
+                continue;
+            }
+            nodes_[id].valid = true;
+            for (int input : nodes_[id].inputs) {
+                needed[input] = 1;
+            }
+        }
+    }
+
+    // Drops all nodes and the buffers their closures hold
+    void clear() {
+        nodes_.clear();
+    }
+
+    // Computes outputs and every node they depend on that is not computed yet
+    void evaluate(const std::vector<int>& outputs) {
+        std::vector<int> order = pending(outputs);
+        std::vector<int> group;
+        for (int id : order) {
+            if (nodes_[id].rows) {
+                group.push_back(id);
+                continue;
+            }
+            runRowGroup(group);
+            group.clear();
+            nodes_[id].run();
+        }
+        runRowGroup(group);
+        for (int id : order) {
+            nodes_[id].valid = true;
+        }
+    }
+
+    // Computes rows [rowBegin, rowEnd) of outputs sequentially, for shard
+    // workers. Earlier row nodes also compute the halo rows that later ones
+    // read, so a band needs nothing from other workers. Nodes are not marked
+    // as computed, since only a band of them is.
+    void evaluateRows(const std::vector<int>& outputs, int rowBegin, int rowEnd) {
+        std::vector<int> order = pending(outputs);
+        std::vector<int> extent(nodes_.size(), 0);
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            const Node& node = nodes_[*it];
+            for (int input : node.inputs) {
+                extent[input] = std::max(extent[input], extent[*it] + node.halo);
+            }
+        }
+        for (int id : order) {
+            const Node& node = nodes_[id];
+            if (node.rows) {
+                node.rows(std::max(0, rowBegin - extent[id]), std::min(rows_, rowEnd + extent[id]));
+            } else {
+                node.run();
+            }
+        }
+    }
+
+private:
+    struct Node {
+        const char* span = nullptr;
+        std::vector<int> inputs;
+        int halo = 0;
+        perf::Stage* stage = nullptr;
+        std::function<void()> run;
+        std::function<void(int, int)> rows;
+        bool valid = false;
+    };
+
+    int add(const Node& node) {
+        int id = static_cast<int>(nodes_.size());
+        int rowInputs = 0;
+        for (int input : node.inputs) {
+            if (input < 0 || input >= id) {
+                throw std::invalid_argument("dataflow: inputs must be added before the nodes that read them");
+            }
+            rowInputs += nodes_[input].rows ? 1 : 0;
+        }
+        if (node.rows && rowInputs > MAX_ROW_INPUTS) {
+            throw std::invalid_argument("dataflow: a row node reads at most two row nodes");
+        }
+        nodes_.push_back(node);
+        return id;
+    }
+
+    // Nodes the outputs need that are not computed, in topological order
+    std::vector<int> pending(const std::vector<int>& outputs) const {
+        std::vector<char> needed(nodes_.size(), 0);
+        for (int id : outputs) {
+            needed[id] = 1;
+        }
+        std::vector<int> order;
+        for (int id = static_cast<int>(nodes_.size()) - 1; id >= 0; --id) {
+            if (!needed[id] || nodes_[id].valid) {
+                continue;
+            }
+            order.push_back(id);
+            for (int input : nodes_[id].inputs) {
+                needed[input] = 1;
+            }
+        }
+        std::reverse(order.begin(), order.end());
+        return order;
+    }
+
+    // Runs row nodes as one task graph over blocks of rows. Nodes outside the
+    // group are already computed.
+    void runRowGroup(const std::vector<int>& group) {
+        if (group.empty()) {
+            return;
+        }
+
+        // Chains of nodes fused into one task, with the units they read
+        std::vector<std::vector<int>> units;
+        std::vector<std::vector<int>> unitInputs;
+        std::vector<int> unitHalo;
+        std::vector<int> depth;
+        std::vector<int> unitOf(nodes_.size(), -1);
+        int blockRows = 32;
+        for (int id : group) {
+            const Node& node = nodes_[id];
+            std::vector<int> inputs;
+            for (int input : node.inputs) {
+                if (unitOf[input] >= 0 && std::find(inputs.begin(), inputs.end(), unitOf[input]) == inputs.end()) {
+                    inputs.push_back(unitOf[input]);
+                }
+            }
+            int producer = -1;
+            for (int input : node.inputs) {
+                producer = unitOf[input] >= 0 ? input : producer;
+            }
+            if (node.halo == 0 && inputs.size() == 1 && units[inputs[0]].back() == producer) {
+                units[inputs[0]].push_back(id);
+                unitOf[id] = inputs[0];
+                continue;
+            }
+            int level = 0;
+            for (int input : inputs) {
+                level = std::max(level, depth[input] + 1);
+            }
+            unitOf[id] = static_cast<int>(units.size());
+            units.push_back({id});
+            unitInputs.push_back(inputs);
+            unitHalo.push_back(node.halo);
+            depth.push_back(level);
+            // Halos may only reach into the neighbouring block
+            blockRows = std::max(blockRows, node.halo);
+        }
+
+        const int unitCount = static_cast<int>(units.size());
+        const int blocks = (rows_ + blockRows - 1) / blockRows;
+        const int levels = *std::max_element(depth.begin(), depth.end()) + 1;
+
+        // One dependency token per unit and block, plus one that nothing
+        // writes for unused dependency slots; the pointer is only referenced
+        // from depend clauses
+        std::vector<char> tokens(unitCount * blocks + 1);
+        [[maybe_unused]] char* token = tokens.data();
+        const int none = unitCount * blocks;
+
+        #pragma omp parallel
+        #pragma omp single
+        {
+        // Tasks are created in wavefront order so that every block a task
+        // depends on already has its task when the dependence is declared
+        for (int step = 0; step < blocks + levels - 1; ++step) {
+            for (int u = 0; u < unitCount; ++u) {
+                int b = step - depth[u];
+                if (b < 0 || b >= blocks) {
+                    continue;
+                }
+                int y0 = b * blockRows;
+                int y1 = std::min(rows_, y0 + blockRows);
+                int reach = unitHalo[u] > 0 ? 1 : 0;
+
+                int in[3 * MAX_ROW_INPUTS];
+                std::fill(in, in + 3 * MAX_ROW_INPUTS, none);
+                for (size_t i = 0; i < unitInputs[u].size(); ++i) {
+                    int first = unitInputs[u][i] * blocks;
+                    in[3 * i] = first + std::max(b - reach, 0);
+                    in[3 * i + 1] = first + b;
+                    in[3 * i + 2] = first + std::min(b + reach, blocks - 1);
+                }
+                int out = u * blocks + b;
+                const std::vector<int>* members = &units[u];
+
+                #pragma omp task depend(in: token[in[0]], token[in[1]], token[in[2]], token[in[3]], token[in[4]], token[in[5]]) depend(out: token[out])
+                {
+                for (int id : *members) {
+                    const Node& node = nodes_[id];
+                    TRACE_SCOPE(node.span);
+                    PERF_SCOPE(*node.stage);
+                    node.rows(y0, y1);
+                }
+                }
+            }
+        }
+        }
+    }
+
+    int rows_;
+    std::vector<Node> nodes_;
+};
+
+} // namespace dataflow
+
+#endif // DATAFLOW_H
@@ -0,0 +1,433 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+// Raw video frames on stdin / stdout, for use inside ffmpeg pipelines such as
+//
+//   ffmpeg -i in.mp4 -f rawvideo -pix_fmt bgr24 -
+//     | ./2.1.1-omp - 1 --stream-size=3840x1080
+//     | ffmpeg -f rawvideo -pix_fmt bgr24 -s 1920x1080 -r 30 -i - out.mp4
+//
+// Frames are either packed bgr24, whose size is given on the command line, or
+// Y4M with 4:2:0 chroma, whose size and frame rate come from the stream
+// header. The output uses the same format as the input.
+//
+// A reader thread fills one of two frame buffers while the filter works on the
+// other. bgr24 frames are read straight into the buffer the filter then reads;
+// Y4M frames are converted to BGR on the reader thread. Both pipes are
+// enlarged so that a frame takes few wakeups to pass through them.
+
+#include <opencv2/opencv.hpp>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "cli_options.h"
+
+enum class StreamFormat {
+    BGR24,
+    Y4M
+};
+
+// Reads --stream-format=bgr24|y4m (default bgr24) and --stream-size=<w>x<h>,
+// which bgr24 requires and Y4M ignores. Returns false when they are invalid.
+inline bool parseStreamOptions(int argc, char** argv, StreamFormat& format, int& width, int& height) {
+    const char* format_option = findOption(argc, argv, "--stream-format");
+    const char* size_option = findOption(argc, argv, "--stream-size");
+    format = StreamFormat::BGR24;
+    width = 0;
+    height = 0;
+    if (format_option && strcmp(format_option, "y4m") == 0) {
+        format = StreamFormat::Y4M;
+        return true;
+    }
+    if (format_option && strcmp(format_option, "bgr24") != 0) {
+        return false;
+    }
+    char separator = 0;
+    return size_option && sscanf(size_option, "%d%c%d", &width, &separator, &height) == 3 && separator == 'x'
+        && width > 0 && height > 0;
+}
+
+namespace stream_detail {
+
+inline void enlargePipe(int fd) {
+#ifdef F_SETPIPE_SZ
+    // Fails harmlessly on files and terminals, and above
+    // /proc/sys/fs/pipe-max-size
+    fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+#else
+    (void)fd;
+#endif
+}
+
+// Reads n bytes unless the stream ends first; returns the number read
+inline size_t readFully(int fd, void* data, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t count = read(fd, static_cast<char*>(data) + done, n - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        done += static_cast<size_t>(count);
+    }
+    return done;
+}
+
+inline bool writeFully(int fd, const void* data, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t count = write(fd, static_cast<const char*>(data) + done, n - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        done += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Reads the pixels of image, row by row when its rows are padded (e.g. by
+// --pad-rows); returns the number of bytes read
+inline size_t readImage(int fd, cv::Mat& image) {
+    if (image.isContinuous()) {
+        return readFully(fd, image.data, image.total() * image.elemSize());
+    }
+    size_t row = image.cols * image.elemSize();
+    size_t done = 0;
+    for (int y = 0; y < image.rows; ++y) {
+        size_t count = readFully(fd, image.ptr(y), row);
+        done += count;
+        if (count != row) {
+            break;
+        }
+    }
+    return done;
+}
+
+// Writes the pixels of image without its row padding
+inline bool writeImage(int fd, const cv::Mat& image) {
+    if (image.isContinuous()) {
+        return writeFully(fd, image.data, image.total() * image.elemSize());
+    }
+    for (int y = 0; y < image.rows; ++y) {
+        if (!writeFully(fd, image.ptr(y), image.cols * image.elemSize())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads one '\n' terminated line byte by byte, so nothing past it is consumed
+inline bool readLine(int fd, std::string& line) {
+    line.clear();
+    char c;
+    while (readFully(fd, &c, 1) == 1) {
+        if (c == '\n') {
+            return true;
+        }
+        line += c;
+        if (line.size() > 4096) {
+            return false;
+        }
+    }
+    return false;
+}
+
+} // namespace stream_detail
+
+// Double-buffered frame source. The reader thread and the caller share two
+// slots: the thread fills whichever one the caller does not hold.
+class FrameReader {
+public:
+    // For Y4M the stream header is read here and sets the frame size; throws
+    // std::runtime_error when it is malformed or not 4:2:0
+    FrameReader(int fd, StreamFormat format, int width, int height)
+        : state_(std::make_shared<State>()) {
+        state_->fd = fd;
+        state_->format = format;
+        state_->width = width;
+        state_->height = height;
+        stream_detail::enlargePipe(fd);
+        if (format == StreamFormat::Y4M) {
+            readY4mHeader(*state_);
+        }
+        for (Slot& slot : state_->slots) {
+            slot.bgr.create(state_->height, state_->width, CV_8UC3);
+            if (format == StreamFormat::Y4M) {
+                slot.yuv.create(state_->height * 3 / 2, state_->width, CV_8UC1);
+            }
+        }
+        std::shared_ptr<State> state = state_;
+        thread_ = std::thread([state] { run(*state); });
+    }
+
+    // A reader still blocked on the pipe is left to end with the process; the
+    // shared state outlives this object
+    ~FrameReader() {
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            state_->stop = true;
+            done = state_->done;
+        }
+        state_->changed.notify_all();
+        if (done) {
+            thread_.join();
+        } else {
+            thread_.detach();
+        }
+    }
+
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+
+    int width() const {
+        return state_->width;
+    }
+
+    int height() const {
+        return state_->height;
+    }
+
+    // Y4M header fields other than the size and chroma (frame rate, aspect,
+    // interlacing), to be copied to the output
+    const std::string& y4mParameters() const {
+        return state_->parameters;
+    }
+
+    // True when the stream ended in the middle of a frame
+    bool truncated() const {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->truncated;
+    }
+
+    // Returns the next frame, or false at the end of the stream. The frame
+    // stays valid until the next call.
+    bool next(cv::Mat& frame) {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->held = -1;
+        state_->changed.notify_all();
+        Slot& slot = state_->slots[state_->nextSlot];
+        state_->changed.wait(lock, [&] { return slot.ready || state_->done; });
+        if (!slot.ready) {
+            return false;
+        }
+        slot.ready = false;
+        state_->held = state_->nextSlot;
+        state_->nextSlot ^= 1;
+        frame = slot.bgr;
+        return true;
+    }
+
+private:
+    struct Slot {
+        cv::Mat bgr;
+        cv::Mat yuv;
+        bool ready = false;
+    };
+
+    struct State {
+        int fd;
+        StreamFormat format;
+        int width;
+        int height;
+        std::string parameters;
+        Slot slots[2];
+        int held = -1;
+        int nextSlot = 0;
+        bool done = false;
+        bool stop = false;
+        bool truncated = false;
+        mutable std::mutex mutex;
+        std::condition_variable changed;
+    };
+
+    std::shared_ptr<State> state_;
+    std::thread thread_;
+
+    static void readY4mHeader(State& state) {
+        std::string line;
+        if (!stream_detail::readLine(state.fd, line) || line.compare(0, 10, "YUV4MPEG2 ") != 0) {
+            throw std::runtime_error("input is not a Y4M stream");
+        }
+        std::istringstream fields(line.substr(10));
+        std::string field;
+        std::string chroma = "420jpeg";
+        state.width = 0;
+        state.height = 0;
+        while (fields >> field) {
+            if (field[0] == 'W') {
+                state.width = atoi(field.c_str() + 1);
+            } else if (field[0] == 'H') {
+                state.height = atoi(field.c_str() + 1);
+            } else if (field[0] == 'C') {
+                chroma = field.substr(1);
+            } else if (field.compare(0, 7, "XYSCSS=") != 0) {
+                // The input chroma hint need not match the C420jpeg output
+                state.parameters += " " + field;
+            }
+        }
+        if (chroma.compare(0, 3, "420") != 0) {
+            throw std::runtime_error("unsupported Y4M chroma C" + chroma + ", use 4:2:0");
+        }
+        if (state.width <= 0 || state.height <= 0 || state.width % 2 || state.height % 2) {
+            throw std::runtime_error("Y4M frame size must be even and non-zero");
+        }
+    }
+
+    // Reads one frame into slot; false at the end of the stream
+    static bool fill(State& state, Slot& slot) {
+        if (state.format == StreamFormat::BGR24) {
+            size_t bytes = slot.bgr.total() * slot.bgr.elemSize();
+            size_t count = stream_detail::readImage(state.fd, slot.bgr);
+            if (count != bytes) {
+                state.truncated = count > 0;
+                return false;
+            }
+            return true;
+        }
+
+        std::string line;
+        if (!stream_detail::readLine(state.fd, line)) {
+            state.truncated = !line.empty();
+            return false;
+        }
+        if (line.compare(0, 5, "FRAME") != 0) {
+            state.truncated = true;
+            return false;
+        }
+        size_t bytes = slot.yuv.total();
+        if (stream_detail::readImage(state.fd, slot.yuv) != bytes) {
+            state.truncated = true;
+            return false;
+        }
+        cv::cvtColor(slot.yuv, slot.bgr, cv::COLOR_YUV2BGR_I420);
+        return true;
+    }
+
+    static void run(State& state) {
+        for (int i = 0;; i ^= 1) {
+            Slot& slot = state.slots[i];
+            {
+                std::unique_lock<std::mutex> lock(state.mutex);
+                state.changed.wait(lock, [&] { return state.stop || (!slot.ready && state.held != i); });
+                if (state.stop) {
+                    state.done = true;
+                    return;
+                }
+            }
+            // The slot is neither held nor ready, so the caller does not touch it
+            bool ok = fill(state, slot);
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                if (ok) {
+                    slot.ready = true;
+                } else {
+                    state.done = true;
+                }
+            }
+            state.changed.notify_all();
+            if (!ok) {
+                return;
+            }
+        }
+    }
+};
+
+// Writes BGR frames in the input's format. The Y4M header goes out with the
+// first frame, since the output size is only known then.
+class FrameWriter {
+public:
+    FrameWriter(int fd, StreamFormat format, const std::string& y4mParameters)
+        : fd_(fd), format_(format), parameters_(y4mParameters), headerWritten_(false) {
+        stream_detail::enlargePipe(fd);
+    }
+
+    // Returns false once the pipe is closed; throws std::runtime_error when a
+    // frame cannot be represented in Y4M 4:2:0
+    bool write(const cv::Mat& bgr) {
+        if (format_ == StreamFormat::BGR24) {
+            return stream_detail::writeImage(fd_, bgr);
+        }
+
+        if (bgr.cols % 2 || bgr.rows % 2) {
+            throw std::runtime_error("Y4M output size must be even");
+        }
+        if (!headerWritten_) {
+            std::string header = "YUV4MPEG2 W" + std::to_string(bgr.cols) + " H" + std::to_string(bgr.rows) + parameters_
+                + " C420jpeg\n";
+            if (!stream_detail::writeFully(fd_, header.data(), header.size())) {
+                return false;
+            }
+            headerWritten_ = true;
+        }
+        cv::cvtColor(bgr, yuv_, cv::COLOR_BGR2YUV_I420);
+        return stream_detail::writeFully(fd_, "FRAME\n", 6) && stream_detail::writeImage(fd_, yuv_);
+    }
+
+private:
+    int fd_;
+    StreamFormat format_;
+    std::string parameters_;
+    bool headerWritten_;
+    cv::Mat yuv_;
+};
+
+// Runs process on every frame from stdin and writes what it returns to
+// stdout. The returned image only needs to stay valid until the next call.
+// Statistics go to stderr, since stdout carries the frames. Returns the exit
+// code for main.
+inline int runFrameStream(StreamFormat format, int width, int height, const std::function<cv::Mat(const cv::Mat&)>& process) {
+    // A closed downstream pipe ends the stream instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    try {
+        FrameReader reader(STDIN_FILENO, format, width, height);
+        FrameWriter writer(STDOUT_FILENO, format, reader.y4mParameters());
+
+        auto begin = std::chrono::high_resolution_clock::now();
+        long frames = 0;
+        cv::Mat frame;
+        while (reader.next(frame)) {
+            if (!writer.write(process(frame))) {
+                std::cerr << "Error: Output pipe closed after " << frames << " frames." << std::endl;
+                return -1;
+            }
+            ++frames;
+        }
+        std::chrono::duration<double> diff = std::chrono::high_resolution_clock::now() - begin;
+
+        if (reader.truncated()) {
+            std::cerr << "Warning: Dropped an incomplete frame at the end of the input." << std::endl;
+        }
+        std::cerr << "Streamed " << frames << " frames of " << reader.width() << "x" << reader.height() << " in "
+                  << diff.count() << " s (" << frames / diff.count() << " fps)" << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+}
+
+#endif // FRAME_STREAM_H
@@ -0,0 +1,170 @@
+#ifndef MAT_ALLOCATOR_H
+#define MAT_ALLOCATOR_H
+
+// cv::MatAllocator for large image buffers.
+//
+// Every buffer is 64-byte aligned, so rows of SIMD-friendly widths start on a
+// cache line. Large buffers (2 MB and up) can additionally be backed by huge
+// pages, which cuts the TLB misses of the vertical blur taps that stride
+// through a whole image:
+//   - "thp":     2 MB aligned memory advised with MADV_HUGEPAGE (transparent
+//                huge pages)
+//   - "hugetlb": MAP_HUGETLB mappings from the reserved huge page pool, falling
+//                back to "thp" when none are reserved
+// With row padding, the row step of large buffers is rounded up to a multiple
+// of 64 bytes and kept off multiples of 4 KB, so vertically adjacent pixels do
+// not all map to the same cache sets. Padded images are not continuous; small
+// buffers are never padded, so reshape() on neighborhoods keeps working.
+//
+// installMatAllocator() makes it the default allocator of every cv::Mat,
+// including decoded images, so it must run before any image is created.
+
+#include <opencv2/opencv.hpp>
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+class AlignedMatAllocator : public cv::MatAllocator {
+public:
+    enum Pages {
+        SMALL_PAGES = 0,
+        TRANSPARENT_HUGE_PAGES,
+        EXPLICIT_HUGE_PAGES
+    };
+
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+    AlignedMatAllocator(Pages pages, bool padRows) : pages_(pages), padRows_(padRows) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step,
+                           cv::AccessFlag, cv::UMatUsageFlags) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i) {
+            if (step) {
+                if (data0 && step[i] != CV_AUTOSTEP) {
+                    total = step[i];
+                } else {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+
+        if (!data0 && step && padRows_ && dims == 2 && sizes[0] > 1 && total >= HUGE_PAGE_BYTES) {
+            size_t rowStep = (step[0] + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            if (rowStep % 4096 == 0) {
+                rowStep += ALIGNMENT;
+            }
+            step[0] = rowStep;
+            total = rowStep * sizes[0];
+        }
+
+        cv::UMatData* u = new cv::UMatData(this);
+        u->size = total;
+        if (data0) {
+            u->data = u->origdata = static_cast<uchar*>(data0);
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+        } else {
+            u->data = u->origdata = static_cast<uchar*>(allocateBytes(total, u->allocatorFlags_));
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag, cv::UMatUsageFlags) const override {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) {
+            return;
+        }
+        CV_Assert(u->urefcount == 0);
+        CV_Assert(u->refcount == 0);
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+            if (u->allocatorFlags_ == MAPPED) {
+                munmap(u->origdata, roundUp(u->size, HUGE_PAGE_BYTES));
+            } else {
+                free(u->origdata);
+            }
+            u->origdata = nullptr;
+        }
+        delete u;
+    }
+
+private:
+    // How a buffer was obtained, kept in UMatData::allocatorFlags_
+    enum Source {
+        ALIGNED_MALLOC = 0,
+        MAPPED
+    };
+
+    Pages pages_;
+    bool padRows_;
+
+    static size_t roundUp(size_t value, size_t multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    void* allocateBytes(size_t bytes, int& source) const {
+        bool large = bytes >= HUGE_PAGE_BYTES;
+
+        if (large && pages_ == EXPLICIT_HUGE_PAGES) {
+            void* mapped = mmap(nullptr, roundUp(bytes, HUGE_PAGE_BYTES), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mapped != MAP_FAILED) {
+                source = MAPPED;
+                return mapped;
+            }
+            static std::atomic<bool> warned(false);
+            if (!warned.exchange(true)) {
+                std::cerr << "Warning: No huge pages reserved, falling back to transparent huge pages." << std::endl;
+            }
+        }
+
+        void* data = nullptr;
+        if (large && pages_ != SMALL_PAGES) {
+            size_t rounded = roundUp(bytes, HUGE_PAGE_BYTES);
+            if (posix_memalign(&data, HUGE_PAGE_BYTES, rounded) == 0) {
+                madvise(data, rounded, MADV_HUGEPAGE);
+                source = ALIGNED_MALLOC;
+                return data;
+            }
+        }
+
+        if (posix_memalign(&data, ALIGNMENT, bytes ? bytes : ALIGNMENT) != 0) {
+            CV_Error(cv::Error::StsNoMem, "Failed to allocate image buffer");
+        }
+        source = ALIGNED_MALLOC;
+        return data;
+    }
+};
+
+// Installs the allocator selected by name ("default", "aligned", "thp" or
+// "hugetlb") for all images created afterwards. Returns false for an unknown
+// name.
+inline bool installMatAllocator(const char* name, bool padRows) {
+    AlignedMatAllocator::Pages pages;
+    if (strcmp(name, "default") == 0) {
+        return true;
+    } else if (strcmp(name, "aligned") == 0) {
+        pages = AlignedMatAllocator::SMALL_PAGES;
+    } else if (strcmp(name, "thp") == 0) {
+        pages = AlignedMatAllocator::TRANSPARENT_HUGE_PAGES;
+    } else if (strcmp(name, "hugetlb") == 0) {
+        pages = AlignedMatAllocator::EXPLICIT_HUGE_PAGES;
+    } else {
+        return false;
+    }
+
+    // Never destroyed: images held by statics and thread-locals may be freed
+    // during shutdown
+    cv::Mat::setDefaultAllocator(new AlignedMatAllocator(pages, padRows));
+    return true;
+}
+
+#endif // MAT_ALLOCATOR_H
@@ -0,0 +1,222 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+// Hardware performance counters per pipeline stage, read with perf_event_open.
+//
+// Counters count user-space events of the calling thread only, so every thread
+// that enters a perf::Scope lazily opens its own counter group. Each scope adds
+// its deltas to a perf::Stage with atomic adds, which aggregates the counts of
+// all OpenMP threads that worked on that stage. When perf events cannot be
+// opened (no PMU, restricted container, perf_event_paranoid) the stages only
+// collect thread time.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+namespace perf {
+
+enum Counter {
+    CYCLES = 0,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+const uint64_t CACHE_LINE_BYTES = 64;
+
+inline std::atomic<bool>& requestedFlag() {
+    static std::atomic<bool> flag(false);
+    return flag;
+}
+
+inline std::atomic<bool>& availableFlag() {
+    static std::atomic<bool> flag(false);
+    return flag;
+}
+
+inline int openEvent(uint32_t type, uint64_t config, int groupFd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0));
+}
+
+// Counter group of the calling thread. slot[c] is the position of counter c in
+// a group read, or -1 when that event is not supported on this host.
+struct ThreadCounters {
+    int fds[COUNTER_COUNT];
+    int slot[COUNTER_COUNT];
+    int leader_fd = -1;
+    int members = 0;
+
+    ThreadCounters() {
+        const uint32_t types[COUNTER_COUNT] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+        };
+        const uint64_t configs[COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            fds[c] = openEvent(types[c], configs[c], leader_fd);
+            slot[c] = fds[c] >= 0 ? members++ : -1;
+            if (leader_fd < 0 && fds[c] >= 0) {
+                leader_fd = fds[c];
+            }
+        }
+    }
+
+    ~ThreadCounters() {
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            if (fds[c] >= 0) {
+                close(fds[c]);
+            }
+        }
+    }
+
+    // Reads the group, scaled for multiplexing. Returns false without counters.
+    bool read(uint64_t values[COUNTER_COUNT]) const {
+        if (members == 0) {
+            return false;
+        }
+        uint64_t buffer[3 + COUNTER_COUNT];
+        if (::read(leader_fd, buffer, sizeof(buffer)) < static_cast<ssize_t>((3 + members) * sizeof(uint64_t))) {
+            return false;
+        }
+        uint64_t enabled = buffer[1];
+        uint64_t running = buffer[2];
+        double scale = running > 0 && running < enabled ? static_cast<double>(enabled) / running : 1.0;
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            values[c] = slot[c] >= 0 ? static_cast<uint64_t>(buffer[3 + slot[c]] * scale) : 0;
+        }
+        return true;
+    }
+};
+
+inline ThreadCounters& threadCounters() {
+    thread_local ThreadCounters counters;
+    return counters;
+}
+
+// Turns stage collection on. Returns false when hardware counters are not
+// available, in which case stages still record thread time.
+inline bool enable() {
+    requestedFlag().store(true, std::memory_order_relaxed);
+    bool available = threadCounters().members > 0;
+    availableFlag().store(available, std::memory_order_relaxed);
+    return available;
+}
+
+inline bool enabled() {
+    return requestedFlag().load(std::memory_order_relaxed);
+}
+
+inline bool available() {
+    return availableFlag().load(std::memory_order_relaxed);
+}
+
+struct Stage {
+    const char* name;
+    std::atomic<uint64_t> counts[COUNTER_COUNT];
+    std::atomic<uint64_t> supported[COUNTER_COUNT];
+    std::atomic<uint64_t> thread_ns;
+
+    explicit Stage(const char* stageName) : name(stageName), thread_ns(0) {
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            counts[c] = 0;
+            supported[c] = 0;
+        }
+    }
+};
+
+class Scope {
+public:
+    explicit Scope(Stage& stage) : stage_(stage), active_(enabled()), counting_(false) {
+        if (active_) {
+            counting_ = available() && threadCounters().read(begin_);
+            begin_time_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~Scope() {
+        if (!active_) {
+            return;
+        }
+        auto end_time = std::chrono::steady_clock::now();
+        uint64_t end[COUNTER_COUNT];
+        if (counting_ && threadCounters().read(end)) {
+            for (int c = 0; c < COUNTER_COUNT; ++c) {
+                if (threadCounters().slot[c] >= 0) {
+                    stage_.counts[c].fetch_add(end[c] - begin_[c], std::memory_order_relaxed);
+                    stage_.supported[c].store(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        stage_.thread_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time_).count(), std::memory_order_relaxed);
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    Stage& stage_;
+    bool active_;
+    bool counting_;
+    uint64_t begin_[COUNTER_COUNT];
+    std::chrono::steady_clock::time_point begin_time_;
+};
+
+// Prints one line per stage: thread time and, when counters were collected,
+// IPC, misses per pixel and the DRAM traffic implied by LLC misses.
+inline void report(const Stage& stage, double pixels) {
+    if (!enabled()) {
+        return;
+    }
+    std::cout << "[perf] " << stage.name << ": " << stage.thread_ns.load() / 1e6 << " ms thread time";
+    if (stage.supported[CYCLES] && stage.supported[INSTRUCTIONS] && stage.counts[CYCLES] > 0) {
+        std::cout << ", IPC " << static_cast<double>(stage.counts[INSTRUCTIONS]) / stage.counts[CYCLES];
+    }
+    if (pixels > 0) {
+        if (stage.supported[L1D_MISSES]) {
+            std::cout << ", L1D misses/pixel " << stage.counts[L1D_MISSES] / pixels;
+        }
+        if (stage.supported[LLC_MISSES]) {
+            std::cout << ", LLC misses/pixel " << stage.counts[LLC_MISSES] / pixels;
+            std::cout << ", DRAM bytes/pixel " << stage.counts[LLC_MISSES] * CACHE_LINE_BYTES / pixels;
+        }
+        if (stage.supported[BRANCH_MISSES]) {
+            std::cout << ", branch misses/pixel " << stage.counts[BRANCH_MISSES] / pixels;
+        }
+    }
+    if (!available()) {
+        std::cout << " (hardware counters unavailable)";
+    }
+    std::cout << std::endl;
+}
+
+} // namespace perf
+
+#define PERF_CONCAT_INNER(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_INNER(a, b)
+#define PERF_SCOPE(stage) perf::Scope PERF_CONCAT(perf_scope_, __LINE__)(stage)
+
+#endif // PERF_COUNTERS_H
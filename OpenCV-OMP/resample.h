@@ -0,0 +1,263 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+// Row-at-a-time resampling of 8-bit images to another size.
+//
+// The filter is separable: every output column and every output row is a
+// weighted sum of a few source columns or rows, whose indices and weights are
+// computed once per size. An output row is produced on its own: the source
+// rows under its vertical footprint are summed into a float row of source
+// width, which is then resampled horizontally and rounded to 8 bits. A
+// consumer can thus fuse resampling with its own per-row work and never hold
+// a resampled (or source-size) image, only two rows per thread.
+//
+// Filters, with replicated borders:
+//  - bilinear: two taps, as cv::resize INTER_LINEAR (no prefiltering, so
+//    strong downscales alias);
+//  - area: the coverage of each source pixel by the output pixel, as
+//    cv::resize INTER_AREA, which averages whole blocks when downscaling;
+//  - lanczos: Lanczos-3 stretched by the downscale factor, so it also
+//    prefilters, with sharper edges than area.
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "cpu_dispatch.h"
+
+namespace resample {
+
+enum class Filter {
+    BILINEAR,
+    AREA,
+    LANCZOS
+};
+
+inline const char* filterName(Filter filter) {
+    switch (filter) {
+        case Filter::BILINEAR:
+            return "bilinear";
+        case Filter::LANCZOS:
+            return "lanczos";
+        default:
+            return "area";
+    }
+}
+
+// Resolves "bilinear", "area" or "lanczos"; false for anything else
+inline bool parseFilter(const char* name, Filter& filter) {
+    for (Filter candidate : {Filter::BILINEAR, Filter::AREA, Filter::LANCZOS}) {
+        if (strcmp(name, filterName(candidate)) == 0) {
+            filter = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Output i of an axis is the sum over t < taps of weight[i * taps + t] times
+// source index[i * taps + t]
+struct Axis {
+    int taps = 0;
+    std::vector<int> index;
+    std::vector<float> weight;
+};
+
+namespace detail {
+
+inline double lanczos3(double x) {
+    x = std::abs(x);
+    if (x < 1e-9) {
+        return 1.0;
+    }
+    if (x >= 3.0) {
+        return 0.0;
+    }
+    double px = CV_PI * x;
+    return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+// Weights of output i from sources first, first + 1, ... before clamping
+inline void filterWeights(Filter filter, int i, int source, int target, int& first, std::vector<double>& weights) {
+    double scale = static_cast<double>(source) / target;
+    weights.clear();
+    if (filter == Filter::BILINEAR || (filter == Filter::AREA && scale < 1.0)) {
+        double fraction;
+        if (filter == Filter::BILINEAR) {
+            double center = (i + 0.5) * scale - 0.5;
+            first = static_cast<int>(std::floor(center));
+            fraction = center - first;
+        } else {
+            // Upscaling area interpolation as cv::resize: an output pixel
+            // inside a source pixel copies it, one that straddles two blends
+            first = static_cast<int>(std::floor(i * scale));
+            fraction = (i + 1) - (first + 1) / scale;
+            fraction = fraction <= 0.0 ? 0.0 : fraction - std::floor(fraction);
+        }
+        weights.push_back(1.0 - fraction);
+        weights.push_back(fraction);
+    } else if (filter == Filter::AREA) {
+        double begin = i * scale;
+        double end = begin + scale;
+        first = static_cast<int>(std::floor(begin));
+        for (int s = first; s < end; ++s) {
+            weights.push_back((std::min<double>(s + 1, end) - std::max<double>(s, begin)) / scale);
+        }
+    } else {
+        double stretch = std::max(scale, 1.0);
+        double center = (i + 0.5) * scale;
+        first = static_cast<int>(std::floor(center - 3.0 * stretch));
+        int last = static_cast<int>(std::ceil(center + 3.0 * stretch));
+        double total = 0.0;
+        for (int s = first; s <= last; ++s) {
+            weights.push_back(lanczos3((s + 0.5 - center) / stretch));
+            total += weights.back();
+        }
+        for (double& weight : weights) {
+            weight /= total;
+        }
+    }
+}
+
+} // namespace detail
+
+// Taps of every output of an axis of target samples over source samples.
+// Zero weights at either end are dropped; shorter footprints are padded with
+// zero weights so every output has the same number of taps.
+inline Axis buildAxis(Filter filter, int source, int target) {
+    std::vector<int> firsts(target);
+    std::vector<std::vector<double>> weights(target);
+    Axis axis;
+    for (int i = 0; i < target; ++i) {
+        detail::filterWeights(filter, i, source, target, firsts[i], weights[i]);
+        std::vector<double>& w = weights[i];
+        while (w.size() > 1 && std::abs(w.back()) < 1e-9) {
+            w.pop_back();
+        }
+        while (w.size() > 1 && std::abs(w.front()) < 1e-9) {
+            w.erase(w.begin());
+            ++firsts[i];
+        }
+        axis.taps = std::max(axis.taps, static_cast<int>(w.size()));
+    }
+    axis.index.assign(static_cast<size_t>(target) * axis.taps, 0);
+    axis.weight.assign(static_cast<size_t>(target) * axis.taps, 0.0f);
+    for (int i = 0; i < target; ++i) {
+        for (int t = 0; t < axis.taps; ++t) {
+            size_t k = static_cast<size_t>(i) * axis.taps + t;
+            int s = firsts[i] + std::min(t, static_cast<int>(weights[i].size()) - 1);
+            axis.index[k] = std::min(std::max(s, 0), source - 1);
+            axis.weight[k] = t < static_cast<int>(weights[i].size()) ? static_cast<float>(weights[i][t]) : 0.0f;
+        }
+    }
+    return axis;
+}
+
+// dst[k] = sum over t of weights[t] times element k of source row index[t],
+// for k < count; source rows are step bytes apart
+CPU_DISPATCH_INLINE void resampleVerticalRowKernel(const uchar* src, size_t step, const int* index, const float* weights, int taps,
+                                                   float* dst, int count) {
+    const uchar* first = src + index[0] * step;
+    for (int k = 0; k < count; ++k) {
+        dst[k] = weights[0] * first[k];
+    }
+    for (int t = 1; t < taps; ++t) {
+        const uchar* row = src + index[t] * step;
+        float weight = weights[t];
+        for (int k = 0; k < count; ++k) {
+            dst[k] += weight * row[k];
+        }
+    }
+}
+
+// Horizontal taps of a float row into cols rounded 8-bit pixels. Taps are
+// the outer loop, so the inner one runs along the output row and vectorizes;
+// sum holds cols * channels floats.
+template <int CHANNELS>
+CPU_DISPATCH_INLINE void resampleHorizontalRowChannels(const float* src, const int* index, const float* weights, int taps, float* sum,
+                                                       uchar* dst, int cols) {
+    for (int t = 0; t < taps; ++t) {
+        for (int x = 0; x < cols; ++x) {
+            float weight = weights[x * taps + t];
+            const float* pixel = src + index[x * taps + t] * CHANNELS;
+            for (int c = 0; c < CHANNELS; ++c) {
+                sum[x * CHANNELS + c] = (t > 0 ? sum[x * CHANNELS + c] : 0.0f) + weight * pixel[c];
+            }
+        }
+    }
+    for (int k = 0; k < cols * CHANNELS; ++k) {
+        dst[k] = static_cast<uchar>(std::min(255.0f, std::max(0.0f, sum[k])) + 0.5f);
+    }
+}
+
+CPU_DISPATCH_INLINE void resampleHorizontalRowKernel(const float* src, const int* index, const float* weights, int taps,
+                                                     int channels, float* sum, uchar* dst, int cols) {
+    if (channels == 3) {
+        resampleHorizontalRowChannels<3>(src, index, weights, taps, sum, dst, cols);
+    } else {
+        resampleHorizontalRowChannels<1>(src, index, weights, taps, sum, dst, cols);
+    }
+}
+
+CPU_DISPATCH(resampleVerticalRow, resampleVerticalRowKernel,
+             (const uchar* src, size_t step, const int* index, const float* weights, int taps, float* dst, int count),
+             (src, step, index, weights, taps, dst, count))
+
+CPU_DISPATCH(resampleHorizontalRow, resampleHorizontalRowKernel,
+             (const float* src, const int* index, const float* weights, int taps, int channels, float* sum, uchar* dst, int cols),
+             (src, index, weights, taps, channels, sum, dst, cols))
+
+class Resampler {
+public:
+    Resampler(cv::Size source, cv::Size target, Filter filter)
+        : source_(source), target_(target), filter_(filter), columns_(buildAxis(filter, source.width, target.width)),
+          rows_(buildAxis(filter, source.height, target.height)) {}
+
+    cv::Size targetSize() const {
+        return target_;
+    }
+
+    Filter filter() const {
+        return filter_;
+    }
+
+    // Source rows summed per output row, and source columns per output column
+    int verticalTaps() const {
+        return rows_.taps;
+    }
+
+    int horizontalTaps() const {
+        return columns_.taps;
+    }
+
+    // Floats of scratch space resampleRow needs for an image of channels:
+    // a source row and a target row
+    size_t scratchSize(int channels) const {
+        return static_cast<size_t>(source_.width + target_.width) * channels;
+    }
+
+    // Writes output row y of src (8-bit with 1 or 3 channels, of the source
+    // size) to dst, which holds a row of the target width. scratch holds
+    // scratchSize floats.
+    void resampleRow(const cv::Mat& src, int y, uchar* dst, float* scratch) const {
+        size_t taps = static_cast<size_t>(y) * rows_.taps;
+        resampleVerticalRow(src.data, src.step, &rows_.index[taps], &rows_.weight[taps], rows_.taps, scratch,
+                            source_.width * src.channels());
+        resampleHorizontalRow(scratch, columns_.index.data(), columns_.weight.data(), columns_.taps, src.channels(),
+                              scratch + source_.width * src.channels(), dst, target_.width);
+    }
+
+private:
+    cv::Size source_;
+    cv::Size target_;
+    Filter filter_;
+    Axis columns_;
+    Axis rows_;
+};
+
+} // namespace resample
+
+#endif // RESAMPLE_H
@@ -0,0 +1,283 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+// Content-addressed on-disk cache of tool results.
+//
+// An entry is keyed by a fast 64-bit hash of the decoded input pixels combined
+// with a description of the operation (name, parameters and engine version).
+// The description and input hash are also stored in the entry and checked on
+// lookup, so a hash collision is treated as a miss, as is an entry with another
+// number of outputs, an empty output or one the file is too short to hold.
+// Entries are written to a temporary file and renamed, so concurrent jobs
+// never read a partial entry.
+//
+// The cache is bounded in bytes. Hits refresh the entry's modification time and
+// inserts evict the least recently used entries until the directory fits.
+// Hit, miss and eviction counts are kept in a small stats file next to the
+// entries and accumulate across runs; updates hold an exclusive flock on a
+// lock file, so concurrent runs do not lose counts.
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/file.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+class ResultCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    ResultCache(const std::string& directory, uint64_t maxBytes) : directory_(directory), maxBytes_(maxBytes) {
+        std::error_code error;
+        std::filesystem::create_directories(directory_, error);
+    }
+
+    // 64-bit hash of the pixel data, size and type. Four independent lanes keep
+    // the multiply chains short so hashing runs near memory speed.
+    static uint64_t hashImage(const cv::Mat& image) {
+        const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+        uint64_t lanes[4] = {
+            0x243F6A8885A308D3ULL ^ static_cast<uint64_t>(image.rows),
+            0x13198A2E03707344ULL ^ static_cast<uint64_t>(image.cols),
+            0xA4093822299F31D0ULL ^ static_cast<uint64_t>(image.type()),
+            0x082EFA98EC4E6C89ULL
+        };
+        size_t rowBytes = image.cols * image.elemSize();
+        for (int y = 0; y < image.rows; ++y) {
+            const uint8_t* row = image.ptr<uint8_t>(y);
+            size_t i = 0;
+            for (; i + 32 <= rowBytes; i += 32) {
+                for (int lane = 0; lane < 4; ++lane) {
+                    uint64_t word;
+                    memcpy(&word, row + i + 8 * lane, sizeof(word));
+                    lanes[lane] = mix(lanes[lane] ^ word, prime);
+                }
+            }
+            for (; i < rowBytes; ++i) {
+                lanes[3] = mix(lanes[3] ^ row[i], prime);
+            }
+        }
+        return mix(mix(lanes[0] ^ (lanes[1] >> 1), prime) ^ mix(lanes[2] ^ (lanes[3] >> 1), prime), prime);
+    }
+
+    // Entry key for an input hash and an operation description such as
+    // "2.1.3 denoise n=5 f=1 v=1".
+    static std::string key(uint64_t inputHash, const std::string& operation) {
+        uint64_t hash = inputHash;
+        for (unsigned char c : operation) {
+            hash = mix(hash ^ c, 0x9E3779B97F4A7C15ULL);
+        }
+        char buffer[17];
+        snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(hash));
+        return buffer;
+    }
+
+    // Loads the outputs of a stored result into outputs. Only an entry with
+    // exactly count non-empty outputs is a hit.
+    bool lookup(uint64_t inputHash, const std::string& operation, size_t count, std::vector<cv::Mat>& outputs) {
+        std::string path = entryPath(key(inputHash, operation));
+        if (!readEntry(path, inputHash, operation, count, outputs)) {
+            recordStats(0, 1, 0);
+            return false;
+        }
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+        recordStats(1, 0, 0);
+        return true;
+    }
+
+    void store(uint64_t inputHash, const std::string& operation, const std::vector<cv::Mat>& outputs) {
+        std::string path = entryPath(key(inputHash, operation));
+        std::string temporary = path + ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            if (!out) {
+                return;
+            }
+            writeValue(out, MAGIC);
+            writeValue(out, inputHash);
+            writeValue(out, static_cast<uint32_t>(operation.size()));
+            out.write(operation.data(), operation.size());
+            writeValue(out, static_cast<uint32_t>(outputs.size()));
+            for (const cv::Mat& mat : outputs) {
+                writeValue(out, static_cast<int32_t>(mat.rows));
+                writeValue(out, static_cast<int32_t>(mat.cols));
+                writeValue(out, static_cast<int32_t>(mat.type()));
+                for (int y = 0; y < mat.rows; ++y) {
+                    out.write(reinterpret_cast<const char*>(mat.ptr(y)), mat.cols * mat.elemSize());
+                }
+            }
+            if (!out) {
+                std::filesystem::remove(temporary);
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        evict();
+    }
+
+    Stats stats() const {
+        Stats stats;
+        std::ifstream in(directory_ + "/stats");
+        in >> stats.hits >> stats.misses >> stats.evictions;
+        return stats;
+    }
+
+    void printStats(std::ostream& out) const {
+        Stats current = stats();
+        uint64_t lookups = current.hits + current.misses;
+        out << "Cache: " << current.hits << " hits, " << current.misses << " misses";
+        if (lookups > 0) {
+            out << " (" << 100.0 * current.hits / lookups << "% hit rate)";
+        }
+        out << ", " << current.evictions << " evictions, " << directoryBytes() / (1024.0 * 1024.0) << " MB used" << std::endl;
+    }
+
+private:
+    static constexpr uint64_t MAGIC = 0x3145484341435252ULL;  // "RRCACHE1"
+
+    std::string directory_;
+    uint64_t maxBytes_;
+
+    static uint64_t mix(uint64_t value, uint64_t prime) {
+        value *= prime;
+        return value ^ (value >> 29);
+    }
+
+    template <typename T>
+    static void writeValue(std::ofstream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static bool readValue(std::ifstream& in, T& value) {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    std::string entryPath(const std::string& entryKey) const {
+        return directory_ + "/" + entryKey + ".entry";
+    }
+
+    static bool readEntry(const std::string& path, uint64_t inputHash, const std::string& operation, size_t expectedCount,
+                          std::vector<cv::Mat>& outputs) {
+        std::error_code error;
+        uint64_t fileBytes = std::filesystem::file_size(path, error);
+        if (error) {
+            return false;
+        }
+        std::ifstream in(path, std::ios::binary);
+        uint64_t magic, storedHash;
+        uint32_t operationSize, count;
+        if (!in || !readValue(in, magic) || magic != MAGIC || !readValue(in, storedHash) || storedHash != inputHash
+            || !readValue(in, operationSize) || operationSize != operation.size()) {
+            return false;
+        }
+        std::string storedOperation(operationSize, '\0');
+        if (!in.read(&storedOperation[0], operationSize) || storedOperation != operation || !readValue(in, count)
+            || count != expectedCount) {
+            return false;
+        }
+
+        std::vector<cv::Mat> loaded(count);
+        for (cv::Mat& mat : loaded) {
+            int32_t rows, cols, type;
+            if (!readValue(in, rows) || !readValue(in, cols) || !readValue(in, type) || rows <= 0 || cols <= 0
+                || type != CV_MAT_TYPE(type)) {
+                return false;
+            }
+            // A corrupt size must not allocate more than the file can hold
+            uint64_t bytes = static_cast<uint64_t>(rows) * static_cast<uint64_t>(cols) * CV_ELEM_SIZE(type);
+            if (bytes > fileBytes - static_cast<uint64_t>(in.tellg())) {
+                return false;
+            }
+            mat.create(rows, cols, type);
+            for (int y = 0; y < rows; ++y) {
+                if (!in.read(reinterpret_cast<char*>(mat.ptr(y)), mat.cols * mat.elemSize())) {
+                    return false;
+                }
+            }
+        }
+        outputs.swap(loaded);
+        return true;
+    }
+
+    uint64_t directoryBytes() const {
+        uint64_t total = 0;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(directory_, error)) {
+            if (entry.path().extension() == ".entry") {
+                total += entry.file_size(error);
+            }
+        }
+        return total;
+    }
+
+    // Removes least recently used entries until the cache fits in maxBytes_
+    void evict() {
+        struct Entry {
+            std::filesystem::path path;
+            std::filesystem::file_time_type used;
+            uint64_t bytes;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(directory_, error)) {
+            if (entry.path().extension() == ".entry") {
+                Entry item{entry.path(), entry.last_write_time(error), entry.file_size(error)};
+                total += item.bytes;
+                entries.push_back(item);
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+
+        uint64_t evicted = 0;
+        for (size_t i = 0; i < entries.size() && total > maxBytes_; ++i) {
+            if (std::filesystem::remove(entries[i].path, error)) {
+                total -= entries[i].bytes;
+                ++evicted;
+            }
+        }
+        if (evicted > 0) {
+            recordStats(0, 0, evicted);
+        }
+    }
+
+    void recordStats(uint64_t hits, uint64_t misses, uint64_t evictions) {
+        // The lock serializes the read-modify-write; the rename keeps
+        // printStats, which does not lock, from reading a partial file
+        int lock = open((directory_ + "/stats.lock").c_str(), O_RDWR | O_CREAT, 0644);
+        if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+            if (lock >= 0) {
+                close(lock);
+            }
+            return;
+        }
+        Stats current = stats();
+        std::string temporary = directory_ + "/stats.tmp" + std::to_string(getpid());
+        {
+            std::ofstream out(temporary);
+            out << current.hits + hits << " " << current.misses + misses << " " << current.evictions + evictions << "\n";
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, directory_ + "/stats", error);
+        close(lock);
+    }
+};
+
+#endif // RESULT_CACHE_H
@@ -0,0 +1,337 @@
+#ifndef ROOFLINE_H
+#define ROOFLINE_H
+
+// Roofline model of the imaging kernels.
+//
+// measureMachine() measures the two roofs of the host: the memory bandwidth
+// with a STREAM triad (a = b + s * c over arrays much larger than the caches,
+// 24 bytes per element as STREAM counts them) and the peak floating point
+// rate with an FMA microkernel that keeps ten independent accumulator chains
+// per thread, in single and in double precision. Both run on all OpenMP
+// threads and keep the best of several runs.
+//
+// A Kernel is one engine's run: its operation and byte counts come from a
+// model of the loop (the compulsory traffic, with reuse inside the sliding
+// windows assumed to hit the cache), its time is measured. The report puts
+// each kernel under its roofline: attainable = min(peak, intensity *
+// bandwidth), the kernel is bandwidth-bound when its arithmetic intensity is
+// below the ridge point peak / bandwidth and compute-bound above it, and the
+// percentage is the achieved rate over the roof that limits it.
+//
+// Integer kernels (the anaglyph lookup tables) are measured against the
+// single precision roof, which has the same number of 32-bit lanes.
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ROOFLINE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace roofline {
+
+enum Precision {
+    SINGLE,
+    DOUBLE,
+    INTEGER
+};
+
+inline const char* precisionName(Precision precision) {
+    switch (precision) {
+        case SINGLE:
+            return "single";
+        case DOUBLE:
+            return "double";
+        default:
+            return "integer";
+    }
+}
+
+struct Machine {
+    std::string isa;
+    int threads;
+    double bandwidth;    // bytes per second
+    double peakSingle;   // FLOP per second
+    double peakDouble;   // FLOP per second
+
+    double peak(Precision precision) const {
+        return precision == DOUBLE ? peakDouble : peakSingle;
+    }
+};
+
+struct Kernel {
+    std::string name;
+    Precision precision;
+    double flops;    // operations of one run
+    double bytes;    // compulsory memory traffic of one run
+    double seconds;  // best time of one run
+};
+
+// Best time of run(): repeated until it has run three times or for about a
+// second, but at least once
+inline double bestSeconds(const std::function<void()>& run) {
+    double best = 0.0;
+    double total = 0.0;
+    for (int runs = 0; runs < 3 && (runs == 0 || total < 1.0); ++runs) {
+        auto begin = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        best = runs == 0 ? elapsed.count() : std::min(best, elapsed.count());
+        total += elapsed.count();
+    }
+    return best;
+}
+
+namespace detail {
+
+// Keeps results alive so the microkernels are not optimized away
+inline void sink(double value) {
+    __asm__ volatile("" : : "g"(value) : "memory");
+}
+
+// FMA microkernel: ten independent chains of acc = acc * a + b, enough to
+// cover the latency of two FMA pipes. Returns the FLOP count of iterations
+// rounds. The accumulators are unrolled by hand so they stay in registers.
+#define ROOFLINE_FMA_KERNEL(name, attributes, vec, scalar, set1, fmadd, add)                         \
+    attributes inline double name(long iterations) {                                                  \
+        vec a = set1(static_cast<scalar>(0.999999));                                                 \
+        vec b = set1(static_cast<scalar>(1e-6));                                                     \
+        vec c0 = set1(0), c1 = set1(1), c2 = set1(2), c3 = set1(3), c4 = set1(4);                    \
+        vec c5 = set1(5), c6 = set1(6), c7 = set1(7), c8 = set1(8), c9 = set1(9);                    \
+        for (long it = 0; it < iterations; ++it) {                                                    \
+            c0 = fmadd(c0, a, b); c1 = fmadd(c1, a, b); c2 = fmadd(c2, a, b); c3 = fmadd(c3, a, b);   \
+            c4 = fmadd(c4, a, b); c5 = fmadd(c5, a, b); c6 = fmadd(c6, a, b); c7 = fmadd(c7, a, b);   \
+            c8 = fmadd(c8, a, b); c9 = fmadd(c9, a, b);                                               \
+        }                                                                                             \
+        vec sum = add(add(add(add(c0, c1), add(c2, c3)), add(add(c4, c5), add(c6, c7))), add(c8, c9)); \
+        scalar lanes[sizeof(vec) / sizeof(scalar)];                                                   \
+        memcpy(lanes, &sum, sizeof(sum));                                                             \
+        sink(lanes[0]);                                                                               \
+        return 2.0 * 10 * (sizeof(vec) / sizeof(scalar)) * iterations;                                \
+    }
+
+inline float setSingle(float x) { return x; }
+inline double setDouble(double x) { return x; }
+inline float scalarFma(float x, float a, float b) { return x * a + b; }
+inline double scalarFma(double x, double a, double b) { return x * a + b; }
+inline float scalarAdd(float x, float y) { return x + y; }
+inline double scalarAdd(double x, double y) { return x + y; }
+
+ROOFLINE_FMA_KERNEL(fmaScalarSingle, , float, float, setSingle, scalarFma, scalarAdd)
+ROOFLINE_FMA_KERNEL(fmaScalarDouble, , double, double, setDouble, scalarFma, scalarAdd)
+
+#ifdef ROOFLINE_X86
+#define ROOFLINE_SSE_FMA_PS(x, a, b) _mm_add_ps(_mm_mul_ps(x, a), b)
+#define ROOFLINE_SSE_FMA_PD(x, a, b) _mm_add_pd(_mm_mul_pd(x, a), b)
+ROOFLINE_FMA_KERNEL(fmaSseSingle, __attribute__((target("sse2"))), __m128, float, _mm_set1_ps, ROOFLINE_SSE_FMA_PS, _mm_add_ps)
+ROOFLINE_FMA_KERNEL(fmaSseDouble, __attribute__((target("sse2"))), __m128d, double, _mm_set1_pd, ROOFLINE_SSE_FMA_PD, _mm_add_pd)
+ROOFLINE_FMA_KERNEL(fmaAvx2Single, __attribute__((target("avx2,fma"))), __m256, float, _mm256_set1_ps, _mm256_fmadd_ps, _mm256_add_ps)
+ROOFLINE_FMA_KERNEL(fmaAvx2Double, __attribute__((target("avx2,fma"))), __m256d, double, _mm256_set1_pd, _mm256_fmadd_pd, _mm256_add_pd)
+ROOFLINE_FMA_KERNEL(fmaAvx512Single, __attribute__((target("avx512f"))), __m512, float, _mm512_set1_ps, _mm512_fmadd_ps, _mm512_add_ps)
+ROOFLINE_FMA_KERNEL(fmaAvx512Double, __attribute__((target("avx512f"))), __m512d, double, _mm512_set1_pd, _mm512_fmadd_pd, _mm512_add_pd)
+#elif defined(__aarch64__)
+#define ROOFLINE_NEON_FMA_PS(x, a, b) vfmaq_f32(b, x, a)
+#define ROOFLINE_NEON_FMA_PD(x, a, b) vfmaq_f64(b, x, a)
+ROOFLINE_FMA_KERNEL(fmaNeonSingle, , float32x4_t, float, vdupq_n_f32, ROOFLINE_NEON_FMA_PS, vaddq_f32)
+ROOFLINE_FMA_KERNEL(fmaNeonDouble, , float64x2_t, double, vdupq_n_f64, ROOFLINE_NEON_FMA_PD, vaddq_f64)
+#endif
+
+#undef ROOFLINE_FMA_KERNEL
+
+typedef double (*FmaKernel)(long);
+
+// Widest FMA microkernels this CPU runs
+inline void selectFmaKernels(std::string& isa, FmaKernel& single, FmaKernel& dbl) {
+#ifdef ROOFLINE_X86
+    if (__builtin_cpu_supports("avx512f")) {
+        isa = "avx512f";
+        single = fmaAvx512Single;
+        dbl = fmaAvx512Double;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        isa = "avx2+fma";
+        single = fmaAvx2Single;
+        dbl = fmaAvx2Double;
+    } else {
+        isa = "sse2";
+        single = fmaSseSingle;
+        dbl = fmaSseDouble;
+    }
+#elif defined(__aarch64__)
+    isa = "neon";
+    single = fmaNeonSingle;
+    dbl = fmaNeonDouble;
+#else
+    isa = "scalar";
+    single = fmaScalarSingle;
+    dbl = fmaScalarDouble;
+#endif
+}
+
+// FLOP per second of kernel on all threads, best of three runs after a
+// warm-up that lets the cores reach their sustained clock
+inline double measurePeak(FmaKernel kernel) {
+    const long iterations = 1L << 23;
+    double best = 0.0;
+    for (int run = 0; run < 4; ++run) {
+        double flops = 0.0;
+        auto begin = std::chrono::steady_clock::now();
+        #pragma omp parallel reduction(+: flops)
+        flops += kernel(iterations);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        if (run > 0) {
+            best = std::max(best, flops / elapsed.count());
+        }
+    }
+    return best;
+}
+
+// Triad bandwidth in bytes per second, best of ten runs. The arrays are
+// first touched with the same static schedule as the triad, so every thread
+// streams its own pages (and NUMA node).
+inline double measureBandwidth() {
+    const long count = 1L << 23;  // 64 MB per array
+    std::unique_ptr<double[]> a(new double[count]);
+    std::unique_ptr<double[]> b(new double[count]);
+    std::unique_ptr<double[]> c(new double[count]);
+    double* pa = a.get();
+    double* pb = b.get();
+    double* pc = c.get();
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < count; ++i) {
+        pa[i] = 0.0;
+        pb[i] = 1.0;
+        pc[i] = 2.0;
+    }
+
+    const double scalar = 3.0;
+    double best = 0.0;
+    for (int run = 0; run < 10; ++run) {
+        auto begin = std::chrono::steady_clock::now();
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < count; ++i) {
+            pa[i] = pb[i] + scalar * pc[i];
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        best = std::max(best, 3.0 * sizeof(double) * count / elapsed.count());
+    }
+    sink(pa[count / 2]);
+    return best;
+}
+
+inline std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            escaped += '\\';
+        }
+        escaped += ch;
+    }
+    return escaped;
+}
+
+} // namespace detail
+
+// Measures the memory and compute roofs of this host; takes about a second
+inline Machine measureMachine() {
+    Machine machine;
+    detail::FmaKernel single;
+    detail::FmaKernel dbl;
+    detail::selectFmaKernels(machine.isa, single, dbl);
+    machine.threads = omp_get_max_threads();
+    machine.bandwidth = detail::measureBandwidth();
+    machine.peakSingle = detail::measurePeak(single);
+    machine.peakDouble = detail::measurePeak(dbl);
+    return machine;
+}
+
+// Where a kernel sits under the roofline
+struct Placement {
+    double intensity;    // FLOP per byte
+    double attainable;   // FLOP per second
+    double fraction;     // of the limiting roof
+    bool bandwidthBound;
+};
+
+inline Placement place(const Machine& machine, const Kernel& kernel) {
+    Placement placement;
+    double peak = machine.peak(kernel.precision);
+    placement.intensity = kernel.bytes > 0 ? kernel.flops / kernel.bytes : 0.0;
+    placement.bandwidthBound = placement.intensity < peak / machine.bandwidth;
+    placement.attainable = std::min(peak, placement.intensity * machine.bandwidth);
+    placement.fraction = placement.bandwidthBound
+        ? kernel.bytes / kernel.seconds / machine.bandwidth
+        : kernel.flops / kernel.seconds / peak;
+    return placement;
+}
+
+// One line for the machine and one per kernel
+inline void printReport(const Machine& machine, const std::vector<Kernel>& kernels, std::ostream& out) {
+    out << "[roofline] machine: " << machine.bandwidth / 1e9 << " GB/s triad, " << machine.peakSingle / 1e9
+        << " GFLOP/s single, " << machine.peakDouble / 1e9 << " GFLOP/s double (" << machine.isa << ", "
+        << machine.threads << " threads), ridge " << machine.peakSingle / machine.bandwidth << " / "
+        << machine.peakDouble / machine.bandwidth << " FLOP/byte" << std::endl;
+    for (const Kernel& kernel : kernels) {
+        Placement placement = place(machine, kernel);
+        out << "[roofline] " << kernel.name << ": " << kernel.seconds * 1000 << " ms, "
+            << kernel.bytes / kernel.seconds / 1e9 << " GB/s, " << kernel.flops / kernel.seconds / 1e9 << " G"
+            << (kernel.precision == INTEGER ? "OP" : "FLOP") << "/s, " << placement.intensity << " "
+            << (kernel.precision == INTEGER ? "OP" : "FLOP") << "/byte, " << placement.fraction * 100
+            << "% of roofline, " << (placement.bandwidthBound ? "bandwidth" : "compute") << "-bound ("
+            << precisionName(kernel.precision) << ")" << std::endl;
+    }
+}
+
+// The same report as JSON. Returns false when the file cannot be written.
+inline bool writeJson(const Machine& machine, const std::vector<Kernel>& kernels, const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "{\n  \"machine\": {\"isa\": \"%s\", \"threads\": %d, \"bandwidth_gbs\": %.3f, "
+            "\"peak_single_gflops\": %.3f, \"peak_double_gflops\": %.3f},\n  \"kernels\": [",
+            detail::jsonEscape(machine.isa).c_str(), machine.threads, machine.bandwidth / 1e9,
+            machine.peakSingle / 1e9, machine.peakDouble / 1e9);
+    for (size_t i = 0; i < kernels.size(); ++i) {
+        const Kernel& kernel = kernels[i];
+        Placement placement = place(machine, kernel);
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"precision\": \"%s\", \"seconds\": %.9f, \"flops\": %.0f, "
+                "\"bytes\": %.0f, \"gbs\": %.3f, \"gflops\": %.3f, \"intensity\": %.4f, "
+                "\"attainable_gflops\": %.3f, \"roofline_fraction\": %.4f, \"bound\": \"%s\"}",
+                i ? "," : "", detail::jsonEscape(kernel.name).c_str(), precisionName(kernel.precision),
+                kernel.seconds, kernel.flops, kernel.bytes, kernel.bytes / kernel.seconds / 1e9,
+                kernel.flops / kernel.seconds / 1e9, placement.intensity, placement.attainable / 1e9,
+                placement.fraction, placement.bandwidthBound ? "bandwidth" : "compute");
+    }
+    fprintf(file, "\n  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+// Prints the report and, when jsonPath is given, writes it as JSON too.
+// Returns false when the JSON file cannot be written.
+inline bool report(const Machine& machine, const std::vector<Kernel>& kernels, const char* jsonPath) {
+    printReport(machine, kernels, std::cout);
+    if (jsonPath && !writeJson(machine, kernels, jsonPath)) {
+        return false;
+    }
+    if (jsonPath) {
+        std::cout << "Roofline written to " << jsonPath << std::endl;
+    }
+    return true;
+}
+
+} // namespace roofline
+
+#endif // ROOFLINE_H
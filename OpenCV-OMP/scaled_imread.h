@@ -0,0 +1,134 @@
+#ifndef SCALED_IMREAD_H
+#define SCALED_IMREAD_H
+
+// Decoding straight to a smaller output width.
+//
+// JPEG decoders can produce 1/2, 1/4 and 1/8 scale images from the DCT
+// coefficients (IMREAD_REDUCED_COLOR_*), skipping most of the inverse DCT and
+// colour conversion work. imreadWithWidth() reads the JPEG header to learn the
+// source size, decodes at the strongest reduction that is still at least as
+// wide as requested and resamples the remainder with INTER_AREA. Other formats
+// are decoded at full size and resampled.
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// Reads the frame size from the SOF marker of a JPEG file. Returns false when
+// the file is not a JPEG or the header cannot be parsed.
+inline bool jpegImageSize(const std::string& path, int& width, int& height) {
+    std::ifstream in(path, std::ios::binary);
+    unsigned char header[2];
+    if (!in.read(reinterpret_cast<char*>(header), 2) || header[0] != 0xFF || header[1] != 0xD8) {
+        return false;
+    }
+
+    while (in) {
+        int byte = in.get();
+        if (byte != 0xFF) {
+            return false;
+        }
+        int marker = in.get();
+        while (marker == 0xFF) {
+            marker = in.get();
+        }
+        if (marker == EOF || marker == 0xD9 || marker == 0xDA) {
+            return false;
+        }
+        // Markers without a payload
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue;
+        }
+
+        unsigned char lengthBytes[2];
+        if (!in.read(reinterpret_cast<char*>(lengthBytes), 2)) {
+            return false;
+        }
+        int length = (lengthBytes[0] << 8) | lengthBytes[1];
+        if (length < 2) {
+            return false;
+        }
+
+        // SOF0..SOF15 except DHT (C4), JPG (C8) and DAC (CC)
+        bool startOfFrame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (startOfFrame) {
+            unsigned char frame[5];
+            if (!in.read(reinterpret_cast<char*>(frame), 5)) {
+                return false;
+            }
+            height = (frame[1] << 8) | frame[2];
+            width = (frame[3] << 8) | frame[4];
+            return width > 0 && height > 0;
+        }
+        in.seekg(length - 2, std::ios::cur);
+    }
+    return false;
+}
+
+// Decodes a colour image and scales it down to the given width, keeping the
+// aspect ratio. A width of 0, or one not smaller than the source, decodes at
+// full size. scale receives the output width over the source width. With
+// luma the result is the CV_8UC1 luminance; JPEG decoders then only decode
+// the Y component.
+inline cv::Mat imreadWithWidth(const std::string& path, int width, double& scale, bool luma = false) {
+    scale = 1.0;
+    const int fullFlags = luma ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR;
+    if (width <= 0) {
+        return cv::imread(path, fullFlags);
+    }
+
+    int sourceWidth = 0;
+    int sourceHeight = 0;
+    int flags = fullFlags;
+    if (jpegImageSize(path, sourceWidth, sourceHeight)) {
+        if (width >= sourceWidth) {
+            return cv::imread(path, fullFlags);
+        }
+        const int reductions[3] = {8, 4, 2};
+        const int reducedColorFlags[3] = {cv::IMREAD_REDUCED_COLOR_8, cv::IMREAD_REDUCED_COLOR_4, cv::IMREAD_REDUCED_COLOR_2};
+        const int reducedLumaFlags[3] = {cv::IMREAD_REDUCED_GRAYSCALE_8, cv::IMREAD_REDUCED_GRAYSCALE_4, cv::IMREAD_REDUCED_GRAYSCALE_2};
+        for (int i = 0; i < 3; ++i) {
+            if ((sourceWidth + reductions[i] - 1) / reductions[i] >= width) {
+                flags = luma ? reducedLumaFlags[i] : reducedColorFlags[i];
+                break;
+            }
+        }
+    }
+
+    cv::Mat decoded = cv::imread(path, flags);
+    if (decoded.empty()) {
+        return decoded;
+    }
+    if (sourceWidth == 0) {
+        sourceWidth = decoded.cols;
+        sourceHeight = decoded.rows;
+        if (width >= sourceWidth) {
+            return decoded;
+        }
+    } else if ((decoded.cols > decoded.rows) != (sourceWidth > sourceHeight)) {
+        // The EXIF orientation swapped the axes of the decoded image
+        std::swap(sourceWidth, sourceHeight);
+    }
+
+    scale = static_cast<double>(width) / sourceWidth;
+    cv::Size size(width, std::max(1, static_cast<int>(std::lround(sourceHeight * scale))));
+    if (decoded.size() == size) {
+        return decoded;
+    }
+    cv::Mat resized;
+    cv::resize(decoded, resized, size, 0, 0, cv::INTER_AREA);
+    return resized;
+}
+
+// Scales an odd window size (kernel or neighborhood) by scale, keeping it odd
+// and no smaller than 3 unless it already was
+inline int scaleWindowSize(int size, double scale) {
+    int scaled = static_cast<int>(std::lround(size * scale)) | 1;
+    return std::min(size, std::max(3, scaled));
+}
+
+#endif // SCALED_IMREAD_H
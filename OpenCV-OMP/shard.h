@@ -0,0 +1,151 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+// Multi-process sharding of row-parallel work.
+//
+// The coordinator maps the output images into POSIX shared memory segments and
+// forks one worker process per band of rows. Workers inherit the decoded input
+// copy-on-write and only read it, so it is shared without a copy; each worker
+// writes its band of the output straight into the shared segment, so once all
+// workers have exited the result is complete in place. Rows outside the band
+// that a filter reads (halos) come directly from the shared input.
+//
+// Workers are single threaded: a forked child must not enter OpenMP parallel
+// regions, since the parent's thread pool does not exist in the child. Run one
+// worker per core (or per cgroup slice) instead.
+
+#include <opencv2/opencv.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Image whose pixels live in a POSIX shared memory segment that survives fork.
+// The segment name is unlinked right after mapping, so nothing is left behind
+// in /dev/shm even if the process dies.
+class SharedImage {
+public:
+    SharedImage(int rows, int cols, int type) {
+        bytes_ = static_cast<size_t>(rows) * cols * CV_ELEM_SIZE(type);
+        std::string name = "/omp-shard-" + std::to_string(getpid()) + "-" + std::to_string(counter()++);
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("shm_open failed for " + name);
+        }
+        shm_unlink(name.c_str());
+        if (ftruncate(fd, bytes_) != 0) {
+            close(fd);
+            throw std::runtime_error("ftruncate failed for " + name);
+        }
+        data_ = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            throw std::runtime_error("mmap failed for " + name);
+        }
+        mat_ = cv::Mat(rows, cols, type, data_);
+    }
+
+    ~SharedImage() {
+        munmap(data_, bytes_);
+    }
+
+    SharedImage(const SharedImage&) = delete;
+    SharedImage& operator=(const SharedImage&) = delete;
+
+    // Header over the shared pixels; valid while this object lives
+    cv::Mat& mat() {
+        return mat_;
+    }
+
+private:
+    void* data_;
+    size_t bytes_;
+    cv::Mat mat_;
+
+    static int& counter() {
+        static int value = 0;
+        return value;
+    }
+};
+
+struct ShardTiming {
+    int rowBegin;
+    int rowEnd;
+    double seconds;
+    bool ok;
+};
+
+// Splits rows [0, rows) into `shards` bands and runs work(rowBegin, rowEnd) for
+// each band in its own forked process. Returns the wall time of every shard as
+// measured inside the worker; ok is false when a worker failed.
+inline std::vector<ShardTiming> runShards(int shards, int rows, const std::function<void(int, int)>& work) {
+    shards = std::max(1, std::min(shards, rows));
+    void* shared = mmap(nullptr, shards * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        throw std::runtime_error("mmap failed for shard timings");
+    }
+    double* seconds = static_cast<double*>(shared);
+
+    std::vector<ShardTiming> timings(shards);
+    std::vector<pid_t> workers(shards, -1);
+    for (int s = 0; s < shards; ++s) {
+        timings[s].rowBegin = static_cast<int>(static_cast<long long>(rows) * s / shards);
+        timings[s].rowEnd = static_cast<int>(static_cast<long long>(rows) * (s + 1) / shards);
+        timings[s].seconds = 0.0;
+        timings[s].ok = false;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            // OpenCV's own worker threads did not survive the fork either
+            cv::setNumThreads(0);
+            int status = 0;
+            try {
+                auto begin = std::chrono::steady_clock::now();
+                work(timings[s].rowBegin, timings[s].rowEnd);
+                seconds[s] = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            } catch (...) {
+                status = 1;
+            }
+            // Skip atexit handlers and static destructors of the parent's state
+            _exit(status);
+        }
+        workers[s] = pid;
+    }
+
+    for (int s = 0; s < shards; ++s) {
+        int status = 0;
+        if (workers[s] > 0 && waitpid(workers[s], &status, 0) == workers[s]) {
+            timings[s].ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            timings[s].seconds = seconds[s];
+        }
+    }
+    munmap(shared, shards * sizeof(double));
+    return timings;
+}
+
+inline bool allShardsOk(const std::vector<ShardTiming>& timings) {
+    for (const ShardTiming& timing : timings) {
+        if (!timing.ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void printShardTimings(const std::vector<ShardTiming>& timings, std::ostream& out) {
+    for (size_t s = 0; s < timings.size(); ++s) {
+        out << "Shard " << s << ": rows " << timings[s].rowBegin << "-" << timings[s].rowEnd << ", "
+            << timings[s].seconds << " s" << (timings[s].ok ? "" : " (failed)") << std::endl;
+    }
+}
+
+#endif // SHARD_H
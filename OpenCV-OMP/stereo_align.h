@@ -0,0 +1,211 @@
+#ifndef STEREO_ALIGN_H
+#define STEREO_ALIGN_H
+
+// Global alignment of the two views of a stereo pair.
+//
+// Both views are converted to luma pyramids (full resolution down to about 32
+// pixels wide). The shift is searched exhaustively on the coarsest level and
+// refined by +-1 pixel on every finer one, comparing the mean absolute
+// difference over the overlap of the two views. Row differences use SIMD sum
+// of absolute differences (SSE2 psadbw, NEON vabd). The result is applied as
+// a view offset: both views are cropped to their overlap, so no pixels move.
+//
+// A coarse disparity map can be computed on top: block matching of 16 x 16
+// blocks at half resolution, searched horizontally around the global shift.
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// right(x + dx, y + dy) shows the same point as left(x, y)
+struct StereoShift {
+    int dx;
+    int dy;
+};
+
+// Sum of absolute differences of two byte rows
+inline uint32_t rowSad(const uint8_t* a, const uint8_t* b, int n) {
+    uint32_t sum = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    sum = static_cast<uint32_t>(_mm_cvtsi128_si32(acc)) + static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#elif defined(__aarch64__)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= n; i += 16) {
+        acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+    }
+    sum = vaddvq_u32(acc);
+#endif
+    for (; i < n; ++i) {
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    }
+    return sum;
+}
+
+// Luma pyramid of a BGR (or already luma) image: level 0 is full resolution,
+// every further level halves both sides with a 2 x 2 box filter, down to about
+// minWidth pixels. OpenCV's vectorized conversion and area resampling do the
+// work; the full resolution conversion is most of the cost of the alignment.
+inline std::vector<cv::Mat> lumaPyramid(const cv::Mat& bgr, int minWidth) {
+    std::vector<cv::Mat> levels(1);
+    if (bgr.channels() == 1) {
+        levels[0] = bgr;
+    } else {
+        cv::cvtColor(bgr, levels[0], cv::COLOR_BGR2GRAY);
+    }
+    while (levels.back().cols / 2 >= minWidth && levels.back().rows / 2 >= 8) {
+        const cv::Mat& fine = levels.back();
+        cv::Mat coarse;
+        cv::resize(fine, coarse, cv::Size(fine.cols / 2, fine.rows / 2), 0, 0, cv::INTER_AREA);
+        levels.push_back(coarse);
+    }
+    return levels;
+}
+
+// Mean absolute difference between left and right shifted by (dx, dy) over
+// their overlap; UINT_MAX when the overlap is under half of the image
+inline uint32_t shiftCost(const cv::Mat& left, const cv::Mat& right, int dx, int dy) {
+    int x0 = std::max(0, -dx);
+    int x1 = std::min(left.cols, right.cols - dx);
+    int y0 = std::max(0, -dy);
+    int y1 = std::min(left.rows, right.rows - dy);
+    if (2 * (x1 - x0) < left.cols || 2 * (y1 - y0) < left.rows) {
+        return UINT_MAX;
+    }
+    uint64_t sum = 0;
+    for (int y = y0; y < y1; ++y) {
+        sum += rowSad(left.ptr<uint8_t>(y) + x0, right.ptr<uint8_t>(y + dy) + x0 + dx, x1 - x0);
+    }
+    // Fixed point with 8 fractional bits, so nearby candidates stay comparable
+    return static_cast<uint32_t>((sum << 8) / (static_cast<uint64_t>(x1 - x0) * (y1 - y0)));
+}
+
+// Estimates the global shift between two luma pyramids. The coarsest level is
+// searched over an eighth of its size in each direction.
+inline StereoShift estimateStereoShift(const std::vector<cv::Mat>& left, const std::vector<cv::Mat>& right) {
+    int top = static_cast<int>(std::min(left.size(), right.size())) - 1;
+    const cv::Mat& coarseLeft = left[top];
+    int radiusX = std::max(1, coarseLeft.cols / 8);
+    int radiusY = std::max(1, coarseLeft.rows / 8);
+
+    StereoShift best = {0, 0};
+    for (int level = top; level >= 0; --level) {
+        StereoShift center = {best.dx * 2, best.dy * 2};
+        int rx = level == top ? radiusX : 1;
+        int ry = level == top ? radiusY : 1;
+        if (level == top) {
+            center = {0, 0};
+        }
+
+        uint32_t bestCost = UINT_MAX;
+        for (int dy = center.dy - ry; dy <= center.dy + ry; ++dy) {
+            for (int dx = center.dx - rx; dx <= center.dx + rx; ++dx) {
+                uint32_t cost = shiftCost(left[level], right[level], dx, dy);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    best = {dx, dy};
+                }
+            }
+        }
+        if (bestCost == UINT_MAX) {
+            best = center;
+        }
+    }
+    return best;
+}
+
+// Crops both views to their overlap under the shift; both stay views into the
+// same pixels and end up the same size
+inline void applyStereoShift(cv::Mat& left, cv::Mat& right, StereoShift shift) {
+    int x0 = std::max(0, -shift.dx);
+    int x1 = std::min(left.cols, right.cols - shift.dx);
+    int y0 = std::max(0, -shift.dy);
+    int y1 = std::min(left.rows, right.rows - shift.dy);
+    if (x1 <= x0 || y1 <= y0) {
+        return;
+    }
+    right = right(cv::Rect(x0 + shift.dx, y0 + shift.dy, x1 - x0, y1 - y0));
+    left = left(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+}
+
+// Horizontal disparity of every 16 x 16 block of level 1 (half resolution)
+// relative to the global shift, searched over +-range pixels at that level.
+// The map has one CV_8UC1 value per block: 128 plus 4 per pixel of residual
+// disparity at that level.
+inline cv::Mat blockDisparity(const std::vector<cv::Mat>& left, const std::vector<cv::Mat>& right, StereoShift shift, int range) {
+    const int block = 16;
+    int level = std::min<int>(1, static_cast<int>(std::min(left.size(), right.size())) - 1);
+    const cv::Mat& l = left[level];
+    const cv::Mat& r = right[level];
+    int baseDx = shift.dx >> level;
+    int baseDy = shift.dy >> level;
+
+    cv::Mat disparity(l.rows / block, l.cols / block, CV_8UC1);
+    #pragma omp parallel for
+    for (int by = 0; by < disparity.rows; ++by) {
+        for (int bx = 0; bx < disparity.cols; ++bx) {
+            int x = bx * block;
+            int y = by * block;
+            uint32_t bestCost = UINT_MAX;
+            int bestDx = 0;
+            for (int d = -range; d <= range; ++d) {
+                int rx = x + baseDx + d;
+                int ry = y + baseDy;
+                if (rx < 0 || rx + block > r.cols || ry < 0 || ry + block > r.rows) {
+                    continue;
+                }
+                uint32_t cost = 0;
+                for (int i = 0; i < block; ++i) {
+                    cost += rowSad(l.ptr<uint8_t>(y + i) + x, r.ptr<uint8_t>(ry + i) + rx, block);
+                }
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestDx = d;
+                }
+            }
+            disparity.at<uint8_t>(by, bx) = cv::saturate_cast<uint8_t>(128 + 4 * bestDx);
+        }
+    }
+    return disparity;
+}
+
+// Estimates the shift between the two views and crops both to their overlap.
+// Without horizontal only the vertical shift is applied; the horizontal one is
+// still estimated, since the views rarely match without it.
+// disparity, when given, receives the coarse disparity map scaled up (nearest
+// neighbour) to the size of the left view before cropping; it stays empty
+// when the views are too small for a single block.
+inline StereoShift alignStereoViews(cv::Mat& left, cv::Mat& right, bool horizontal, cv::Mat* disparity) {
+    std::vector<cv::Mat> leftPyramid = lumaPyramid(left, 32);
+    std::vector<cv::Mat> rightPyramid = lumaPyramid(right, 32);
+    StereoShift shift = estimateStereoShift(leftPyramid, rightPyramid);
+    if (disparity) {
+        int level = std::min<int>(1, static_cast<int>(leftPyramid.size()) - 1);
+        cv::Mat blocks = blockDisparity(leftPyramid, rightPyramid, shift, std::max(4, leftPyramid[level].cols / 32));
+        if (!blocks.empty()) {
+            cv::resize(blocks, *disparity, left.size(), 0, 0, cv::INTER_NEAREST);
+        }
+    }
+    if (!horizontal) {
+        shift.dx = 0;
+    }
+    applyStereoShift(left, right, shift);
+    return shift;
+}
+
+#endif // STEREO_ALIGN_H
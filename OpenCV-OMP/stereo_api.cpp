@@ -0,0 +1,262 @@
+#include "stereo_api.h"
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <omp.h> // OpenMP header
+#include "anaglyph_lut.h"
+#include "covariance_denoise.h"
+
+namespace {
+
+// Coefficients in BGR order, as in 2.1.2. Rows are the output B, G, R
+// channels; columns are left B, G, R and right B, G, R.
+AnaglyphCoefficients anaglyphCoefficients(stereo_anaglyph_mode mode) {
+    switch (mode) {
+        case STEREO_ANAGLYPH_TRUE:
+            return {{{0, 0, 0, 0.114, 0.578, 0.299}, {0, 0, 0, 0, 0, 0}, {0.114, 0.578, 0.299, 0, 0, 0}}};
+        case STEREO_ANAGLYPH_GRAY:
+            return {{{0, 0, 0, 0.114, 0.578, 0.299}, {0, 0, 0, 0.114, 0.578, 0.299}, {0.114, 0.578, 0.299, 0, 0, 0}}};
+        case STEREO_ANAGLYPH_COLOR:
+            return {{{0, 0, 0, 0, 0, 1}, {0, 0, 0, 0, 1, 0}, {1, 0, 0, 0, 0, 0}}};
+        case STEREO_ANAGLYPH_HALF_COLOR:
+            return {{{0, 0, 0, 0.114, 0.578, 0.299}, {0, 0, 0, 0, 1, 0}, {1, 0, 0, 0, 0, 0}}};
+        case STEREO_ANAGLYPH_OPTIMIZED:
+            return {{{0, 0, 0, 0.3, 0.7, 0}, {0, 0, 0, 0, 1, 0}, {1, 0, 0, 0, 0, 0}}};
+        default:
+            return {{{1, 0, 0, 0, 0, 0}, {0, 1, 0, 0, 0, 0}, {0, 0, 1, 0, 0, 0}}};
+    }
+}
+
+// Channel c of a pixel in the given format holds BGR channel bgrChannel(c)
+int bgrChannel(stereo_pixel_format format, int c) {
+    return format == STEREO_FORMAT_RGB24 ? 2 - c : c;
+}
+
+bool validFormat(stereo_pixel_format format) {
+    return format == STEREO_FORMAT_BGR24 || format == STEREO_FORMAT_RGB24;
+}
+
+bool validImage(const stereo_image* image) {
+    return image && image->data && image->width > 0 && image->height > 0
+        && image->stride >= static_cast<size_t>(image->width) * 3;
+}
+
+bool sameSize(const stereo_image* a, const stereo_image* b) {
+    return a->width == b->width && a->height == b->height;
+}
+
+bool overlaps(const stereo_image* a, const stereo_image* b) {
+    const uint8_t* aBegin = static_cast<const uint8_t*>(a->data);
+    const uint8_t* bBegin = static_cast<const uint8_t*>(b->data);
+    const uint8_t* aEnd = aBegin + a->stride * (a->height - 1) + a->width * 3;
+    const uint8_t* bEnd = bBegin + b->stride * (b->height - 1) + b->width * 3;
+    return aBegin < bEnd && bBegin < aEnd;
+}
+
+uint8_t* row(const stereo_image* image, int y) {
+    return static_cast<uint8_t*>(image->data) + image->stride * y;
+}
+
+// Header over the caller's pixels; no allocation, no copy
+cv::Mat wrap(const stereo_image* image) {
+    return cv::Mat(image->height, image->width, CV_8UC3, image->data, image->stride);
+}
+
+// Runs body(rowBegin, rowEnd) over [0, rows) on the caller's pool or with
+// OpenMP. Exceptions must not cross the C boundary or leave a worker thread,
+// so they are caught per range and reported as a failure.
+template <typename Body>
+bool parallelRows(int rows, const stereo_thread_pool* pool, const Body& body) {
+    struct Job {
+        const Body* body;
+        std::atomic<bool> failed;
+    } job;
+    job.body = &body;
+    job.failed = false;
+
+    auto run = [](void* arg, int begin, int end) {
+        Job* current = static_cast<Job*>(arg);
+        try {
+            (*current->body)(begin, end);
+        } catch (...) {
+            current->failed = true;
+        }
+    };
+
+    if (pool && pool->parallel_for) {
+        pool->parallel_for(pool->context, rows, run, &job);
+    } else {
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < rows; ++y) {
+            run(&job, y, y + 1);
+        }
+    }
+    return !job.failed;
+}
+
+// Normalized 1D Gaussian of kernelSize taps, as the factor of the 2D kernel of
+// 2.1.2
+void generateKernel(double* kernel, int kernelSize, double sigma) {
+    int halfKernelSize = kernelSize / 2;
+    double rp = 1.0 / (2.0 * sigma * sigma);
+    for (int i = -halfKernelSize; i <= halfKernelSize; ++i) {
+        kernel[i + halfKernelSize] = exp(-(i * i) * rp);
+    }
+}
+
+// Separable blur of one output row: the vertical pass accumulates into a
+// per-thread float row, the horizontal pass reads it. Like 2.1.2, taps outside
+// the image are dropped and the remaining weights renormalized, which for a
+// separable kernel is the same as renormalizing the 2D kernel.
+void blurRow(const stereo_image* src, const stereo_image* dst, const double* kernel, int kernelSize, int y) {
+    const int halfKernelSize = kernelSize / 2;
+    const int width = src->width;
+
+    thread_local std::vector<float> column;
+    if (column.size() < static_cast<size_t>(width) * 3) {
+        column.resize(static_cast<size_t>(width) * 3);
+    }
+
+    int iBegin = std::max(-halfKernelSize, -y);
+    int iEnd = std::min(halfKernelSize, src->height - 1 - y);
+    double verticalTotal = 0.0;
+    for (int i = iBegin; i <= iEnd; ++i) {
+        verticalTotal += kernel[i + halfKernelSize];
+    }
+    std::fill(column.begin(), column.begin() + width * 3, 0.0f);
+    for (int i = iBegin; i <= iEnd; ++i) {
+        const uint8_t* in = row(src, y + i);
+        float weight = static_cast<float>(kernel[i + halfKernelSize] / verticalTotal);
+        for (int x = 0; x < width * 3; ++x) {
+            column[x] += weight * in[x];
+        }
+    }
+
+    uint8_t* out = row(dst, y);
+    for (int x = 0; x < width; ++x) {
+        int jBegin = std::max(-halfKernelSize, -x);
+        int jEnd = std::min(halfKernelSize, width - 1 - x);
+        double sum[3] = {0.0, 0.0, 0.0};
+        double total = 0.0;
+        for (int j = jBegin; j <= jEnd; ++j) {
+            double weight = kernel[j + halfKernelSize];
+            total += weight;
+            for (int c = 0; c < 3; ++c) {
+                sum[c] += weight * column[(x + j) * 3 + c];
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            out[x * 3 + c] = cv::saturate_cast<uchar>(sum[c] / total);
+        }
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+stereo_status stereo_anaglyph(const stereo_image* left, const stereo_image* right, const stereo_image* out,
+                              stereo_anaglyph_mode mode, const stereo_thread_pool* pool) {
+    if (!validImage(left) || !validImage(right) || !validImage(out) || !sameSize(left, right) || !sameSize(left, out)
+        || mode < STEREO_ANAGLYPH_NONE || mode > STEREO_ANAGLYPH_OPTIMIZED || overlaps(out, left) || overlaps(out, right)) {
+        return STEREO_INVALID_ARGUMENT;
+    }
+    if (!validFormat(left->format) || !validFormat(right->format) || !validFormat(out->format)) {
+        return STEREO_UNSUPPORTED_FORMAT;
+    }
+
+    try {
+        // Reorder the BGR coefficients to the formats at hand instead of
+        // converting pixels
+        AnaglyphCoefficients bgr = anaglyphCoefficients(mode);
+        AnaglyphCoefficients coefficients;
+        for (int c = 0; c < 3; ++c) {
+            for (int i = 0; i < 3; ++i) {
+                int outChannel = bgrChannel(out->format, c);
+                coefficients.coeff[c][i] = bgr.coeff[outChannel][bgrChannel(left->format, i)];
+                coefficients.coeff[c][3 + i] = bgr.coeff[outChannel][3 + bgrChannel(right->format, i)];
+            }
+        }
+        AnaglyphLut lut(coefficients);
+
+        bool ok = parallelRows(out->height, pool, [&](int rowBegin, int rowEnd) {
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                lut.mixRow(row(left, y), row(right, y), row(out, y), out->width);
+            }
+        });
+        return ok ? STEREO_OK : STEREO_INTERNAL_ERROR;
+    } catch (...) {
+        return STEREO_INTERNAL_ERROR;
+    }
+}
+
+stereo_status stereo_blur(const stereo_image* src, const stereo_image* dst, const stereo_blur_params* params,
+                          const stereo_thread_pool* pool) {
+    if (!validImage(src) || !validImage(dst) || !sameSize(src, dst) || !params || overlaps(src, dst)
+        || params->kernel_size < 1 || params->kernel_size > STEREO_MAX_KERNEL_SIZE || params->kernel_size % 2 == 0
+        || !(params->sigma > 0)) {
+        return STEREO_INVALID_ARGUMENT;
+    }
+    if (!validFormat(src->format) || src->format != dst->format) {
+        return STEREO_UNSUPPORTED_FORMAT;
+    }
+
+    try {
+        double kernel[STEREO_MAX_KERNEL_SIZE];
+        generateKernel(kernel, params->kernel_size, params->sigma);
+
+        bool ok = parallelRows(src->height, pool, [&](int rowBegin, int rowEnd) {
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                blurRow(src, dst, kernel, params->kernel_size, y);
+            }
+        });
+        return ok ? STEREO_OK : STEREO_INTERNAL_ERROR;
+    } catch (...) {
+        return STEREO_INTERNAL_ERROR;
+    }
+}
+
+stereo_status stereo_denoise(const stereo_image* src, const stereo_image* dst, const stereo_denoise_params* params,
+                             const stereo_thread_pool* pool) {
+    if (!validImage(src) || !validImage(dst) || !sameSize(src, dst) || !params || overlaps(src, dst)
+        || params->neighborhood_size < 3 || params->neighborhood_size % 2 == 0 || !(params->factor_ratio > 0)) {
+        return STEREO_INVALID_ARGUMENT;
+    }
+    if (!validFormat(src->format) || src->format != dst->format) {
+        return STEREO_UNSUPPORTED_FORMAT;
+    }
+
+    try {
+        // The determinant and the blur do not depend on the channel order
+        const cv::Mat source = wrap(src);
+        cv::Mat destination = wrap(dst);
+
+        bool ok = parallelRows(src->height, pool, [&](int rowBegin, int rowEnd) {
+            denoiseByCovarianceRows(source, destination, params->neighborhood_size, params->factor_ratio, rowBegin, rowEnd);
+        });
+        return ok ? STEREO_OK : STEREO_INTERNAL_ERROR;
+    } catch (...) {
+        return STEREO_INTERNAL_ERROR;
+    }
+}
+
+const char* stereo_status_string(stereo_status status) {
+    switch (status) {
+        case STEREO_OK:
+            return "ok";
+        case STEREO_INVALID_ARGUMENT:
+            return "invalid argument";
+        case STEREO_UNSUPPORTED_FORMAT:
+            return "unsupported pixel format";
+        case STEREO_INTERNAL_ERROR:
+            return "internal error";
+        default:
+            return "unknown status";
+    }
+}
+
+} // extern "C"
@@ -0,0 +1,101 @@
+#ifndef STEREO_API_H
+#define STEREO_API_H
+
+/*
+ * Embeddable C API for the anaglyph, Gaussian blur and covariance denoise
+ * filters.
+ *
+ * Every function works on caller-owned buffers described by stereo_image:
+ * pixels are read from and written to those buffers directly, so a decoder or
+ * camera frame can be processed without copying it. Outputs must be allocated
+ * by the caller with the size noted for each function and must not overlap
+ * the inputs.
+ *
+ * The functions keep no global mutable state and may be called concurrently
+ * from any number of threads. Work is split over rows with OpenMP unless a
+ * stereo_thread_pool is passed, in which case it is handed to the caller's
+ * pool instead. The anaglyph and blur paths do not allocate once each calling
+ * thread has processed its first frame of a given width.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    STEREO_OK = 0,
+    STEREO_INVALID_ARGUMENT,
+    STEREO_UNSUPPORTED_FORMAT,
+    STEREO_INTERNAL_ERROR
+} stereo_status;
+
+/* Interleaved 8-bit pixel layouts */
+typedef enum {
+    STEREO_FORMAT_BGR24 = 0,
+    STEREO_FORMAT_RGB24
+} stereo_pixel_format;
+
+typedef struct {
+    void* data;                  /* first pixel of the first row */
+    int width;                   /* pixels */
+    int height;                  /* rows */
+    size_t stride;               /* bytes from one row to the next */
+    stereo_pixel_format format;
+} stereo_image;
+
+typedef enum {
+    STEREO_ANAGLYPH_NONE = 0,
+    STEREO_ANAGLYPH_TRUE,
+    STEREO_ANAGLYPH_GRAY,
+    STEREO_ANAGLYPH_COLOR,
+    STEREO_ANAGLYPH_HALF_COLOR,
+    STEREO_ANAGLYPH_OPTIMIZED
+} stereo_anaglyph_mode;
+
+typedef struct {
+    int kernel_size;             /* odd, 1 to STEREO_MAX_KERNEL_SIZE */
+    double sigma;                /* > 0 */
+} stereo_blur_params;
+
+#define STEREO_MAX_KERNEL_SIZE 63
+
+typedef struct {
+    int neighborhood_size;       /* odd, >= 3 */
+    double factor_ratio;         /* > 0 */
+} stereo_denoise_params;
+
+/*
+ * Caller-supplied thread pool. parallel_for must call body(arg, begin, end)
+ * over disjoint ranges covering [0, count), possibly concurrently, and return
+ * once all calls have finished.
+ */
+typedef struct {
+    void (*parallel_for)(void* context, int count, void (*body)(void* arg, int begin, int end), void* arg);
+    void* context;
+} stereo_thread_pool;
+
+/*
+ * Mixes the left and right views into out. All three images must have the
+ * same width and height; out may use a different format than the inputs.
+ */
+stereo_status stereo_anaglyph(const stereo_image* left, const stereo_image* right, const stereo_image* out,
+                              stereo_anaglyph_mode mode, const stereo_thread_pool* pool);
+
+/* Gaussian blur of src into dst, which must have the same size and format */
+stereo_status stereo_blur(const stereo_image* src, const stereo_image* dst, const stereo_blur_params* params,
+                          const stereo_thread_pool* pool);
+
+/* Covariance-driven denoise of src into dst, which must have the same size and format */
+stereo_status stereo_denoise(const stereo_image* src, const stereo_image* dst, const stereo_denoise_params* params,
+                             const stereo_thread_pool* pool);
+
+/* Static description of a status code */
+const char* stereo_status_string(stereo_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STEREO_API_H */
@@ -0,0 +1,200 @@
+#ifndef TEMPORAL_DENOISE_H
+#define TEMPORAL_DENOISE_H
+
+// Recursive temporal denoise of video frames.
+//
+// Every pixel and channel keeps an exponentially weighted mean and variance of
+// its values over the frames. A new value x updates them in O(1):
+//
+//   d = x - mean,  mean += a * d,  variance = (1 - a) * (variance + a * d^2)
+//
+// with a = max(alpha, 1 / n) after n frames, so the first frames are averaged
+// evenly. The output is a Wiener blend of the mean and the new value: the
+// variance over time is the noise variance where the pixel is still and
+// larger where it changes, so the gain (variance - noise) / variance keeps
+// the mean where the scene is static and follows the input where it is not.
+//
+// The noise variance is the median over tiles of the mean squared difference
+// from the running mean, smoothed over frames. A tile whose mean squared
+// difference exceeds motionThreshold times the noise variance has moved: its
+// statistics restart from the current frame, so moving objects do not smear.
+// Each frame takes two passes over the tiles: one measures the error, the
+// other updates the statistics, vectorized along the rows of a tile.
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "trace.h"
+
+// Sum of (x - mean)^2 over count values. Sixteen fixed partial sums let the
+// loop vectorize while every variant adds in the same order.
+CPU_DISPATCH_INLINE void temporalErrorRowKernel(const uchar* in, const float* mean, int count, double* error) {
+    float lanes[16] = {};
+    int k = 0;
+    for (; k + 16 <= count; k += 16) {
+        for (int l = 0; l < 16; ++l) {
+            float d = in[k + l] - mean[k + l];
+            lanes[l] += d * d;
+        }
+    }
+    for (; k < count; ++k) {
+        float d = in[k] - mean[k];
+        lanes[0] += d * d;
+    }
+    float sum = 0.0f;
+    for (int l = 0; l < 16; ++l) {
+        sum += lanes[l];
+    }
+    *error += sum;
+}
+
+// Updates the statistics of count values with weight a and writes the
+// filtered values; a reset restarts them from the input
+CPU_DISPATCH_INLINE void temporalUpdateRowKernel(const uchar* in, float* mean, float* variance, uchar* out, int count, float a,
+                                                 float noise, bool reset) {
+    if (reset) {
+        for (int k = 0; k < count; ++k) {
+            mean[k] = in[k];
+            variance[k] = noise;
+            out[k] = in[k];
+        }
+        return;
+    }
+    for (int k = 0; k < count; ++k) {
+        float x = in[k];
+        float d = x - mean[k];
+        float m = mean[k] + a * d;
+        float v = (1.0f - a) * (variance[k] + a * d * d);
+        float gain = std::max(0.0f, 1.0f - noise / std::max(v, noise));
+        float y = m + gain * (x - m);
+        mean[k] = m;
+        variance[k] = v;
+        out[k] = static_cast<uchar>(std::min(255.0f, std::max(0.0f, y)) + 0.5f);
+    }
+}
+
+CPU_DISPATCH(temporalErrorRow, temporalErrorRowKernel, (const uchar* in, const float* mean, int count, double* error),
+             (in, mean, count, error))
+
+CPU_DISPATCH(temporalUpdateRow, temporalUpdateRowKernel,
+             (const uchar* in, float* mean, float* variance, uchar* out, int count, float a, float noise, bool reset),
+             (in, mean, variance, out, count, a, noise, reset))
+
+class TemporalDenoiser {
+public:
+    // alpha is the weight of a new frame once a tile has settled; tiles are
+    // tileSize x tileSize pixels
+    TemporalDenoiser(double alpha, double motionThreshold, int tileSize = 16)
+        : alpha_(alpha), motionThreshold_(motionThreshold), tileSize_(tileSize), noise_(0.0), frames_(0), resets_(0) {}
+
+    // Denoises frame (8-bit, any channel count) into dst, which is (re)created
+    // with its size and type. The first frame, and a frame of another size,
+    // start every tile anew.
+    void process(const cv::Mat& frame, cv::Mat& dst) {
+        TRACE_SCOPE("denoise.temporal");
+        dst.create(frame.size(), frame.type());
+        if (mean_.size() != frame.size() || mean_.channels() != frame.channels()) {
+            mean_.create(frame.size(), CV_32FC(frame.channels()));
+            variance_.create(frame.size(), CV_32FC(frame.channels()));
+            tilesX_ = (frame.cols + tileSize_ - 1) / tileSize_;
+            int tiles = tilesX_ * ((frame.rows + tileSize_ - 1) / tileSize_);
+            count_.assign(tiles, 0);
+            error_.assign(tiles, 0.0);
+            noise_ = 0.0;
+        }
+        const int tiles = static_cast<int>(count_.size());
+        const int channels = frame.channels();
+
+        // Mean squared difference from the running mean per tile
+        #pragma omp parallel for schedule(static)
+        for (int t = 0; t < tiles; ++t) {
+            cv::Rect rect = tileRect(t, frame.size());
+            double error = 0.0;
+            if (count_[t] > 0) {
+                for (int y = rect.y; y < rect.y + rect.height; ++y) {
+                    temporalErrorRow(frame.ptr<uchar>(y) + rect.x * channels, mean_.ptr<float>(y) + rect.x * channels,
+                                     rect.width * channels, &error);
+                }
+            }
+            error_[t] = error / (static_cast<double>(rect.area()) * channels);
+        }
+        updateNoise();
+
+        // Tiles with history whose error is out of proportion to the noise
+        // have moved and restart, as do tiles without history
+        long resets = 0;
+        #pragma omp parallel for schedule(static) reduction(+: resets)
+        for (int t = 0; t < tiles; ++t) {
+            cv::Rect rect = tileRect(t, frame.size());
+            bool reset = count_[t] == 0 || error_[t] > motionThreshold_ * noise_;
+            count_[t] = reset ? 1 : count_[t] + 1;
+            resets += reset ? 1 : 0;
+            float a = static_cast<float>(std::max(alpha_, 1.0 / count_[t]));
+            for (int y = rect.y; y < rect.y + rect.height; ++y) {
+                int offset = rect.x * channels;
+                temporalUpdateRow(frame.ptr<uchar>(y) + offset, mean_.ptr<float>(y) + offset, variance_.ptr<float>(y) + offset,
+                                  dst.ptr<uchar>(y) + offset, rect.width * channels, a, static_cast<float>(noise_), reset);
+            }
+        }
+        ++frames_;
+        resets_ += resets;
+    }
+
+    // Estimated standard deviation of the noise, in grey levels
+    double noiseSigma() const {
+        return std::sqrt(noise_);
+    }
+
+    // Share of tiles restarted per frame, the first frame included
+    double resetRate() const {
+        return frames_ > 0 ? static_cast<double>(resets_) / (static_cast<double>(frames_) * count_.size()) : 0.0;
+    }
+
+private:
+    cv::Rect tileRect(int t, cv::Size size) const {
+        int x = (t % tilesX_) * tileSize_;
+        int y = (t / tilesX_) * tileSize_;
+        return cv::Rect(x, y, std::min(tileSize_, size.width - x), std::min(tileSize_, size.height - y));
+    }
+
+    // The median error of the tiles with history is the noise variance while
+    // less than half the frame moves. It is smoothed over frames, and a
+    // median that more than doubles (a pan or a cut) leaves it unchanged, so
+    // that such frames reset their tiles instead of raising the noise floor.
+    void updateNoise() {
+        std::vector<double> errors;
+        for (size_t t = 0; t < count_.size(); ++t) {
+            if (count_[t] > 0) {
+                errors.push_back(error_[t]);
+            }
+        }
+        if (errors.empty()) {
+            return;
+        }
+        std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+        double median = std::max(errors[errors.size() / 2], 1.0);
+        if (noise_ == 0.0) {
+            noise_ = median;
+        } else if (median <= 2.0 * noise_) {
+            noise_ += 0.1 * (median - noise_);
+        }
+    }
+
+    double alpha_;
+    double motionThreshold_;
+    int tileSize_;
+    int tilesX_ = 0;
+    cv::Mat mean_;
+    cv::Mat variance_;
+    std::vector<int> count_;
+    std::vector<double> error_;
+    double noise_;
+    long frames_;
+    long resets_;
+};
+
+#endif // TEMPORAL_DENOISE_H
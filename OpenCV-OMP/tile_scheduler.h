@@ -0,0 +1,184 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+// Largest-first work stealing over tiles of uneven cost.
+//
+// The tiles are sorted by estimated cost and dealt out greedily, each to the
+// thread whose queue holds the least cost so far, so every thread starts with
+// about the same estimated work and with its largest tiles in front. A thread
+// takes tiles from the front of its own queue; once that is empty it steals
+// from the back of the other queues, where their smallest tiles are, so the
+// errors of the estimate are evened out with small pieces near the end.
+//
+// The scheduler runs inside a parallel region the caller opens, so callers
+// keep their per-thread trace spans and counters. Busy time (inside tiles)
+// and idle time (from the end of a thread's last tile to the end of the last
+// tile overall) are added to a ScheduleStats per thread.
+
+#include <opencv2/opencv.hpp>
+#include <omp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <ostream>
+#include <vector>
+
+struct ScheduledTile {
+    cv::Rect rect;
+    double cost;
+};
+
+// Busy and idle time of every thread over all scheduled runs
+class ScheduleStats {
+public:
+    struct Thread {
+        double busySeconds = 0;
+        double idleSeconds = 0;
+        long tasks = 0;
+        long stolen = 0;
+    };
+
+    void add(int thread, double busySeconds, double idleSeconds, long tasks, long stolen) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (thread >= static_cast<int>(threads_.size())) {
+            threads_.resize(thread + 1);
+        }
+        threads_[thread].busySeconds += busySeconds;
+        threads_[thread].idleSeconds += idleSeconds;
+        threads_[thread].tasks += tasks;
+        threads_[thread].stolen += stolen;
+    }
+
+    // One line per thread, then the busiest thread's busy time over the mean
+    // and the share of thread time spent idle
+    void print(std::ostream& out, const char* name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        double busy = 0;
+        double idle = 0;
+        double maxBusy = 0;
+        for (size_t t = 0; t < threads_.size(); ++t) {
+            out << "Thread " << t << ": busy " << threads_[t].busySeconds << " s, idle " << threads_[t].idleSeconds
+                << " s, " << threads_[t].tasks << " tasks (" << threads_[t].stolen << " stolen)" << std::endl;
+            busy += threads_[t].busySeconds;
+            idle += threads_[t].idleSeconds;
+            maxBusy = std::max(maxBusy, threads_[t].busySeconds);
+        }
+        if (busy > 0) {
+            out << name << ": busiest thread " << maxBusy * threads_.size() / busy << "x the mean busy time, "
+                << 100.0 * idle / (busy + idle) << "% of thread time idle" << std::endl;
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<Thread> threads_;
+};
+
+class TileScheduler {
+public:
+    TileScheduler(std::vector<ScheduledTile> tiles, int threads)
+        : tiles_(std::move(tiles)), threads_(std::max(1, threads)), queues_(new Queue[threads_]),
+          loads_(threads_), remaining_(static_cast<int>(tiles_.size())) {
+        std::vector<int> order(tiles_.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return tiles_[a].cost > tiles_[b].cost;
+        });
+        std::vector<double> queued(threads_, 0.0);
+        for (int tile : order) {
+            int least = static_cast<int>(std::min_element(queued.begin(), queued.end()) - queued.begin());
+            queues_[least].tiles.push_back(tile);
+            queued[least] += tiles_[tile].cost;
+        }
+    }
+
+    // Called by every thread of the region; runs body(rect) on tiles until
+    // none are left to take
+    void work(const std::function<void(const cv::Rect&)>& body) {
+        int self = omp_get_thread_num() % threads_;
+        Load& load = loads_[self];
+        load.start = Clock::now();
+        int tile;
+        bool stolen;
+        while (take(self, tile, stolen)) {
+            auto begin = Clock::now();
+            body(tiles_[tile].rect);
+            auto end = Clock::now();
+            load.busy += end - begin;
+            ++load.tasks;
+            load.stolen += stolen;
+            // The thread that finishes the last tile marks the end of the run
+            if (remaining_.fetch_sub(1) == 1) {
+                finish_ = end;
+            }
+        }
+        load.active = true;
+    }
+
+    // Adds the times of the threads that took part to stats; call after the
+    // parallel region
+    void report(ScheduleStats& stats) const {
+        for (int t = 0; t < threads_; ++t) {
+            const Load& load = loads_[t];
+            if (!load.active) {
+                continue;
+            }
+            double busy = std::chrono::duration<double>(load.busy).count();
+            double total = std::chrono::duration<double>(std::max(finish_, load.start) - load.start).count();
+            stats.add(t, busy, std::max(0.0, total - busy), load.tasks, load.stolen);
+        }
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> tiles;
+    };
+
+    // Padded so the threads' counters do not share cache lines
+    struct alignas(64) Load {
+        Clock::time_point start;
+        Clock::duration busy = Clock::duration::zero();
+        long tasks = 0;
+        long stolen = 0;
+        bool active = false;
+    };
+
+    // Own queue front first, then the back of the others in turn
+    bool take(int self, int& tile, bool& stolen) {
+        for (int i = 0; i < threads_; ++i) {
+            Queue& queue = queues_[(self + i) % threads_];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tiles.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                tile = queue.tiles.front();
+                queue.tiles.pop_front();
+            } else {
+                tile = queue.tiles.back();
+                queue.tiles.pop_back();
+            }
+            stolen = i != 0;
+            return true;
+        }
+        return false;
+    }
+
+    std::vector<ScheduledTile> tiles_;
+    int threads_;
+    std::unique_ptr<Queue[]> queues_;
+    std::vector<Load> loads_;
+    std::atomic<int> remaining_;
+    Clock::time_point finish_;
+};
+
+#endif // TILE_SCHEDULER_H
@@ -0,0 +1,135 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Lightweight scoped trace spans for the OpenMP tools.
+//
+// Every thread records its spans into its own buffer, so recording never takes
+// a lock. Buffers are linked into a global list the first time a thread traces
+// and are read back only by writeChromeTrace() once the parallel work is done.
+// When tracing is disabled a span costs a single relaxed atomic load.
+//
+// The output is Chrome trace-event JSON and can be opened in Perfetto
+// (https://ui.perfetto.dev) or chrome://tracing.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace trace {
+
+struct Event {
+    const char* name;   // must point to a string literal
+    int64_t begin_ns;
+    int64_t end_ns;
+};
+
+struct ThreadBuffer {
+    int tid;
+    std::vector<Event> events;
+    ThreadBuffer* next;
+};
+
+inline std::atomic<bool>& enabledFlag() {
+    static std::atomic<bool> flag(false);
+    return flag;
+}
+
+inline std::atomic<ThreadBuffer*>& bufferList() {
+    static std::atomic<ThreadBuffer*> head(nullptr);
+    return head;
+}
+
+inline std::atomic<int>& threadCounter() {
+    static std::atomic<int> counter(0);
+    return counter;
+}
+
+inline std::chrono::steady_clock::time_point origin() {
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return start;
+}
+
+inline int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin()).count();
+}
+
+// Buffers are never freed: OpenMP worker threads outlive the traced regions
+// and their spans must still be readable when the trace is written.
+inline ThreadBuffer* registerThread() {
+    ThreadBuffer* buffer = new ThreadBuffer();
+    buffer->tid = threadCounter().fetch_add(1, std::memory_order_relaxed);
+    buffer->events.reserve(4096);
+    buffer->next = bufferList().load(std::memory_order_relaxed);
+    while (!bufferList().compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return buffer;
+}
+
+inline ThreadBuffer& localBuffer() {
+    thread_local ThreadBuffer* buffer = registerThread();
+    return *buffer;
+}
+
+inline bool enabled() {
+    return enabledFlag().load(std::memory_order_relaxed);
+}
+
+inline void enable() {
+    origin();
+    localBuffer();  // the enabling thread becomes tid 0
+    enabledFlag().store(true, std::memory_order_relaxed);
+}
+
+class Scope {
+public:
+    explicit Scope(const char* name) : name_(name), begin_ns_(enabled() ? nowNs() : -1) {}
+
+    ~Scope() {
+        if (begin_ns_ >= 0) {
+            localBuffer().events.push_back(Event{name_, begin_ns_, nowNs()});
+        }
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char* name_;
+    int64_t begin_ns_;
+};
+
+// Writes every recorded span as a complete ("X") event. Must not be called
+// while other threads are still tracing.
+inline bool writeChromeTrace(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (ThreadBuffer* buffer = bufferList().load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"" << (buffer->tid == 0 ? "main" : "worker " + std::to_string(buffer->tid)) << "\"}}";
+        first = false;
+        for (const Event& event : buffer->events) {
+            out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                << ",\"ts\":" << event.begin_ns / 1000.0 << ",\"dur\":" << (event.end_ns - event.begin_ns) / 1000.0 << "}";
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+} // namespace trace
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif // TRACE_H